@@ -0,0 +1,109 @@
+#include <cstdlib>
+#include <new>
+#include "arena.h"
+
+//! Constructs an Arena.
+/*!
+ *  \param chunk_size Size of each chunk. Larger allocations get
+ *                    their own chunk.
+ */
+Arena::Arena(size_t chunk_size)
+	: mutex()
+	, chunks()
+	, head(nullptr)
+	, remaining(0)
+	, chunk_size(chunk_size)
+	, allocation_count(0)
+	, bytes_allocated(0)
+	, bytes_reserved(0)
+{
+}
+
+//! Destroys the Arena, releasing all memory at once.
+Arena::~Arena()
+{
+	for(auto && chunk : chunks)
+		std::free(chunk);
+}
+
+void* Arena::new_chunk(size_t size)
+{
+	void* chunk = std::malloc(size);
+	if(!chunk)
+		throw std::bad_alloc();
+	chunks.push_back(chunk);
+	bytes_reserved += size;
+	return chunk;
+}
+
+//! Allocate memory from the arena.
+/*!
+ *  \param size      Number of bytes.
+ *  \param alignment Alignment, must be a power of 2 and not larger than
+ *                   the alignment of std::max_align_t.
+ */
+void* Arena::allocate(size_t size, size_t alignment)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	allocation_count++;
+	bytes_allocated += size;
+
+	// Large allocations get their own chunk so the current one can be filled up.
+	if(size > chunk_size / 4)
+		return new_chunk(size);
+
+	size_t padding = (alignment - ((uintptr_t)head & (alignment - 1))) & (alignment - 1);
+	if(!head || padding + size > remaining)
+	{
+		head = static_cast<char*>(new_chunk(chunk_size));
+		remaining = chunk_size;
+		padding = 0;
+	}
+	void* ptr = head + padding;
+	head += padding + size;
+	remaining -= padding + size;
+	return ptr;
+}
+
+//! Return memory to the arena.
+/*!
+ *  The memory is only reused if it was the most recent allocation in the
+ *  current chunk, otherwise it is released when the arena is destroyed.
+ */
+void Arena::deallocate(void* ptr, size_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(head && static_cast<char*>(ptr) + size == head)
+	{
+		head -= size;
+		remaining += size;
+	}
+}
+
+//! Get the number of allocations made from the arena.
+unsigned long Arena::get_allocation_count() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return allocation_count;
+}
+
+//! Get the number of chunks allocated from the heap.
+unsigned long Arena::get_chunk_count() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return chunks.size();
+}
+
+//! Get the total number of bytes requested from the arena.
+size_t Arena::get_bytes_allocated() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return bytes_allocated;
+}
+
+//! Get the total number of bytes allocated from the heap.
+size_t Arena::get_bytes_reserved() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return bytes_reserved;
+}
@@ -0,0 +1,126 @@
+/*! \file src/arena.h
+ *  \brief Monotonic memory arena
+ *
+ *  \see Arena Arena_Allocator
+ */
+#ifndef ARENA_H
+#define ARENA_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <type_traits>
+
+//! Monotonic memory arena.
+/*!
+ *  Memory is handed out from large chunks and is only returned to the
+ *  heap when the Arena is destroyed. Objects sharing the lifetime of a
+ *  Song (mainly the event lists of its tracks) can then be freed at once,
+ *  instead of one by one.
+ *
+ *  Allocation is thread-safe.
+ *
+ *  \see Arena_Allocator
+ */
+class Arena
+{
+	public:
+		//! Default chunk size.
+		static const size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+		Arena(size_t chunk_size = DEFAULT_CHUNK_SIZE);
+		~Arena();
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		void* allocate(size_t size, size_t alignment);
+		void deallocate(void* ptr, size_t size);
+
+		unsigned long get_allocation_count() const;
+		unsigned long get_chunk_count() const;
+		size_t get_bytes_allocated() const;
+		size_t get_bytes_reserved() const;
+
+	private:
+		void* new_chunk(size_t size);
+
+		mutable std::mutex mutex;
+		std::vector<void*> chunks;
+		char* head;
+		size_t remaining;
+		size_t chunk_size;
+		unsigned long allocation_count;
+		size_t bytes_allocated;
+		size_t bytes_reserved;
+};
+
+//! Allocator that uses an Arena.
+/*!
+ *  If no Arena is set, the global heap is used, so containers using this
+ *  allocator behave like ordinary containers by default.
+ *
+ *  Copies of a container get an allocator without an Arena, so they can
+ *  safely outlive the Arena. Moved containers keep the Arena.
+ */
+template<class T>
+class Arena_Allocator
+{
+	public:
+		typedef T value_type;
+		typedef std::true_type propagate_on_container_move_assignment;
+		typedef std::true_type propagate_on_container_swap;
+
+		Arena_Allocator(Arena* arena = nullptr) noexcept
+			: arena(arena)
+		{
+		}
+
+		template<class U>
+		Arena_Allocator(const Arena_Allocator<U>& other) noexcept
+			: arena(other.get_arena())
+		{
+		}
+
+		T* allocate(std::size_t n)
+		{
+			if(arena)
+				return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		}
+
+		void deallocate(T* ptr, std::size_t n)
+		{
+			if(arena)
+				arena->deallocate(ptr, n * sizeof(T));
+			else
+				::operator delete(ptr);
+		}
+
+		Arena_Allocator select_on_container_copy_construction() const
+		{
+			return Arena_Allocator();
+		}
+
+		//! Get the Arena, or nullptr if the heap is used.
+		Arena* get_arena() const
+		{
+			return arena;
+		}
+
+	private:
+		Arena* arena;
+};
+
+template<class T, class U>
+inline bool operator==(const Arena_Allocator<T>& a, const Arena_Allocator<U>& b)
+{
+	return a.get_arena() == b.get_arena();
+}
+
+template<class T, class U>
+inline bool operator!=(const Arena_Allocator<T>& a, const Arena_Allocator<U>& b)
+{
+	return a.get_arena() != b.get_arena();
+}
+
+#endif
@@ -18,15 +18,32 @@ class Track;
 class Song;
 class Input;
 class InputRef;
+class Source_Map;
 class VGM_Writer;
 class VGM_Interface;
 class Player;
 class Driver;
 class Platform;
+class Cost_Model;
+class Track_Map;
+class Arena;
+class Tag_Map;
+struct Platform_Command;
+
+//! Compact reference to input data.
+/*!
+ *  Stored per event by Track, in a list parallel to the events, instead
+ *  of an InputRef. See Track::get_reference() and Source_Map.
+ */
+struct Source_Location
+{
+	//! Index of the line in the Source_Map. 0 if there is no reference.
+	uint32_t line;
+	//! Column number.
+	uint32_t column;
+};
 
 typedef std::vector<std::string> Tag;
-typedef std::map<std::string,Tag> Tag_Map;
-typedef std::map<uint16_t,Track> Track_Map;
 typedef std::shared_ptr<InputRef> InputRefPtr;
 
 #endif
@@ -1,6 +1,11 @@
 #include "input.h"
 #include "song.h"
+#include "mml_input.h"
+#include "midi_input.h"
+#include "platform/mds_input.h"
+#include "stringf.h"
 #include <cctype>
+#include <climits>
 #include <cstring>
 #include <cstdio>
 #include <iostream>
@@ -71,9 +76,140 @@ std::ostream& operator<<(std::ostream& os, const class InputRef& ref)
 
 //=============================================================================
 
+//! Creates a Source_Map.
+/*!
+ *  Line 0 is reserved for Events without a reference.
+ */
+Source_Map::Source_Map()
+	: files(1)
+	, texts(1, std::make_shared<std::string>())
+	, lines(1, {0, 0, 0, 0, 0})
+	, scratch_text(0)
+{
+}
+
+//! Get the ID of a file name, adding it if needed.
+uint16_t Source_Map::add_file(const std::string& filename)
+{
+	auto it = file_index.find(filename);
+	if(it != file_index.end())
+		return it->second;
+	uint16_t id = files.size();
+	files.push_back(filename);
+	file_index[filename] = id;
+	return id;
+}
+
+//! Add a text buffer that lines can refer to.
+/*!
+ *  The buffer is shared, not copied. It must not be modified
+ *  afterwards, except by appending.
+ */
+uint16_t Source_Map::add_text(std::shared_ptr<std::string> text)
+{
+	texts.push_back(text);
+	return texts.size() - 1;
+}
+
+//! Add a line that refers to a part of a text buffer.
+/*!
+ *  \return index of the line, to be used in a Source_Location.
+ */
+uint32_t Source_Map::add_line(uint16_t file, uint16_t text, unsigned int line_number, unsigned int start, unsigned int length)
+{
+	lines.push_back({file, text, line_number, start, length});
+	return lines.size() - 1;
+}
+
+//! Add a line, copying its contents.
+/*!
+ *  \return index of the line, to be used in a Source_Location.
+ */
+uint32_t Source_Map::add_line(uint16_t file, unsigned int line_number, const std::string& contents)
+{
+	auto& text = *texts[scratch_text];
+	unsigned int start = text.size();
+	text.append(contents);
+	return add_line(file, scratch_text, line_number, start, contents.size());
+}
+
+//! Create an InputRef from a Source_Location.
+/*!
+ *  \return nullptr if the location has no reference.
+ */
+std::shared_ptr<InputRef> Source_Map::get_reference(const Source_Location& location) const
+{
+	if(!location.line)
+		return nullptr;
+	auto& line = lines.at(location.line);
+	auto& text = *texts[line.text];
+	return std::make_shared<InputRef>(files[line.file], text.substr(line.start, line.length), line.line_number, location.column);
+}
+
+//=============================================================================
+
+File_Provider::~File_Provider()
+{
+}
+
+//! Read a file from the filesystem.
+std::shared_ptr<std::string> Disk_File_Provider::read_file(const std::string& filename)
+{
+	std::ifstream inputfile(filename, std::ios::binary);
+	if(!inputfile)
+		return nullptr;
+
+	auto text = std::make_shared<std::string>();
+	inputfile.seekg(0, std::ios::end);
+	auto size = inputfile.tellg();
+	inputfile.seekg(0, std::ios::beg);
+	if(size > 0)
+	{
+		text->resize(size);
+		if(!inputfile.read(&(*text)[0], size))
+			return nullptr;
+	}
+	return text;
+}
+
+//! Creates an empty Memory_File_Provider.
+Memory_File_Provider::Memory_File_Provider()
+	: files()
+{
+}
+
+//! Add or replace a file.
+void Memory_File_Provider::add_file(const std::string& filename, std::string contents)
+{
+	files[filename] = std::make_shared<std::string>(std::move(contents));
+}
+
+//! Get the buffer of a file.
+/*!
+ *  \return nullptr if the file has not been added.
+ */
+std::shared_ptr<std::string> Memory_File_Provider::read_file(const std::string& filename)
+{
+	auto it = files.find(filename);
+	if(it == files.end())
+		return nullptr;
+	return it->second;
+}
+
+//=============================================================================
+
 //! Creates an Input.
+/*!
+ *  Files are read from the filesystem unless another File_Provider
+ *  is set.
+ */
 Input::Input(Song* song)
-	: song(song), filename("")
+	: song(song)
+	, filename("")
+	, file_id(0)
+	, file_provider(std::make_shared<Disk_File_Provider>())
+	, file_text(nullptr)
+	, include_depth(0)
 {
 }
 
@@ -91,12 +227,127 @@ Input::~Input()
 void Input::open_file(const std::string& fn)
 {
 	int path_break = fn.find_last_of("/\\");
-	if(path_break != -1)
+	if(path_break != -1 && song)
 		song->add_tag("include_path", fn.substr(0, path_break + 1));
 	filename = fn;
+	file_id = 0;
 	parse_file();
 }
 
+//! Get the appropriate Input for a file, based on the file name.
+/*!
+ *  Files with the `.mid`, `.midi` or `.smf` extension are read by
+ *  MIDI_Input, files with the `.mds` extension by MDS_Input, and all
+ *  other files by MML_Input.
+ *
+ *  \param song     Song to add the contents of the file to.
+ *  \param filename File name. The file is not opened.
+ *  \param jobs     Number of threads, for formats that support it.
+ */
+std::shared_ptr<Input> Input::get_input(Song* song, const std::string& filename, unsigned int jobs)
+{
+	auto extension_start = filename.find_last_of(".");
+	std::string extension = "";
+	if(extension_start != std::string::npos && filename.find_first_of("/\\", extension_start) == std::string::npos)
+		extension = filename.substr(extension_start);
+	if(iequal(extension, ".mid") || iequal(extension, ".midi") || iequal(extension, ".smf"))
+		return std::make_shared<MIDI_Input>(song);
+	if(iequal(extension, ".mds"))
+		return std::make_shared<MDS_Input>(song);
+	return std::make_shared<MML_Input>(song, jobs);
+}
+
+//! Parse a file from a buffer.
+/*!
+ *  Same as open_file(), except that the contents of the file are given
+ *  instead of read with the File_Provider. Included files are still
+ *  read with the File_Provider.
+ *
+ *  \param fn   File name, used in references and to find included files.
+ *  \param text Contents of the file.
+ *  \exception InputError in case of a parse error.
+ */
+void Input::open_buffer(const std::string& fn, std::string text)
+{
+	file_text = std::make_shared<std::string>(std::move(text));
+	try
+	{
+		open_file(fn);
+	}
+	catch(...)
+	{
+		file_text = nullptr;
+		throw;
+	}
+	file_text = nullptr;
+}
+
+//! Set the File_Provider used to read input files.
+void Input::set_file_provider(std::shared_ptr<File_Provider> provider)
+{
+	file_provider = provider;
+}
+
+//! Get the number of nested include_file() calls.
+unsigned int Input::get_include_depth() const
+{
+	return include_depth;
+}
+
+//! Read the contents of the current file.
+/*!
+ *  \exception InputError if the file could not be read.
+ */
+std::shared_ptr<std::string> Input::read_file()
+{
+	std::shared_ptr<std::string> text = nullptr;
+	if(file_text)
+		text.swap(file_text);
+	else
+		text = file_provider->read_file(filename);
+	if(!text)
+		parse_error("failed to open file");
+	return text;
+}
+
+//! Parse another file, then continue with the current file.
+/*!
+ *  Relative paths are resolved from the directory of the current file.
+ *
+ *  \exception InputError in case of a read or parse error.
+ */
+void Input::include_file(const std::string fn)
+{
+	if(include_depth >= MAX_INCLUDE_DEPTH)
+		parse_error("too many nested include files");
+
+	std::string path = fn;
+	int path_break = filename.find_last_of("/\\");
+	bool absolute = (fn.size() > 0 && (fn[0] == '/' || fn[0] == '\\')) || (fn.size() > 1 && fn[1] == ':');
+	if(path_break != -1 && !absolute)
+		path = filename.substr(0, path_break + 1) + fn;
+
+	std::string previous_filename = filename;
+	uint16_t previous_file_id = file_id;
+	filename = path;
+	file_id = 0;
+	include_depth++;
+	try
+	{
+		parse_file();
+	}
+	catch(...)
+	{
+		include_depth--;
+		filename = previous_filename;
+		file_id = previous_file_id;
+		throw;
+	}
+	include_depth--;
+	filename = previous_filename;
+	file_id = previous_file_id;
+}
+
 //! Get the target Song object
 Song& Input::get_song()
 {
@@ -120,6 +371,25 @@ std::shared_ptr<InputRef> Input::get_reference()
 	return std::make_shared<InputRef>(r);
 }
 
+//! Get the Source_Map of the target Song.
+/*!
+ *  \return nullptr if there is no target Song.
+ */
+Source_Map* Input::get_source_map()
+{
+	if(!song)
+		return nullptr;
+	return &song->get_source_map();
+}
+
+//! Get the file ID of the current file in the Source_Map.
+uint16_t Input::get_file_id()
+{
+	if(!file_id && song)
+		file_id = song->get_source_map().add_file(filename);
+	return file_id;
+}
+
 //! Throw an InputError.
 void Input::parse_error(const char* msg)
 {
@@ -128,26 +398,38 @@ void Input::parse_error(const char* msg)
 
 //! Raise a parse warning.
 /*!
+ *  The warning is written to std::cerr.
+ *
  *  \todo this should be added to a warning buffer...
  */
 void Input::parse_warning(const char* msg)
 {
-	std::cerr << *get_reference() << ": " << msg << "\n";
-	std::cerr << get_reference()->get_line_contents() << std::endl;
+	write_warning(std::cerr, msg);
+}
+
+//! Write a parse warning with the current reference to a stream.
+void Input::write_warning(std::ostream& os, const char* msg)
+{
+	os << *get_reference() << ": " << msg << "\n";
+	os << get_reference()->get_line_contents() << std::endl;
 }
 
 //=============================================================================
 
 //! Creates a Line_Buffer
 Line_Buffer::Line_Buffer(std::string line, unsigned int column)
-	: column(column)
+	: buffer(std::make_shared<std::string>(line))
+	, line_start(0)
+	, line_length(buffer->size())
+	, column(column)
 {
-	buffer = std::make_shared<std::string>(line);
 }
 
 //! Duplicates a Line_Buffer
 Line_Buffer::Line_Buffer(const class Line_Buffer& original)
 	: buffer(original.buffer)
+	, line_start(original.line_start)
+	, line_length(original.line_length)
 	, column(original.column)
 {
 }
@@ -166,12 +448,12 @@ Line_Buffer::~Line_Buffer()
  */
 int Line_Buffer::get()
 {
-	if(column >= buffer->size())
+	if(column >= line_length)
 	{
 		column++;
 		return 0;
 	}
-	return (*buffer)[column++];
+	return (*buffer)[line_start + column++];
 }
 
 //! Get the next non-blank character from the buffer.
@@ -196,27 +478,86 @@ int Line_Buffer::get_token()
  */
 int Line_Buffer::get_num()
 {
-	int base = 10;
+	int value;
+	if(!read_num(value))
+		throw std::invalid_argument("expected number");
+	return value;
+}
+
+//! Get the value of a digit, or 36 if the character is not a digit.
+static inline unsigned int digit_value(int c)
+{
+	if((unsigned int)(c - '0') < 10)
+		return c - '0';
+	c |= 0x20; // lower case
+	if((unsigned int)(c - 'a') < 26)
+		return c - 'a' + 10;
+	return 36;
+}
+
+//! Read a number from the buffer, if there is one.
+/*!
+ *  Same as get_num(), except that false is returned instead of throwing
+ *  an exception if no number could be read. Since optional parameters
+ *  are common in MML, this is what parsers should normally use.
+ *
+ *  The number is scanned directly from the line buffer and accepts the
+ *  same syntax as strtol(), except that it can't cross the end of the
+ *  line.
+ *
+ *  \param value Set to the number if one was read.
+ *  \return true if a number was read.
+ */
+bool Line_Buffer::read_num(int& value)
+{
+	unsigned int base = 10;
 	int c = get_token();
 	if(c == '$' || c == 'x')
 		base = 16;
 	else
 		unget(c);
-	if(column == buffer->size())
-		throw std::invalid_argument("expected number");
-	const char* ptr = buffer->c_str() + column;
-	const char* endptr = ptr;
-	int ret = strtol(ptr, (char**)&endptr, base);
-	if(ptr == endptr)
-		throw std::invalid_argument("expected number");
-	column += endptr - ptr;
-	return ret;
+	if(column >= line_length)
+		return false;
+
+	const char* start = buffer->data() + line_start;
+	const char* end = start + line_length;
+	const char* ptr = start + column;
+	while(ptr < end && std::isspace((unsigned char)*ptr))
+		ptr++;
+	bool negative = false;
+	if(ptr < end && (*ptr == '-' || *ptr == '+'))
+		negative = (*ptr++ == '-');
+	if(base == 16 && end - ptr > 2 && ptr[0] == '0' && (ptr[1] | 0x20) == 'x'
+		&& digit_value(ptr[2]) < 16)
+		ptr += 2;
+
+	// Saturate like strtol() does
+	const unsigned long limit = (unsigned long)LONG_MAX + negative;
+	const char* digits = ptr;
+	unsigned long number = 0;
+	bool overflow = false;
+	for(unsigned int digit; ptr < end && (digit = digit_value(*ptr)) < base; ptr++)
+	{
+		if(number > (limit - digit) / base)
+			overflow = true;
+		else
+			number = number * base + digit;
+	}
+	if(ptr == digits)
+		return false;
+	if(overflow)
+		number = limit;
+	column = ptr - start;
+	value = negative ? -(long)(number - 1) - 1 : (long)number;
+	return true;
 }
 
 //! Return a substring starting from the current position.
 std::string Line_Buffer::get_line()
 {
-	return std::string(*buffer, column);
+	if(column > line_length)
+		throw std::out_of_range("get_line");
+	return std::string(*buffer, line_start + column, line_length - column);
 }
 
 //! Put back the character to the buffer, decrementing the buffer position.
@@ -233,12 +574,11 @@ void Line_Buffer::unget(int c)
 {
 	if(column == 0)
 		throw std::out_of_range("unget too many");
-	if(c == 0)
-	{
-		column--;
-		return;
-	}
-	(*buffer)[--column] = c;
+	column--;
+	// Only write if the character was changed, since the buffer may be
+	// shared with other threads. See MML_Input::parse_file().
+	if(c != 0 && (*buffer)[line_start + column] != (char)c)
+		(*buffer)[line_start + column] = c;
 }
 
 //! Get current buffer position.
@@ -257,15 +597,35 @@ void Line_Buffer::seek(unsigned long pos)
 void Line_Buffer::set_buffer(std::string line, unsigned int new_column)
 {
 	buffer = std::make_shared<std::string>(line);
+	line_start = 0;
+	line_length = buffer->size();
 	if(new_column >= 0)
 		column = new_column;
 }
 
+//! Set the current line to a part of a shared buffer and reset the position.
+/*!
+ *  The buffer is not copied.
+ */
+void Line_Buffer::set_buffer(std::shared_ptr<std::string> text, unsigned int start, unsigned int length)
+{
+	buffer = text;
+	line_start = start;
+	line_length = length;
+	column = 0;
+}
+
+//! Return a copy of the current line.
+std::string Line_Buffer::get_line_contents() const
+{
+	return std::string(*buffer, line_start, line_length);
+}
+
 //=============================================================================
 
 //! Creates a Line_Input.
 Line_Input::Line_Input(Song* song)
-	: Input(song), Line_Buffer("", 0), line(0)
+	: Input(song), Line_Buffer("", 0), line(0), line_index(0)
 {
 }
 
@@ -274,26 +634,91 @@ Line_Input::~Line_Input()
 }
 
 //! Open file and parse lines.
+/*!
+ *  The whole file is read into the buffer at once, then each line is
+ *  parsed in place. Line breaks may be either LF or CR LF.
+ *
+ *  If this is an included file, the current line and position are
+ *  restored afterwards, so that parsing can continue after it.
+ */
 void Line_Input::parse_file()
 {
-	std::ifstream inputfile = std::ifstream(get_filename());
-	buffer = std::make_shared<std::string>("");
-	if(!inputfile)
-		parse_error("failed to open file");
+	Line_Buffer previous_buffer(*this);
+	unsigned int previous_line = line;
+	uint32_t previous_index = line_index;
+
+	auto text = read_file();
+	auto map = get_source_map();
+	uint16_t text_id = map ? map->add_text(text) : 0;
+
 	line = 0;
-	for(std::string str; std::getline(inputfile, str);)
+	unsigned int start = 0;
+	while(start < text->size())
 	{
-		read_line(str);
+		std::string::size_type end = text->find('\n', start);
+		if(end == std::string::npos)
+			end = text->size();
+		unsigned int length = end - start;
+		if(length && (*text)[end - 1] == '\r')
+			length--;
+		set_buffer(text, start, length);
+		if(map)
+			line_index = map->add_line(get_file_id(), text_id, line, start, length);
+		parse_line();
+		start = end + 1;
 		line++;
 	}
+
+	if(get_include_depth())
+	{
+		static_cast<Line_Buffer&>(*this) = previous_buffer;
+		line = previous_line;
+		line_index = previous_index;
+	}
 }
 
+//! Get an InputRef to the current line and column.
+/*!
+ *  If the line has been added to the Source_Map, the file name is
+ *  taken from there, as it may differ from the current file when
+ *  fragments are parsed by MML_Input.
+ */
 std::shared_ptr<InputRef> Line_Input::get_reference()
 {
-	InputRef r = InputRef(get_filename(), *buffer, line, column);
+	if(line_index)
+	{
+		if(auto map = get_source_map())
+			return map->get_reference(get_location());
+	}
+	InputRef r = InputRef(get_filename(), get_line_contents(), line, column);
 	return std::make_shared<InputRef>(r);
 }
 
+//! Get the line number of the current line.
+unsigned int Line_Input::get_line_number() const
+{
+	return line;
+}
+
+//! Set the line number and the Source_Map line index of the current line.
+/*!
+ *  Used to return to a line after it has been read with parse_file().
+ */
+void Line_Input::set_line(unsigned int line_number, uint32_t index)
+{
+	line = line_number;
+	line_index = index;
+}
+
+//! Get the Source_Location of the current line and column.
+/*!
+ *  This is stored in Events instead of a full InputRef.
+ */
+Source_Location Line_Input::get_location()
+{
+	return {line_index, column};
+}
+
 //! Read a single input line and parse it.
 /*!
  *  Optionally also set the line number.
@@ -302,7 +727,8 @@ void Line_Input::read_line(const std::string& input_line, int line_number)
 {
 	if (line_number >= 0)
 		line = line_number;
-	column = 0;
-	buffer = std::make_shared<std::string>(input_line);
+	set_buffer(input_line);
+	if(auto map = get_source_map())
+		line_index = map->add_line(get_file_id(), line, input_line);
 	parse_line();
 }
@@ -8,6 +8,8 @@
 #include <ostream>
 #include <fstream>
 #include <string>
+#include <map>
+#include <memory>
 #include "core.h"
 
 //! Exception class for input file errors
@@ -59,6 +61,92 @@ class InputRef
 
 std::ostream& operator<<(std::ostream& os, const class InputRef& ref);
 
+//! Table of input files and lines.
+/*!
+ *  Events refer to their input line using a Source_Location, which is an
+ *  index to the line table. The file name and line contents are only
+ *  looked up when an InputRef is requested, for example to create an
+ *  InputError.
+ *
+ *  File names are interned. Line contents are kept as views into shared
+ *  text buffers, so lines from a file read by Line_Input are not copied.
+ */
+class Source_Map
+{
+	friend class Song_Cache;
+	public:
+		Source_Map();
+
+		uint16_t add_file(const std::string& filename);
+		uint16_t add_text(std::shared_ptr<std::string> text);
+		uint32_t add_line(uint16_t file, uint16_t text, unsigned int line_number, unsigned int start, unsigned int length);
+		uint32_t add_line(uint16_t file, unsigned int line_number, const std::string& contents);
+
+		std::shared_ptr<InputRef> get_reference(const Source_Location& location) const;
+
+	private:
+		struct Line
+		{
+			uint16_t file;
+			uint16_t text;
+			uint32_t line_number;
+			uint32_t start;
+			uint32_t length;
+		};
+
+		std::vector<std::string> files;
+		std::map<std::string, uint16_t> file_index;
+		std::vector<std::shared_ptr<std::string>> texts;
+		std::vector<Line> lines;
+		uint16_t scratch_text; // used by add_line() for copied lines
+};
+
+//! Interface for reading input files.
+/*!
+ *  Input reads files through a File_Provider, so that songs can be
+ *  parsed from memory without using the filesystem.
+ *
+ *  \see Input::set_file_provider()
+ */
+class File_Provider
+{
+	public:
+		virtual ~File_Provider();
+
+		//! Read the contents of a file.
+		/*!
+		 *  The returned buffer may be shared and must not be modified.
+		 *
+		 *  \return nullptr if the file could not be read.
+		 */
+		virtual std::shared_ptr<std::string> read_file(const std::string& filename) = 0;
+};
+
+//! Reads input files from the filesystem.
+class Disk_File_Provider : public File_Provider
+{
+	public:
+		std::shared_ptr<std::string> read_file(const std::string& filename) override;
+};
+
+//! Reads input files from named buffers.
+/*!
+ *  Buffers are shared with the parser instead of copied, so the same
+ *  files can be parsed many times. read_file() may be called from
+ *  several threads, as long as no files are added at the same time.
+ */
+class Memory_File_Provider : public File_Provider
+{
+	public:
+		Memory_File_Provider();
+
+		void add_file(const std::string& filename, std::string contents);
+		std::shared_ptr<std::string> read_file(const std::string& filename) override;
+
+	private:
+		std::map<std::string, std::shared_ptr<std::string>> files;
+};
+
 //! Abstract input file format class.
 /*!
  *  The general purpose of this class (and derived) is to convert
@@ -67,36 +155,66 @@ std::ostream& operator<<(std::ostream& os, const class InputRef& ref);
  *  A binary file format might inherit directly from the Input class.
  *  Text-based formats such as MML can use Line_Input that provides
  *  helper functions for reading text lines.
+ *
+ *  Inputs can be moved but not copied, since they refer to a Song and
+ *  hold parser state. Derived classes may use the protected copy
+ *  constructor to clone a parser.
  */
 class Input
 {
 	public:
 		Input(Song* song);
+		Input(Input&& other) = default;
+		Input& operator=(const Input& other) = delete;
+		Input& operator=(Input&& other) = default;
 		virtual ~Input();
 
 		void open_file(const std::string& filename);
-		static Input& get_input(const std::string& filename); // Get appropriate input type based on the filename
+		void open_buffer(const std::string& filename, std::string text);
+		void set_file_provider(std::shared_ptr<File_Provider> provider);
+		static std::shared_ptr<Input> get_input(Song* song, const std::string& filename, unsigned int jobs = 1);
 
 	protected:
+		Input(const Input& other) = default; // for cloning parsers
+
 		Song& get_song();
 		const std::string& get_filename();
 		virtual std::shared_ptr<InputRef> get_reference();
+		Source_Map* get_source_map();
+		uint16_t get_file_id();
 
 		void parse_error(const char* msg);
-		void parse_warning(const char* msg);
+		virtual void parse_warning(const char* msg);
+		void write_warning(std::ostream& os, const char* msg);
 		void include_file(const std::string filename);
+		std::shared_ptr<std::string> read_file();
+		unsigned int get_include_depth() const;
 
 		//! Used by derived classes to open and parse a file.
+		/*!
+		 *  The contents of the file should be read with read_file().
+		 */
 		virtual void parse_file() = 0;
 
 	private:
+		//! Maximum include_file() nesting.
+		static const unsigned int MAX_INCLUDE_DEPTH = 16;
+
 		Song* song;
 		std::string filename;
+		uint16_t file_id;
+		std::shared_ptr<File_Provider> file_provider;
+		std::shared_ptr<std::string> file_text; // set by open_buffer()
+		unsigned int include_depth;
 };
 
 //! Line buffer interface
 /*!
  *  This provides a stdio-style interface to a buffer as if it was a file.
+ *
+ *  The current line is a view into the buffer, which may hold an entire
+ *  file. Positions returned by tell() are relative to the start of the
+ *  line.
  */
 class Line_Buffer
 {
@@ -110,22 +228,28 @@ class Line_Buffer
 		int get();
 		int get_token();
 		int get_num();
+		bool read_num(int& value);
 		std::string get_line();
 		void unget(int c = 0);
 		unsigned long tell();
 		void seek(unsigned long pos);
 
 	protected:
-		std::shared_ptr<std::string> buffer; // current line used by get/unget functions, etc.
+		std::shared_ptr<std::string> buffer; // text containing the current line used by get/unget functions, etc.
 		void set_buffer(std::string line, unsigned int new_column = 0);
+		void set_buffer(std::shared_ptr<std::string> text, unsigned int start, unsigned int length);
+		std::string get_line_contents() const;
 
+		unsigned int line_start; // offset of the current line in the buffer
+		unsigned int line_length;
 		unsigned int column;
 };
 
 //! Abstract class for text line-based input formats (such as MML)
 /*!
  *  Reads the input files, one line at a time, parsing them using
- *  the virtual function parse_line().
+ *  the virtual function parse_line(). The file is read into a single
+ *  buffer, and each line is parsed in place without being copied.
  *
  *  To help with parsing, a C stdio-style interface to lines of texts
  *  is provided. (see Line_Buffer)
@@ -140,20 +264,28 @@ class Line_Input: public Input, protected Line_Buffer
 
 	public:
 		Line_Input(Song* song);
+		Line_Input(Line_Input&& other) = default;
+		Line_Input& operator=(Line_Input&& other) = default;
 		virtual ~Line_Input();
 
 		void read_line(const std::string& input_line, int line_number = -1);
 
 	protected:
+		Line_Input(const Line_Input& other) = default;
+
 		std::shared_ptr<InputRef> get_reference();
+		Source_Location get_location();
+		unsigned int get_line_number() const;
+		void set_line(unsigned int line_number, uint32_t index);
 
 		//! Used by derived classes to read the input lines.
 		virtual void parse_line() = 0;
 
-	private:
 		void parse_file();
 
+	private:
 		unsigned int line;
+		uint32_t line_index; // current line in the Source_Map
 };
 
 #endif
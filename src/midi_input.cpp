@@ -0,0 +1,307 @@
+#include <cmath>
+#include <map>
+#include <algorithm>
+#include "midi_input.h"
+#include "song.h"
+
+const char* const MIDI_Input::DEFAULT_CHANNEL_MAP = "ABCDEFGHIJ";
+
+//! Constructs a MIDI_Input.
+/*!
+ *  \param song        Song to add tracks to.
+ *  \param channel_map Song track for each MIDI channel, using the MML
+ *                     track names (A-Z, 0-9). Channels that are not in
+ *                     the map or mapped to any other character are
+ *                     ignored.
+ */
+MIDI_Input::MIDI_Input(Song* song, const std::string& channel_map)
+	: Input(song)
+	, channel_map(channel_map)
+	, data(nullptr)
+	, position(0)
+	, division(0)
+{
+}
+
+MIDI_Input::~MIDI_Input()
+{
+}
+
+//! Convert MIDI volume to fine volume (FM total level).
+int MIDI_Input::volume_to_mdsdrv(int volume)
+{
+	if(volume <= 0)
+		return 127;
+	int value = ((-40 * std::log10(volume / 127.0)) / 0.75) + 0.5;
+	return std::min(value, 127);
+}
+
+//! Convert MIDI panning to FM panning.
+int MIDI_Input::pan_to_mdsdrv(int pan)
+{
+	if(pan < 64)
+		return 2;
+	else if(pan == 64)
+		return 3;
+	else
+		return 1;
+}
+
+//! Get the Event::NOTE parameter of a note on message.
+/*!
+ *  The default converts MIDI note 60 to `o4c`.
+ */
+int MIDI_Input::convert_note(const Message& message)
+{
+	return message.data1 - 24;
+}
+
+//! Convert a program change message.
+/*!
+ *  The default sets the instrument to the program number.
+ */
+void MIDI_Input::convert_program_change(Track& track, const Message& message)
+{
+	track.add_event(Event::INS, message.data1);
+}
+
+//! Convert a control change message.
+/*!
+ *  The default converts channel volume to fine volume and panning to
+ *  FM panning, and ignores other controllers.
+ */
+void MIDI_Input::convert_control_change(Track& track, const Message& message)
+{
+	if(message.data1 == 7)
+		track.add_event(Event::VOL_FINE, volume_to_mdsdrv(message.data2));
+	else if(message.data1 == 10)
+		track.add_event(Event::PAN, pan_to_mdsdrv(message.data2));
+}
+
+uint8_t MIDI_Input::read_byte()
+{
+	if(position >= data->size())
+		parse_error("unexpected end of file");
+	return (*data)[position++];
+}
+
+//! Read a big endian number.
+uint32_t MIDI_Input::read_number(unsigned int bytes)
+{
+	uint32_t value = 0;
+	while(bytes--)
+		value = (value << 8) | read_byte();
+	return value;
+}
+
+//! Read a variable length quantity.
+uint32_t MIDI_Input::read_varlen()
+{
+	uint32_t value = 0;
+	for(int i = 0; i < 4; i++)
+	{
+		uint8_t c = read_byte();
+		value = (value << 7) | (c & 0x7f);
+		if(~c & 0x80)
+			return value;
+	}
+	parse_error("invalid variable length quantity");
+	return 0;
+}
+
+//! Get the end position of a chunk or event, checking that it is in the file.
+uint32_t MIDI_Input::get_end(uint32_t length)
+{
+	if(length > data->size() - position)
+		parse_error("unexpected end of file");
+	return position + length;
+}
+
+//! Read the messages of a track chunk.
+void MIDI_Input::read_track(uint32_t end, std::vector<Timed_Message>& messages)
+{
+	uint32_t time = 0;
+	uint8_t running_status = 0;
+	while(position < end)
+	{
+		time += read_varlen();
+		uint8_t status = read_byte();
+		if(status < 0x80)
+		{
+			if(!running_status)
+				parse_error("missing status byte");
+			status = running_status;
+			position--;
+		}
+		if(status == 0xff)
+		{
+			// Meta event
+			uint8_t type = read_byte();
+			uint32_t next = get_end(read_varlen());
+			uint32_t tempo = (type == 0x51 && next - position == 3) ? read_number(3) : 0;
+			messages.push_back({time, tempo, {status, 0, type, 0}});
+			position = next;
+			running_status = 0;
+			if(type == 0x2f) // End of track
+				break;
+		}
+		else if(status == 0xf0 || status == 0xf7)
+		{
+			// System exclusive
+			position = get_end(read_varlen());
+			running_status = 0;
+		}
+		else if(status > 0xf0)
+		{
+			parse_error("unexpected system message");
+		}
+		else
+		{
+			Message message = {(uint8_t)(status & 0xf0), (uint8_t)(status & 0x0f), read_byte(), 0};
+			// Program change and channel aftertouch have one data byte
+			if(message.status != 0xc0 && message.status != 0xd0)
+				message.data2 = read_byte();
+			messages.push_back({time, 0, message});
+			running_status = status;
+		}
+	}
+	position = end;
+}
+
+//! Get the Song track of a MIDI track.
+/*!
+ *  \return -1 if the track should be ignored.
+ */
+int MIDI_Input::get_track_id(const std::vector<Timed_Message>& messages) const
+{
+	unsigned int channel = 0;
+	for(auto && timed : messages)
+	{
+		if(timed.message.status != 0xff)
+		{
+			channel = timed.message.channel;
+			break;
+		}
+	}
+	if(channel >= channel_map.size())
+		return -1;
+	char c = channel_map[channel];
+	if(c >= 'A' && c <= 'Z')
+		return c - 'A';
+	else if(c >= '0' && c <= '9')
+		return c - '0' + 26;
+	return -1;
+}
+
+//! Convert the merged messages of a track to events.
+void MIDI_Input::convert_track(Track& track, const std::vector<Timed_Message>& messages)
+{
+	uint16_t ppqn = get_song().get_ppqn();
+	uint32_t time = 0;
+	int midi_note = -1; // key of the current note, or -1 if there is none
+	int note = 0;
+	bool note_started = false;
+	track.set_octave(0);
+	for(auto && timed : messages)
+	{
+		// Times are converted from the start of the track, so that
+		// rounding errors do not accumulate.
+		uint32_t next = (uint64_t)timed.time * ppqn / division;
+		while(next > time)
+		{
+			uint16_t duration = std::min<uint32_t>(next - time, UINT16_MAX);
+			if(midi_note < 0)
+			{
+				track.add_rest(duration);
+			}
+			else if(!note_started)
+			{
+				track.add_note(note, duration);
+				note_started = true;
+			}
+			else
+			{
+				track.add_tie(duration);
+			}
+			time += duration;
+		}
+
+		const Message& message = timed.message;
+		if(message.status == 0xff)
+		{
+			if(message.data1 == 0x51 && timed.tempo)
+				track.add_event(Event::TEMPO_BPM, 60000000 / timed.tempo);
+		}
+		else if(message.status == 0xc0)
+		{
+			convert_program_change(track, message);
+		}
+		else if(message.status == 0xb0)
+		{
+			convert_control_change(track, message);
+		}
+		else if(message.status == 0x90 && message.data2)
+		{
+			midi_note = message.data1;
+			note = convert_note(message);
+			note_started = false;
+		}
+		else if(message.status == 0x80 || message.status == 0x90)
+		{
+			if(message.data1 == midi_note)
+				midi_note = -1;
+		}
+	}
+}
+
+//! Read and convert a MIDI file.
+void MIDI_Input::parse_file()
+{
+	data = read_file();
+	position = 0;
+
+	if(read_number(4) != 0x4d546864) // MThd
+		parse_error("not a MIDI file");
+	uint32_t header_end = get_end(read_number(4));
+	unsigned int format = read_number(2);
+	unsigned int track_count = read_number(2);
+	division = read_number(2);
+	if(format != 1)
+		parse_error("not a MIDI type 1 file");
+	if(division == 0 || division & 0x8000)
+		parse_error("unsupported time division");
+	position = header_end;
+
+	// Messages of each Song track, merged by time
+	std::map<uint16_t, std::vector<Timed_Message>> tracks;
+	auto by_time = [](const Timed_Message& a, const Timed_Message& b)
+	{
+		return a.time < b.time;
+	};
+	while(track_count && position < data->size())
+	{
+		uint32_t type = read_number(4);
+		uint32_t end = get_end(read_number(4));
+		if(type != 0x4d54726b) // MTrk
+		{
+			// Unknown chunks are skipped
+			position = end;
+			continue;
+		}
+		track_count--;
+
+		std::vector<Timed_Message> messages;
+		read_track(end, messages);
+		int id = get_track_id(messages);
+		if(id < 0)
+			continue;
+		auto& merged = tracks[id];
+		size_t middle = merged.size();
+		merged.insert(merged.end(), messages.begin(), messages.end());
+		std::inplace_merge(merged.begin(), merged.begin() + middle, merged.end(), by_time);
+	}
+
+	for(auto && it : tracks)
+		convert_track(get_song().make_track(it.first), it.second);
+	data = nullptr;
+}
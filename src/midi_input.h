@@ -0,0 +1,83 @@
+/*! \file src/midi_input.h
+ *  \brief Standard MIDI File parser
+ *
+ *  This replaces the text conversion done by tools/mid2ctrmml.py.
+ */
+#ifndef MIDI_INPUT_H
+#define MIDI_INPUT_H
+#include <string>
+#include <vector>
+#include "input.h"
+#include "track.h"
+
+//! Standard MIDI File (SMF) parser class
+/*!
+ *  Converts the tracks of a type 1 SMF directly to Song tracks, the same
+ *  way as tools/mid2ctrmml.py:
+ *
+ *  - Each MIDI track is assigned to a Song track with the channel map,
+ *    using the channel of its first channel message. MIDI tracks
+ *    assigned to the same Song track are merged.
+ *  - Times are converted to the ppqn of the Song.
+ *  - Only one note is played at a time in each track. A note on message
+ *    replaces the previous note.
+ *  - Only note on/off, program change, control change and tempo messages
+ *    are converted. Note velocity is ignored.
+ *
+ *  Notes, program changes and control changes are converted by virtual
+ *  functions, which can be overridden for a more detailed conversion.
+ */
+class MIDI_Input: public Input
+{
+	public:
+		//! MIDI channel message.
+		struct Message
+		{
+			uint8_t status; //!< Status byte, without the channel number.
+			uint8_t channel;
+			uint8_t data1;
+			uint8_t data2;
+		};
+
+		//! Default channel map. MIDI channel 0 is converted to track A, 1 to B and so on.
+		static const char* const DEFAULT_CHANNEL_MAP;
+
+		MIDI_Input(Song* song, const std::string& channel_map = DEFAULT_CHANNEL_MAP);
+		MIDI_Input(MIDI_Input&& other) = default;
+		MIDI_Input& operator=(MIDI_Input&& other) = default;
+		~MIDI_Input();
+
+		static int volume_to_mdsdrv(int volume);
+		static int pan_to_mdsdrv(int pan);
+
+	protected:
+		virtual int convert_note(const Message& message);
+		virtual void convert_program_change(Track& track, const Message& message);
+		virtual void convert_control_change(Track& track, const Message& message);
+
+	private:
+		//! Message or meta event with its time, used to merge tracks.
+		struct Timed_Message
+		{
+			uint32_t time; // in MIDI ticks
+			uint32_t tempo; // for the set tempo meta event
+			Message message; // status is 0xff for meta events, data1 is the type
+		};
+
+		void parse_file() override;
+		void read_track(uint32_t end, std::vector<Timed_Message>& messages);
+		int get_track_id(const std::vector<Timed_Message>& messages) const;
+		void convert_track(Track& track, const std::vector<Timed_Message>& messages);
+
+		uint8_t read_byte();
+		uint32_t read_number(unsigned int bytes);
+		uint32_t read_varlen();
+		uint32_t get_end(uint32_t length);
+
+		std::string channel_map;
+		std::shared_ptr<std::string> data;
+		uint32_t position;
+		uint16_t division;
+};
+
+#endif
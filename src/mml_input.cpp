@@ -1,6 +1,12 @@
 #include <iostream>
+#include <sstream>
 #include <cctype>
+#include <climits>
 #include <stdexcept>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <atomic>
 #include "mml_input.h"
 #include "song.h"
 #include "track.h"
@@ -9,68 +15,49 @@
 unsigned int MML_Input::read_duration()
 {
 	int duration = 0, dot;
-	try
+	int c = get();
+	if(c == ':')
 	{
-		int c = get();
-		if(c == ':')
-		{
-			duration = get_num();
-		}
-		else
-		{
-			unget(c);
-			int div = get_num();
-			if(div < 1)
-				parse_error("illegal duration");
-			duration = track->get_measure_len() / div;
-		}
-		if(duration < 0)
-			parse_error("illegal duration");
+		if(!read_num(duration))
+			duration = track->get_duration();
 	}
-	catch(std::invalid_argument&)
+	else
 	{
-		duration = track->get_duration();
+		unget(c);
+		int div;
+		if(!read_num(div))
+			duration = track->get_duration();
+		else if(div < 1)
+			parse_error("illegal duration");
+		else
+			duration = track->get_measure_len() / div;
 	}
+	if(duration < 0)
+		parse_error("illegal duration");
 	dot = duration>>1;
-	while(1)
+	while(get() == '.')
 	{
-		if(get() == '.')
-		{
-			duration += dot;
-			dot >>= 1;
-		}
-		else
-		{
-			unget();
-			break;
-		}
+		duration += dot;
+		dot >>= 1;
 	}
+	unget();
 	return (unsigned)duration;
 }
 
 int MML_Input::read_parameter(int default_parameter)
 {
-	try
-	{
-		return get_num();
-	}
-	catch(std::invalid_argument&)
-	{
-		return default_parameter;
-	}
+	int value;
+	if(read_num(value))
+		return value;
+	return default_parameter;
 }
 
 int MML_Input::expect_parameter()
 {
-	try
-	{
-		return get_num();
-	}
-	catch(std::invalid_argument&)
-	{
+	int value = 0;
+	if(!read_num(value))
 		parse_error("missing parameter");
-		return 0;
-	}
+	return value;
 }
 
 int MML_Input::expect_signed()
@@ -104,28 +91,6 @@ int MML_Input::read_note(int c)
 	return val + sig;
 }
 
-//! Platform-exclusive messages ('<key> <value> ...')
-void MML_Input::platform_exclusive()
-{
-	std::string str = "";
-	char c = get();
-	while(c && c != '\'')
-	{
-		str.push_back(c);
-		c = get();
-	}
-	if(c != '\'')
-		parse_error("unterminated platform-exclusive message");
-	int16_t param = get_song().register_platform_command(-1, str);
-	track->add_event(Event::PLATFORM, param);
-}
-
-void MML_Input::mml_slur()
-{
-	if(track->add_slur())
-		parse_warning("slur may not affect articulation of previous note");
-}
-
 void MML_Input::mml_reverse_rest(int duration)
 {
 	try
@@ -142,7 +107,111 @@ void MML_Input::mml_reverse_rest(int duration)
 	}
 }
 
-void MML_Input::mml_grace()
+//! combination command that allows for two Event::Type depending on
+//! if a sign prefix is found.
+void MML_Input::event_relative(Event::Type type, Event::Type subtype)
+{
+	int c = get_token();
+	if(c == '+' || c == '-')
+		type = subtype;
+	if(c != '+')
+		unget();
+	if(type == Event::INVALID)
+		parse_error("parameter must be relative (+ or - prefix)");
+	track->add_event(type, expect_parameter());
+}
+
+void MML_Input::conditional_block_begin()
+{
+	int c;
+	int offset = track_offset;
+	conditional_block = 1;
+	while(offset)
+	{
+		do c = get_token();
+		while(c != 0 && c != '/' && c != ';');
+		if(c != '/')
+			parse_error("unterminated conditonal block");
+		c = 0;
+		offset--;
+	}
+}
+
+void MML_Input::conditional_block_end(int c)
+{
+	while(c != 0 && c != '}' && c != ';')
+		c = get_token();
+	if(c != '}')
+		parse_error("unterminated conditional block");
+	conditional_block = 0;
+}
+
+//! Add an event without parameters.
+void MML_Input::cmd_event(int, Event::Type type)
+{
+	track->add_event(type);
+}
+
+//! Add an event with a required parameter.
+void MML_Input::cmd_event_parameter(int, Event::Type type)
+{
+	track->add_event(type, expect_parameter());
+}
+
+void MML_Input::cmd_note(int c, Event::Type)
+{
+	c = read_note(c);
+	track->add_note(c, read_duration());
+}
+
+void MML_Input::cmd_rest(int, Event::Type)
+{
+	track->add_rest(read_duration());
+}
+
+void MML_Input::cmd_tie(int, Event::Type)
+{
+	track->add_tie(read_duration());
+}
+
+void MML_Input::cmd_slur(int, Event::Type)
+{
+	if(track->add_slur())
+		parse_warning("slur may not affect articulation of previous note");
+}
+
+void MML_Input::cmd_octave(int, Event::Type)
+{
+	track->set_octave(expect_parameter() - 1);
+}
+
+//! '<' and '>'
+void MML_Input::cmd_octave_change(int c, Event::Type)
+{
+	track->change_octave(c == '<' ? -1 : 1);
+}
+
+void MML_Input::cmd_length(int, Event::Type)
+{
+	track->set_duration(read_duration());
+}
+
+void MML_Input::cmd_quantize(int, Event::Type)
+{
+	track->set_quantize(expect_parameter());
+}
+
+void MML_Input::cmd_early_release(int, Event::Type)
+{
+	track->set_early_release(expect_parameter());
+}
+
+void MML_Input::cmd_reverse_rest(int, Event::Type)
+{
+	mml_reverse_rest(read_duration());
+}
+
+void MML_Input::cmd_grace(int, Event::Type)
 {
 	int c = read_note(get_token());
 	int duration = read_duration();
@@ -150,42 +219,18 @@ void MML_Input::mml_grace()
 	track->add_note(c, duration);
 }
 
-void MML_Input::mml_transpose()
+void MML_Input::cmd_measure_len(int, Event::Type)
 {
-	int c = get_token();
-	if(c == '_')
-	{
-		track->add_event(Event::TRANSPOSE_REL, expect_signed());
-	}
-	else if(c == '{')
-	{
-		try
-		{
-			// Read key signature
-			std::string str = "";
-			do
-			{
-				c = get();
-				if(c && c != '}' && !std::isspace(c))
-					str.push_back(c);
-			}
-			while(c && c != '}');
-			track->set_key_signature(str.c_str());
-		}
-		catch(std::invalid_argument&)
-		{
-			parse_error("invalid key signature");
-		}
-	}
-	else
-	{
-		unget();
-		track->add_event(Event::TRANSPOSE, expect_signed());
-	}
+	track->set_measure_len(expect_parameter());
+}
+
+void MML_Input::cmd_shuffle(int, Event::Type)
+{
+	track->set_shuffle(expect_signed());
 }
 
 //! mucom88 style echo command
-void MML_Input::mml_echo()
+void MML_Input::cmd_echo(int, Event::Type)
 {
 	int c = get_token();
 	if(c == '=')
@@ -207,210 +252,238 @@ void MML_Input::mml_echo()
 	}
 }
 
-//! combination command that allows for two Event::Type depending on
-//! if a sign prefix is found.
-void MML_Input::event_relative(Event::Type type, Event::Type subtype)
+void MML_Input::cmd_separator(int, Event::Type)
 {
-	int c = get_token();
-	if(c == '+' || c == '-')
-		type = subtype;
-	if(c != '+')
+}
+
+void MML_Input::cmd_conditional_begin(int, Event::Type)
+{
+	if(conditional_block)
+	{
 		unget();
-	if(type == Event::INVALID)
-		parse_error("parameter must be relative (+ or - prefix)");
-	track->add_event(type, expect_parameter());
+		parse_error("unknown MML command");
+	}
+	conditional_block_begin();
 }
 
-// Basic MML command parser. Commands defined here are the ones
-// unlikely to change in different MML dialects.
-bool MML_Input::mml_basic()
+void MML_Input::cmd_conditional_end(int c, Event::Type)
 {
-	int c = get_token();
-	if(c >= 'a' && c <= 'h')
-	{
-		c = read_note(c);
-		track->add_note(c, read_duration());
-	}
-	else if(c == 'r')
-		track->add_rest(read_duration());
-	else if(c == '^')
-		track->add_tie(read_duration());
-	else if(c == '&')
-		mml_slur();
-	else if(c == 'o')
-		track->set_octave(expect_parameter() - 1);
-	else if(c == '<')
-		track->change_octave(-1);
-	else if(c == '>')
-		track->change_octave(1);
-	else if(c == 'l')
-		track->set_duration(read_duration());
-	else if(c == 'Q')
-		track->set_quantize(expect_parameter());
-	else if(c == 'q')
-		track->set_early_release(expect_parameter());
-	else if(c == 'R')
-		mml_reverse_rest(read_duration());
-	else if(c == '~')
-		mml_grace();
-	else if(c == 'C')
-		track->set_measure_len(expect_parameter());
-	else if(c == 's')
-		track->set_shuffle(expect_signed());
-	else if(c == '\\')
-		mml_echo();
-	else
+	if(!conditional_block)
 	{
-		unget(c);
-		return true;
+		unget();
+		parse_error("unknown MML command");
 	}
-	return false;
+	conditional_block_end(c);
 }
 
-bool MML_Input::mml_control()
+//! '/' ends a conditional block, otherwise it is a loop break.
+void MML_Input::cmd_loop_break(int c, Event::Type)
 {
-	int c = get_token();
-	if(c == '[')
-		track->add_event(Event::LOOP_START);
-	else if(c == '/')
-		track->add_event(Event::LOOP_BREAK);
-	else if(c == ']')
-		track->add_event(Event::LOOP_END, read_parameter(2));
-	else if(c == 'L')
-		track->add_event(Event::SEGNO);
-	else if(c == '*')
-		track->add_event(Event::JUMP, expect_parameter());
-	else if(c == '\'')
-		platform_exclusive();
+	if(conditional_block)
+		conditional_block_end(c);
 	else
+		track->add_event(Event::LOOP_BREAK);
+}
+
+void MML_Input::cmd_loop_end(int, Event::Type)
+{
+	track->add_event(Event::LOOP_END, read_parameter(2));
+}
+
+//! Platform-exclusive messages ('<key> <value> ...')
+void MML_Input::cmd_platform_exclusive(int, Event::Type)
+{
+	std::string str = "";
+	char c = get();
+	while(c && c != '\'')
 	{
-		unget(c);
-		return true;
+		str.push_back(c);
+		c = get();
+	}
+	if(c != '\'')
+		parse_error("unterminated platform-exclusive message");
+	if(worker)
+	{
+		// Registered in order by parse_fragments()
+		worker_result->commands.push_back({fragment_index, track->get_event_count(), str});
+		track->add_event(Event::PLATFORM, 0);
+		return;
 	}
-	return false;
+	int16_t param = get_song().register_platform_command(-1, str);
+	track->add_event(Event::PLATFORM, param);
 }
 
-// Dialect specific MML commands
-bool MML_Input::mml_envelope()
+void MML_Input::cmd_transpose(int, Event::Type)
 {
 	int c = get_token();
-	if(c == '@')
-		track->add_event(Event::INS, expect_parameter());
-	else if(c == '_')
-		mml_transpose();
-	else if(c == 'k') // TODO: ktype command to set compile-time transpose?
-		mml_transpose();
-	else if(c == 'K')
-		track->add_event(Event::DETUNE, expect_signed());
-	else if(c == 'v')
-		track->add_event(Event::VOL, expect_parameter());
-	else if(c == '(')
-		track->add_event(Event::VOL_REL, -read_parameter(1));
-	else if(c == ')')
-		track->add_event(Event::VOL_REL, read_parameter(1));
-	else if(c == 'V')
-		event_relative(Event::VOL_FINE, Event::VOL_FINE_REL);
-	else if(c == 'p')
-		track->add_event(Event::PAN, expect_signed());
-	else if(c == 'E')
-		track->add_event(Event::VOL_ENVELOPE, expect_parameter());
-	else if(c == 'M')
-		track->add_event(Event::PITCH_ENVELOPE, expect_parameter());
-	else if(c == 'P')
-		track->add_event(Event::PAN_ENVELOPE, expect_parameter());
-	else if(c == 'G')
-		track->add_event(Event::PORTAMENTO, expect_parameter());
-	else if(c == 'D')
-		track->set_drum_mode(expect_parameter());
-	else if(c == 't')
-		track->add_event(Event::TEMPO_BPM, expect_parameter());
-	else if(c == 'T')
-		track->add_event(Event::TEMPO, expect_parameter());
+	if(c == '_')
+	{
+		track->add_event(Event::TRANSPOSE_REL, expect_signed());
+	}
+	else if(c == '{')
+	{
+		try
+		{
+			// Read key signature
+			std::string str = "";
+			do
+			{
+				c = get();
+				if(c && c != '}' && !std::isspace(c))
+					str.push_back(c);
+			}
+			while(c && c != '}');
+			track->set_key_signature(str.c_str());
+		}
+		catch(std::invalid_argument&)
+		{
+			parse_error("invalid key signature");
+		}
+	}
 	else
 	{
-		unget(c);
-		return true;
+		unget();
+		track->add_event(Event::TRANSPOSE, expect_signed());
 	}
-	return false;
 }
 
-void MML_Input::conditional_block_begin()
+//! '(' and ')'
+void MML_Input::cmd_volume_relative(int c, Event::Type)
 {
-	int c;
-	int offset = track_offset;
-	conditional_block = 1;
-	while(offset)
+	int step = read_parameter(1);
+	track->add_event(Event::VOL_REL, c == '(' ? -step : step);
+}
+
+void MML_Input::cmd_volume_fine(int, Event::Type)
+{
+	event_relative(Event::VOL_FINE, Event::VOL_FINE_REL);
+}
+
+void MML_Input::cmd_drum_mode(int, Event::Type)
+{
+	track->set_drum_mode(expect_parameter());
+}
+
+//! Get the default MML command table.
+/*!
+ *  Derived classes implementing other MML dialects can copy this table,
+ *  change or add entries and then use set_command_table().
+ */
+const MML_Input::Command_Table& MML_Input::get_default_command_table()
+{
+	static const Command_Table table = []()
 	{
-		do c = get_token();
-		while(c != 0 && c != '/' && c != ';');
-		if(c != '/')
-			parse_error("unterminated conditonal block");
-		c = 0;
-		offset--;
-	}
+		Command_Table t = {};
+		auto set = [&](const char* chars, Command_Handler handler, Event::Type type = Event::INVALID)
+		{
+			for(; *chars; chars++)
+				t[(uint8_t)*chars] = {handler, type};
+		};
+		// Basic commands. These are unlikely to change in different MML dialects.
+		set("abcdefgh", &MML_Input::cmd_note);
+		set("r", &MML_Input::cmd_rest);
+		set("^", &MML_Input::cmd_tie);
+		set("&", &MML_Input::cmd_slur);
+		set("o", &MML_Input::cmd_octave);
+		set("<>", &MML_Input::cmd_octave_change);
+		set("l", &MML_Input::cmd_length);
+		set("Q", &MML_Input::cmd_quantize);
+		set("q", &MML_Input::cmd_early_release);
+		set("R", &MML_Input::cmd_reverse_rest);
+		set("~", &MML_Input::cmd_grace);
+		set("C", &MML_Input::cmd_measure_len);
+		set("s", &MML_Input::cmd_shuffle);
+		set("\\", &MML_Input::cmd_echo);
+		// Control commands
+		set("|", &MML_Input::cmd_separator);
+		set("{", &MML_Input::cmd_conditional_begin);
+		set("}", &MML_Input::cmd_conditional_end);
+		set("[", &MML_Input::cmd_event, Event::LOOP_START);
+		set("/", &MML_Input::cmd_loop_break);
+		set("]", &MML_Input::cmd_loop_end);
+		set("L", &MML_Input::cmd_event, Event::SEGNO);
+		set("*", &MML_Input::cmd_event_parameter, Event::JUMP);
+		set("'", &MML_Input::cmd_platform_exclusive);
+		set("%", &MML_Input::cmd_event_parameter, Event::PLATFORM);
+		// Dialect specific commands
+		set("@", &MML_Input::cmd_event_parameter, Event::INS);
+		set("_k", &MML_Input::cmd_transpose); // TODO: ktype command to set compile-time transpose?
+		set("K", &MML_Input::cmd_event_parameter, Event::DETUNE);
+		set("v", &MML_Input::cmd_event_parameter, Event::VOL);
+		set("()", &MML_Input::cmd_volume_relative);
+		set("V", &MML_Input::cmd_volume_fine);
+		set("p", &MML_Input::cmd_event_parameter, Event::PAN);
+		set("E", &MML_Input::cmd_event_parameter, Event::VOL_ENVELOPE);
+		set("M", &MML_Input::cmd_event_parameter, Event::PITCH_ENVELOPE);
+		set("P", &MML_Input::cmd_event_parameter, Event::PAN_ENVELOPE);
+		set("G", &MML_Input::cmd_event_parameter, Event::PORTAMENTO);
+		set("D", &MML_Input::cmd_drum_mode);
+		set("t", &MML_Input::cmd_event_parameter, Event::TEMPO_BPM);
+		set("T", &MML_Input::cmd_event_parameter, Event::TEMPO);
+		return t;
+	}();
+	return table;
 }
 
-void MML_Input::conditional_block_end(int c)
+//! Set the MML command table.
+/*!
+ *  The table is not copied and must outlive the MML_Input.
+ */
+void MML_Input::set_command_table(const Command_Table& table)
 {
-	while(c != 0 && c != '}' && c != ';')
-		c = get_token();
-	if(c != '}')
-		parse_error("unterminated conditional block");
-	conditional_block = 0;
+	commands = &table;
 }
 
 void MML_Input::parse_mml_track()
 {
-	int c;
 	while(1)
 	{
-		// could this be rewritten using a command map?
-		// it would be nice to at least split the MML commands
-		// into a few functions...
-		c = get_token();
-		if(c == '|') // Separator
-			continue;
-		else if(c == ';') // Comment
-			break;
-		else if((c == '/' || c == '}') && conditional_block)
-			conditional_block_end(c);
-		else if(c == '{' && !conditional_block)
-			conditional_block_begin();
-		else if(c == '%')
-			track->add_event(Event::PLATFORM, expect_parameter());
-		else if(c == 0)
+		int c = get_token();
+		if(c == 0 || c == ';') // End of line or comment
 			return;
-		else
-		{
-			unget(c);
-			// Set reference
-			track->set_reference(get_reference());
-			// Here i can read a list of command handlers and call them
-			// until one returns false
-			if(mml_basic() == false)
-				continue;
-			else if(mml_control() == false)
-				continue;
-			else if(mml_envelope() == false)
-				continue;
+		const Command& command = (*commands)[(uint8_t)c];
+		// Set reference
+		unget();
+		if(!command.handler)
 			parse_error("unknown MML command");
-		}
+		track->set_reference(get_location());
+		get();
+		(this->*command.handler)(c, command.type);
 	}
 }
 
+//! Parse the MML at the current position for a single track.
+/*!
+ *  \param id     Track ID.
+ *  \param offset Position of the track in the track list, used to select
+ *                the part of conditional blocks.
+ */
+void MML_Input::parse_mml_fragment(uint16_t id, uint16_t offset)
+{
+	track_id = id;
+	track_offset = offset;
+	track = &get_song().make_track(track_id);
+	conditional_block = false;
+	parse_mml_track();
+	if(conditional_block)
+		parse_error("unterminated conditional block");
+}
+
 void MML_Input::parse_mml()
 {
 	unsigned long col = tell();
 	for(unsigned int i = 0; i < track_list.size(); i++)
 	{
+		if(record_fragments)
+		{
+			// Tracks are created in the same order as when parsing directly.
+			get_song().make_track(track_list[i]);
+			fragments.push_back({buffer, line_start, line_length, (uint32_t)col,
+				get_line_number(), get_location().line, track_list[i], (uint16_t)i});
+			continue;
+		}
 		seek(col);
-		track_id = track_list[i];
-		track_offset = i;
-		track = &get_song().make_track(track_id);
-		conditional_block = false;
-		parse_mml_track();
-		if(conditional_block)
-			parse_error("unterminated conditional block");
+		parse_mml_fragment(track_list[i], i);
 	}
 }
 
@@ -422,8 +495,11 @@ void MML_Input::parse_tag()
 		// Special cases for "include" etc commands go here
 		// #platform = set output format
 		// #format = set MML format. Handle internally
+		// #include = parse another file
 		if(iequal(tag_key, "#platform"))
 			get_song().set_platform(get_line());
+		else if(iequal(tag_key, "#include"))
+			mml_include(get_line());
 		else
 			get_song().set_tag(tag_key, get_line());
 		last_cmd = nullptr; // Only read a single line
@@ -434,6 +510,21 @@ void MML_Input::parse_tag()
 	}
 }
 
+//! Parse an included file.
+/*!
+ *  \param path File name, optionally enclosed in double quotes.
+ */
+void MML_Input::mml_include(std::string path)
+{
+	while(!path.empty() && std::isspace(path.back()))
+		path.pop_back();
+	if(path.size() >= 2 && path.front() == '"' && path.back() == '"')
+		path = path.substr(1, path.size() - 2);
+	if(path.empty())
+		parse_error("missing file name");
+	include_file(path);
+}
+
 // may throw std::invalid_argument
 int MML_Input::get_track_id()
 {
@@ -449,13 +540,26 @@ int MML_Input::get_track_id()
 	return -1;
 }
 
-MML_Input::MML_Input(Song* song)
+//! Constructs an MML_Input.
+/*!
+ *  \param song Song to add tracks and tags to.
+ *  \param jobs Number of threads used by open_file(). Parsing with
+ *              more than one job gives the same result.
+ */
+MML_Input::MML_Input(Song* song, unsigned int jobs)
 	: Line_Input(song),
 	track_id(0),
 	track_offset(0),
 	track_list(0),
 	last_cmd(nullptr),
-	conditional_block(0)
+	conditional_block(0),
+	jobs(jobs),
+	record_fragments(false),
+	worker(false),
+	fragment_index(0),
+	fragments(),
+	worker_result(nullptr),
+	commands(&get_default_command_table())
 {
 	// Perhaps the initial state of mml_input should be track A.
 	// Or maybe it can be initialized by a previous MML_Input during
@@ -466,6 +570,173 @@ MML_Input::~MML_Input()
 {
 }
 
+//! Open file and parse lines.
+/*!
+ *  With more than one job, the track lines are recorded as fragments
+ *  and parsed by parse_fragments() after the whole file has been read.
+ *  If reading the file fails, the recorded fragments are still parsed
+ *  so that an earlier error in a track line is reported first.
+ */
+void MML_Input::parse_file()
+{
+	// Included files are parsed as part of the current phase.
+	if(jobs <= 1 || get_include_depth())
+	{
+		Line_Input::parse_file();
+		return;
+	}
+	std::exception_ptr error = nullptr;
+	fragments.clear();
+	record_fragments = true;
+	try
+	{
+		Line_Input::parse_file();
+	}
+	catch(...)
+	{
+		error = std::current_exception();
+	}
+	record_fragments = false;
+	parse_fragments(error);
+}
+
+//! Raise a parse warning.
+/*!
+ *  Warnings from worker threads are printed in order by parse_fragments().
+ */
+void MML_Input::parse_warning(const char* msg)
+{
+	if(!worker)
+	{
+		Line_Input::parse_warning(msg);
+		return;
+	}
+	std::ostringstream os;
+	write_warning(os, msg);
+	worker_result->warnings.push_back({fragment_index, 0, os.str()});
+}
+
+//! Parse the recorded fragments, one track per thread.
+/*!
+ *  Platform commands are registered and warnings are printed in
+ *  fragment order. If any fragment (or the file itself) had an error,
+ *  only the first one is thrown, and output after it is discarded.
+ *
+ *  \param error Error from reading the file, or nullptr.
+ */
+void MML_Input::parse_fragments(std::exception_ptr error)
+{
+	std::vector<Fragment> list;
+	list.swap(fragments);
+
+	// Group the fragments by track
+	std::vector<Track_Result> results;
+	std::map<uint16_t, unsigned int> result_index;
+	std::vector<unsigned long> result_size;
+	for(uint32_t i = 0; i < list.size(); i++)
+	{
+		auto it = result_index.find(list[i].track_id);
+		if(it == result_index.end())
+		{
+			it = result_index.emplace(list[i].track_id, results.size()).first;
+			results.push_back({{}, UINT32_MAX, nullptr, {}, {}});
+			result_size.push_back(0);
+		}
+		results[it->second].fragments.push_back(i);
+		result_size[it->second] += list[i].length - std::min(list[i].column, list[i].length);
+	}
+
+	// Start with the longest tracks
+	std::vector<unsigned int> order(results.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+		return result_size[a] > result_size[b];
+	});
+
+	std::atomic<unsigned int> next_index(0);
+	std::vector<std::thread> workers;
+	auto work = [&]()
+	{
+		MML_Input parser(*this);
+		while(1)
+		{
+			unsigned int i = next_index.fetch_add(1);
+			if(i >= order.size())
+				break;
+			parser.parse_track_fragments(list, results[order[i]]);
+		}
+	};
+	for(unsigned int id = 1; id < jobs && id < results.size(); id++)
+		workers.emplace_back(work);
+	work();
+	for(auto && thread : workers)
+		thread.join();
+
+	// Find the first error
+	uint32_t error_fragment = list.size();
+	std::vector<Deferred_Output> commands, warnings;
+	for(auto && result : results)
+	{
+		if(result.error && result.error_fragment < error_fragment)
+		{
+			error_fragment = result.error_fragment;
+			error = result.error;
+		}
+		commands.insert(commands.end(), result.commands.begin(), result.commands.end());
+		warnings.insert(warnings.end(), result.warnings.begin(), result.warnings.end());
+	}
+
+	auto by_fragment = [](const Deferred_Output& a, const Deferred_Output& b) {
+		return a.fragment < b.fragment;
+	};
+	std::stable_sort(warnings.begin(), warnings.end(), by_fragment);
+	std::stable_sort(commands.begin(), commands.end(), by_fragment);
+	for(auto && warning : warnings)
+	{
+		if(warning.fragment <= error_fragment)
+			std::cerr << warning.text;
+	}
+	for(auto && command : commands)
+	{
+		if(command.fragment > error_fragment)
+			continue;
+		int16_t param = get_song().register_platform_command(-1, command.text);
+		get_song().get_track(list[command.fragment].track_id).get_event(command.position).param = param;
+	}
+
+	if(error)
+		std::rethrow_exception(error);
+}
+
+//! Parse the fragments of a single track in a worker thread.
+/*!
+ *  Stops at the first error, which is stored in \p result.
+ */
+void MML_Input::parse_track_fragments(const std::vector<Fragment>& list, Track_Result& result)
+{
+	worker = true;
+	worker_result = &result;
+	for(auto && index : result.fragments)
+	{
+		const Fragment& fragment = list[index];
+		fragment_index = index;
+		set_buffer(fragment.text, fragment.start, fragment.length);
+		set_line(fragment.line, fragment.line_index);
+		seek(fragment.column);
+		try
+		{
+			parse_mml_fragment(fragment.track_id, fragment.track_offset);
+		}
+		catch(...)
+		{
+			result.error = std::current_exception();
+			result.error_fragment = index;
+			break;
+		}
+	}
+	worker_result = nullptr;
+}
+
 //! Get a list of tracks that were affected by the previous read_line()
 MML_Input::Track_Position_Map MML_Input::get_track_map()
 {
@@ -9,7 +9,10 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <array>
 #include <map>
+#include <memory>
+#include <exception>
 #include "input.h"
 #include "track.h"
 
@@ -18,49 +21,146 @@
  *  For more info about the MML dialect used here, see
  *  the [MML reference](mml_ref.md).
  *
- *  \todo it should be possible to derive this in order to
- *        better support different MML dialects.
+ *  If more than one job is used, files are parsed in two phases. The
+ *  lines are first read serially, where tags are set and the MML on each
+ *  track line is recorded as a Fragment for each of its tracks. The
+ *  fragments of each track are then parsed concurrently. Platform
+ *  commands, warnings and errors are applied in the original order
+ *  afterwards, so the result is the same as with a single job.
+ *
+ *  MML commands are dispatched with a Command_Table indexed by the
+ *  command character. Other MML dialects can be supported by deriving
+ *  this class and replacing the table with set_command_table().
  */
 class MML_Input: public Line_Input
 {
 	public:
 		typedef std::map<uint16_t, unsigned long> Track_Position_Map;
 
-		MML_Input(Song* song);
+		//! MML command handler.
+		/*!
+		 *  Called after the command character has been read.
+		 *
+		 *  \param c    The command character.
+		 *  \param type Event type from the Command_Table.
+		 */
+		typedef void (MML_Input::*Command_Handler)(int c, Event::Type type);
+
+		//! Entry in the Command_Table.
+		struct Command
+		{
+			Command_Handler handler; //!< nullptr if the character is not a command.
+			Event::Type type; //!< Passed to the handler.
+		};
+
+		//! MML command dispatch table, indexed by the command character.
+		typedef std::array<Command, 256> Command_Table;
+
+		MML_Input(Song* song, unsigned int jobs = 1);
+		MML_Input(MML_Input&& other) = default;
+		MML_Input& operator=(MML_Input&& other) = default;
 		~MML_Input();
 
 		Track_Position_Map get_track_map();
 
-	private:
+		static const Command_Table& get_default_command_table();
+
+	protected:
+		void parse_file() override;
+		void parse_warning(const char* msg) override;
+		void set_command_table(const Command_Table& table);
+
+		//! Get the track currently being parsed.
+		inline Track& get_current_track()
+		{
+			return *track;
+		}
+
 		// MML read helpers
 		unsigned int read_duration();
 		int read_parameter(int default_parameter);
 		int expect_parameter();
 		int expect_signed();
 		int read_note(int c); // c is the first character
-		void platform_exclusive();
 
 		// Wrappers that provide error/warning messages
 		// or other functions
-		void mml_slur();
 		void mml_reverse_rest(int duration);
-		void mml_grace();
-		void mml_transpose();
-		void mml_echo();
 		void event_relative(Event::Type type, Event::Type subtype);
+
+		// Command handlers, see Command_Table.
+		void cmd_event(int c, Event::Type type); // Event without parameter
+		void cmd_event_parameter(int c, Event::Type type); // Event with a required parameter
+		void cmd_note(int c, Event::Type type);
+		void cmd_rest(int c, Event::Type type);
+		void cmd_tie(int c, Event::Type type);
+		void cmd_slur(int c, Event::Type type);
+		void cmd_octave(int c, Event::Type type);
+		void cmd_octave_change(int c, Event::Type type);
+		void cmd_length(int c, Event::Type type);
+		void cmd_quantize(int c, Event::Type type);
+		void cmd_early_release(int c, Event::Type type);
+		void cmd_reverse_rest(int c, Event::Type type);
+		void cmd_grace(int c, Event::Type type);
+		void cmd_measure_len(int c, Event::Type type);
+		void cmd_shuffle(int c, Event::Type type);
+		void cmd_echo(int c, Event::Type type);
+		void cmd_separator(int c, Event::Type type);
+		void cmd_conditional_begin(int c, Event::Type type);
+		void cmd_conditional_end(int c, Event::Type type);
+		void cmd_loop_break(int c, Event::Type type);
+		void cmd_loop_end(int c, Event::Type type);
+		void cmd_platform_exclusive(int c, Event::Type type);
+		void cmd_transpose(int c, Event::Type type);
+		void cmd_volume_relative(int c, Event::Type type);
+		void cmd_volume_fine(int c, Event::Type type);
+		void cmd_drum_mode(int c, Event::Type type);
+
+	private:
+		MML_Input(const MML_Input& other) = default; // clones a worker parser
+
+		//! MML of a track line, to be parsed for one of its tracks.
+		struct Fragment
+		{
+			std::shared_ptr<std::string> text;
+			uint32_t start;
+			uint32_t length;
+			uint32_t column; // start of the MML
+			uint32_t line;
+			uint32_t line_index; // Source_Map line index
+			uint16_t track_id;
+			uint16_t track_offset;
+		};
+		//! Platform command or warning from a worker, applied in fragment order.
+		struct Deferred_Output
+		{
+			uint32_t fragment;
+			unsigned long position; // event position of a platform command
+			std::string text;
+		};
+		//! Result of parsing the fragments of a track.
+		struct Track_Result
+		{
+			std::vector<uint32_t> fragments;
+			uint32_t error_fragment;
+			std::exception_ptr error;
+			std::vector<Deferred_Output> commands;
+			std::vector<Deferred_Output> warnings;
+		};
+
 		void conditional_block_begin();
 		void conditional_block_end(int c);
 
-		// MML command parsers. Returns 0 and increments position if parsing succeeds.
-		// the idea is that these can be swapped out for different MML dialects or platforms.
-		bool mml_basic(); // Notes, length, octave, etc.
-		bool mml_control(); // Loop control
-		bool mml_envelope(); // Instrument, volume, envelope etc.
-
 		// Parsers for various parts of the MML file
 		void parse_mml_track();
+		void parse_mml_fragment(uint16_t id, uint16_t offset);
 		void parse_mml();
 		void parse_tag();
+		void mml_include(std::string path);
+
+		// Parse recorded fragments with multiple jobs
+		void parse_fragments(std::exception_ptr error);
+		void parse_track_fragments(const std::vector<Fragment>& list, Track_Result& result);
 
 		// Convert track id from character
 		int get_track_id();
@@ -75,6 +175,15 @@ class MML_Input: public Line_Input
 		std::vector<uint16_t> track_list;
 		void (MML_Input::*last_cmd)();
 		bool conditional_block;
+
+		unsigned int jobs;
+		bool record_fragments; // set during the first phase of parse_file()
+		bool worker; // set for the parsers used in the second phase
+		uint32_t fragment_index; // fragment currently parsed by a worker
+		std::vector<Fragment> fragments;
+		Track_Result* worker_result;
+
+		const Command_Table* commands;
 };
 #endif
 
@@ -7,10 +7,13 @@
 #include "platform/mdsdrv.h"
 #include "stringf.h"
 #include "optimizer.h"
+#include "song_cache.h"
 
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
+#include <algorithm>
+#include <thread>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,11 +24,21 @@ void print_usage(const char* exename)
 	std::cout << "ctrmml Music Compiler, version " CTRMML_VERSION "\n";
 	std::cout << "(C) 2019-2022 Ian Karlsson.\n";
 	std::cout << "Licensed under GPLv2, see COPYING for details.\n\n";
-	std::cout << "Usage: " << exename << " [options] <input_file.mml>\n";
+	std::cout << "Usage: " << exename << " [options] <input_file.mml|input_file.mid|input_file.mds>\n";
 	std::cout << "Options:\n";
 	std::cout << "\t--output / -o <filename> : Set output filename\n";
 	std::cout << "\t--format / -f <format> : Set output file format\n";
 	std::cout << "\t--optimize / -O : Optimize music data (Experimental!)\n";
+	std::cout << "\t--jobs / -j <count> : Set number of parser and optimizer threads (0 = all cores)\n";
+	std::cout << "\t--cache <directory> : Reuse the parsed song if the input files are unchanged\n";
+	std::cout << "\t--batch / -b <count> : Set max number of optimizations per pass\n";
+	std::cout << "\t--transpose / -t : Share subroutines between transposed phrases\n";
+	std::cout << "\t--loops / -l : Create nested loops from the remaining repeats after optimizing\n";
+	std::cout << "\t--time <seconds> : Stop optimizing after the time limit\n";
+	std::cout << "\t--passes <count> : Stop optimizing after a number of passes\n";
+	std::cout << "\t--target-size <bytes> : Stop optimizing when the estimated size is reached\n";
+	std::cout << "\t--min-score, --max-stack-depth, --max-sub-stack, --max-loop-stack <value> :\n";
+	std::cout << "\t\tSet optimizer parameters, overriding #option\n";
 }
 
 std::string get_extension(const char* input_filename)
@@ -65,11 +78,27 @@ void validate_song(Song& song)
 	}
 }
 
-Song convert_file(const char* filename)
+Song convert_file(const char* filename, unsigned int jobs, const std::string& cache_directory)
 {
-	Song song;
-	MML_Input input = MML_Input(&song);
-	input.open_file(filename);
+	Song song(std::make_shared<Arena>());
+	if(!cache_directory.size())
+	{
+		auto input = Input::get_input(&song, filename, jobs);
+		input->open_file(filename);
+	}
+	else
+	{
+		Song_Cache cache(cache_directory);
+		if(!cache.load(song, filename))
+		{
+			auto provider = std::make_shared<Recording_File_Provider>(std::make_shared<Disk_File_Provider>());
+			auto input = Input::get_input(&song, filename, jobs);
+			input->set_file_provider(provider);
+			input->open_file(filename);
+			if(!cache.save(song, provider->get_dependencies()))
+				std::cerr << "Failed to write cache file " << cache.get_cache_filename(filename) << "\n";
+		}
+	}
 	validate_song(song);
 	return song;
 }
@@ -81,6 +110,15 @@ int main(int argc, char* argv[])
 	std::string format = "";
 	bool optimize = false;
 	bool verbose = false;
+	unsigned int jobs = 1;
+	unsigned int batch_size = 1;
+	bool transpose = false;
+	bool loop_synthesis = false;
+	double max_time = 0;
+	int max_passes = 0;
+	unsigned int target_size = 0;
+	std::string cache_directory = "";
+	Tag optimizer_options;
 
 	for(int arg = 1, default_arguments = 0; arg < argc; arg++)
 	{
@@ -90,6 +128,30 @@ int main(int argc, char* argv[])
 			format = argv[++arg];
 		else if(!strcmp(argv[arg], "-O") || !strcmp(argv[arg], "--optimize"))
 			optimize = true;
+		else if((!strcmp(argv[arg], "-j") || !strcmp(argv[arg], "--jobs")) && arg + 1 < argc)
+			jobs = strtoul(argv[++arg], NULL, 10);
+		else if((!strcmp(argv[arg], "-b") || !strcmp(argv[arg], "--batch")) && arg + 1 < argc)
+			batch_size = strtoul(argv[++arg], NULL, 10);
+		else if(!strcmp(argv[arg], "-t") || !strcmp(argv[arg], "--transpose"))
+			transpose = true;
+		else if(!strcmp(argv[arg], "-l") || !strcmp(argv[arg], "--loops"))
+			loop_synthesis = true;
+		else if(!strcmp(argv[arg], "--time") && arg + 1 < argc)
+			max_time = strtod(argv[++arg], NULL);
+		else if(!strcmp(argv[arg], "--cache") && arg + 1 < argc)
+			cache_directory = argv[++arg];
+		else if(!strcmp(argv[arg], "--passes") && arg + 1 < argc)
+			max_passes = strtol(argv[++arg], NULL, 10);
+		else if(!strcmp(argv[arg], "--target-size") && arg + 1 < argc)
+			target_size = strtoul(argv[++arg], NULL, 10);
+		else if((!strcmp(argv[arg], "--min-score") || !strcmp(argv[arg], "--max-stack-depth")
+				|| !strcmp(argv[arg], "--max-sub-stack") || !strcmp(argv[arg], "--max-loop-stack")) && arg + 1 < argc)
+		{
+			// Same format as #option
+			std::string name = argv[arg] + 2;
+			std::replace(name.begin(), name.end(), '-', '_');
+			optimizer_options.push_back(name + "=" + argv[++arg]);
+		}
 		else if(!strcmp(argv[arg], "-v"))
 			verbose = true;
 		else if(!strcmp(argv[arg], "-h") || !strcmp(argv[arg], "--help"))
@@ -97,6 +159,13 @@ int main(int argc, char* argv[])
 			print_usage(argv[0]);
 			return -1;
 		}
+		else if(argv[arg][0] == '-' && arg + 1 == argc)
+		{
+			// Option without its value
+			print_usage(argv[0]);
+			std::cerr << "invalid or incomplete option " << argv[arg] << "\n";
+			return -1;
+		}
 		else if(default_arguments < 1)
 		{
 			default_arguments++;
@@ -111,10 +180,13 @@ int main(int argc, char* argv[])
 		return -1;
 	}
 
+	if(!jobs)
+		jobs = std::max(1u, std::thread::hardware_concurrency());
+
 	try
 	{
 		// Parse MML
-		Song song = convert_file(in_filename.c_str());
+		Song song = convert_file(in_filename.c_str(), jobs, cache_directory);
 
 		// Get available formats
 		unsigned int format_id = 0;
@@ -150,7 +222,14 @@ int main(int argc, char* argv[])
 		// Optimize data
 		if(optimize)
 		{
-			Optimizer opt(song, 1 + verbose);
+			Optimizer opt(song, 1 + verbose, jobs);
+			opt.batch_size = batch_size;
+			opt.transpose = transpose;
+			opt.loop_synthesis = loop_synthesis;
+			opt.max_time = max_time;
+			opt.max_passes = max_passes;
+			opt.target_size = target_size;
+			opt.read_options(optimizer_options);
 			opt.optimize();
 			printf("\n");
 		}
@@ -2,105 +2,106 @@
 //
 // Basic flowchart:
 //   1. Analyze stack depth.
-//   2. Find matches.
+//   2. Find matches. A suffix array of all track events is used to look up the positions that share a
+//      common prefix with each source position.
 //      a) Check if a loop match is found (same track ID, loop pos-start pos smaller than match length. If a loop match is found, assign score based on length
 //      b) Check for subroutine matches. Assign score based on length AND number of matches found.
 //   3. Pick the strategy with the highest score (out of one loop match and potentially multiple subroutine matches)
 //   4. Perform the optimization and go back to step 1. If there are no good matches left, exit.
 //
+// The score is the estimated number of bytes saved, as given by the Cost_Model of the song platform.
+//
+// Optionally, multiple matches can be applied in step 4. The best matches are applied in order of score,
+// skipping those that read from events that were modified by a previous match in the same pass.
+//
+// The matches from step 2 are cached between passes. Only the positions that read from the edited parts
+// of the song (or from a position where the stack usage changed) are scored again in the next pass.
+//
+// The match search in step 2 can be split across multiple worker threads. Each worker scores a
+// subset of the source positions and the results are reduced in the same order as a serial search,
+// so the output does not depend on the number of threads.
+//
+// Each pass is checked by playing the tracks that were changed by step 4 (and the tracks that call
+// them) and comparing the play and loop lengths with the original song.
+//
 // TODO:
-//   Potential performance improvements:
-//     Switch to KMP search and/or hash tables.
-//     If still too slow, switch to Multithreaded searches.
 //   Look for more edge cases that could break loop optimizations...
-//   Customizable minimum score.
-//   Adjustable stack limits.
 
 #include <cstdio>
+#include <climits>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include <cstdlib>
 #include "optimizer.h"
 #include "song.h"
 #include "input.h" // TrackRef
-#include "player.h" // Song_Validator
+#include "player.h" // Track_Validator
+#include "stringf.h"
 
 
-// For debugging, it's useful to run each pass through the song validator, to check for changes in the
-// song length and other looping errors. Only works when building mmlc
+// Validate each pass, to check for changes in the song length and other looping errors.
+// Only the changed tracks are validated, so this is cheap compared to the match search.
 #if 1
 #define VALIDATE_PASS
-//void validate_song(Song& song);
 #endif
 
-const int Optimizer::max_stack_depth = 6;
-
 const int Optimizer::min_sub_score = 3;
 const int Optimizer::min_loop_score = 3;
 
-const int Optimizer::max_sub_stack = 7;
-const int Optimizer::max_loop_stack = 6;
+//! Get the number of state registers.
+unsigned int Cost_Model::get_state_count() const
+{
+	return 0;
+}
 
-int Optimizer::Stack_Analyzer::analyze_track(Song& song, Track& track, Optimizer& optimizer, int drum_mode)
+//! Get the size of each event in a track.
+void Cost_Model::get_track_cost(Song& song, Track& track, std::vector<Event_Cost>& cost_list) const
 {
-	int loop_depth = 0;
-	std::vector<Event>& events = track.get_events();
-	event_list.clear();
-	parsing = true;
+	cost_list.assign(track.get_event_count(), {1, 0, 0});
+}
 
-	for(auto && event : events)
-	{
-		int jump_depth = 0;
-		if(event.type == Event::LOOP_START)
-			loop_depth++;
-		if(event.type == Event::JUMP)
-			jump_depth++;
-		if(drum_mode && event.type == Event::NOTE)
-			jump_depth++;
+//! Get the size of a subroutine call.
+unsigned int Cost_Model::get_jump_cost() const
+{
+	return 1;
+}
 
-		int usage = jump_depth + loop_depth * 2;
+//! Get the size added by creating a subroutine.
+unsigned int Cost_Model::get_subroutine_cost() const
+{
+	return 0;
+}
 
-		if(event.type == Event::JUMP)
-		{
-			Stack_Analyzer& dest = optimizer.stack_analyzer[event.param];
-			if(dest.base_usage < (usage + base_usage))
-			{
-				dest.base_usage = usage + base_usage;
-				if(!dest.parsing)
-					drum_mode = dest.analyze_track(song, song.get_track(event.param), optimizer, drum_mode);
-			}
-			usage += dest.max_usage;
-		}
-		else if(event.type == Event::NOTE && drum_mode)
-		{
-			Stack_Analyzer& dest = optimizer.stack_analyzer[event.param];
-			if(dest.base_usage < (usage + base_usage))
-			{
-				//printf("calling %d with usage %d+%d\n", drum_mode+event.param, usage, base_usage);
-				dest.base_usage = usage + base_usage;
-				if(!dest.parsing)
-					dest.analyze_track(song, song.get_track(event.param), optimizer, 0);
-			}
-			usage += dest.max_usage;
-		}
-		else if(event.type == Event::DRUM_MODE)
-		{
-			drum_mode = event.param;
-		}
-		else if(event.type == Event::LOOP_END)
-		{
-			loop_depth--;
-		}
+//! Get the size of the loop commands.
+unsigned int Cost_Model::get_loop_cost(bool loop_break) const
+{
+	return 2;
+}
 
-		event_list.push_back(usage);
-		if(usage > max_usage)
-			max_usage = usage;
-	}
-	parsing = false;
-	return drum_mode;
+//! Get the size of the commands that transpose a subroutine call.
+unsigned int Cost_Model::get_transpose_cost() const
+{
+	return 2;
 }
 
-Optimizer::Optimizer(Song& song, int verbose)
+Optimizer::Optimizer(Song& song, int verbose, unsigned int jobs)
 	: sub_id(15000)
 	, verbose(verbose)
+	, jobs(jobs)
+	, use_cache(true)
+	, batch_size(1)
+	, transpose(false)
+	, loop_synthesis(false)
+	, use_transpose(false)
 	, min_score(10)
+	, max_stack_depth(7)
+	, max_sub_stack(7)
+	, max_loop_stack(6)
+	, max_time(0)
+	, max_passes(0)
+	, target_size(0)
 	, last_score(-1)
 	, top_score(min_score)
 	, song(&song)
@@ -108,6 +109,14 @@ Optimizer::Optimizer(Song& song, int verbose)
 {
 	auto& track_map = song.get_track_map();
 
+	if(song.get_platform())
+		cost_model = song.get_platform()->get_cost_model();
+	else
+		cost_model = std::make_shared<Cost_Model>();
+
+	read_options(song.get_option_list());
+	top_score = min_score;
+
 	auto it = track_map.rbegin();
 	if(it != track_map.rend() && it->first > sub_id)
 	{
@@ -115,9 +124,96 @@ Optimizer::Optimizer(Song& song, int verbose)
 	}
 }
 
+//! Set optimizer parameters from a list of options.
+/*!
+ *  Options are written as \c name=value. Other options are ignored,
+ *  as they are used by the platform.
+ *
+ *  \see Song::get_option_list()
+ *
+ *  \exception InputError if the value is not a number.
+ */
+void Optimizer::read_options(const Tag& tag)
+{
+	const std::map<std::string, int*> option_map = {
+		{"min_score", &min_score},
+		{"max_stack_depth", &max_stack_depth},
+		{"max_sub_stack", &max_sub_stack},
+		{"max_loop_stack", &max_loop_stack},
+	};
+	for(auto && option : tag)
+	{
+		auto separator = option.find('=');
+		if(separator == std::string::npos)
+			continue;
+		auto it = option_map.find(option.substr(0, separator));
+		if(it == option_map.end())
+			continue;
+
+		const char* value = option.c_str() + separator + 1;
+		char* end;
+		long result = std::strtol(value, &end, 10);
+		if(end == value || *end)
+			throw InputError(nullptr, stringf("#option %s: expected a number", it->first.c_str()).c_str());
+		*it->second = result;
+	}
+}
+
+//! Get the estimated size of the song data, as given by the Cost_Model.
+unsigned int Optimizer::get_size() const
+{
+	std::vector<Cost_Model::Event_Cost> cost_list;
+	unsigned int size = 0;
+	for(auto && track_it : song->get_track_map())
+	{
+		cost_model->get_track_cost(*song, track_it.second, cost_list);
+		for(auto && cost : cost_list)
+			size += cost.size;
+		size += cost_model->get_subroutine_cost();
+	}
+	return size;
+}
+
+//! Check if the budget set by max_time, max_passes or target_size is used up.
+bool Optimizer::budget_exceeded() const
+{
+	if(max_passes && pass >= max_passes)
+		return true;
+	if(max_time > 0)
+	{
+		std::chrono::duration<double> time = std::chrono::steady_clock::now() - start_time;
+		if(time.count() >= max_time)
+			return true;
+	}
+	if(target_size && get_size() <= target_size)
+		return true;
+	return false;
+}
+
+//! Optimize the song.
+/*!
+ *  Passes are made until no match scores higher than min_score or the
+ *  budget is used up. Each pass leaves the song in a valid state, so
+ *  stopping early returns the best song found so far. The matches
+ *  that save the most space are applied first.
+ */
 void Optimizer::optimize()
 {
 	pass = 0;
+	start_time = std::chrono::steady_clock::now();
+	match_cache.clear();
+	cache_stack.clear();
+	edit_list.clear();
+	stack_analyzer.clear();
+	stack_slot.clear();
+	stack_changes.clear();
+	track_time.clear();
+	callers.clear();
+	changed_tracks.clear();
+#ifdef VALIDATE_PASS
+	validate_pass();
+	reference_time = track_time;
+#endif
 	do
 	{
 		pass++;
@@ -125,19 +221,20 @@ void Optimizer::optimize()
 		analyze_stack();
 		find_best_match();
 		if(verbose > 1)
-			printf("Pass %d done, best score = %d\n", pass++, best_match.best_score());
+			printf("Pass %d done, best score = %d\n", pass, best_match.best_score());
 
 		last_score = best_match.best_score();
 
-		auto validator = Song_Validator(*song);
+#ifdef VALIDATE_PASS
+		validate_pass();
 		if(verbose > 1)
 		{
 			unsigned int total_commands = 0;
-			for(auto it = validator.get_track_map().begin(); it != validator.get_track_map().end(); it++)
+			for(auto it = track_time.begin(); it != track_time.end(); it++)
 			{
 				unsigned int command_count = song->get_track(it->first).get_event_count();
-				printf("Track%5d:%7d:%7d", it->first, command_count, it->second.get_play_time());
-				if(auto length = it->second.get_loop_length())
+				printf("Track%5d:%7d:%7d", it->first, command_count, it->second.play_time);
+				if(auto length = it->second.loop_length)
 					printf(" (loop %7d)", length);
 
 				printf("\n");
@@ -145,40 +242,314 @@ void Optimizer::optimize()
 			}
 			printf("Total # of commands:%7d\n", total_commands);
 		}
+#endif
+	}
+	while(best_match.best_score() > min_score && !budget_exceeded());
+
+	if(loop_synthesis && !budget_exceeded())
+	{
+		synthesize_loops();
+#ifdef VALIDATE_PASS
+		validate_pass();
+#endif
 	}
-	while(best_match.best_score() > min_score);
 }
 
+//! Analyze the stack usage of all tracks.
+/*!
+ *  Only the tracks edited since the last call (see add_edit()), and the
+ *  tracks calling them, are analyzed again. The base usage is then
+ *  propagated from the calling tracks to their subroutines in
+ *  topological order.
+ */
 void Optimizer::analyze_stack()
 {
-	stack_analyzer.clear();
-	for(auto && track_it : song->get_track_map())
+	auto& track_map = song->get_track_map();
+
+	// Add new tracks
+	for(auto && track_it : track_map)
 	{
-		Stack_Analyzer& dest = stack_analyzer[track_it.first];
-		if(!dest.base_usage)
+		if(track_it.first >= stack_slot.size())
+			stack_slot.resize(track_it.first + 1, -1);
+		if(stack_slot[track_it.first] < 0)
 		{
-			dest.analyze_track(*song, track_it.second, *this, 0);
-			// Don't optimized unused tracks or macro tracks. TODO: Platform specific
-			if(track_it.first > 15)
-				dest.base_usage = 100;
+			stack_slot[track_it.first] = stack_analyzer.size();
+			stack_analyzer.emplace_back();
+			stack_analyzer.back().track_id = track_it.first;
 		}
 	}
-#if 0
-	if(verbose > 1)
+
+	auto get_slot = [&](int16_t track_id) -> int32_t
+	{
+		if((uint16_t)track_id < stack_slot.size())
+			return stack_slot[(uint16_t)track_id];
+		return -1;
+	};
+
+	// Invalidate the edited tracks and the tracks calling them
+	std::vector<std::vector<uint32_t>> caller_list(stack_analyzer.size());
+	for(uint32_t slot = 0; slot < stack_analyzer.size(); slot++)
+	{
+		stack_analyzer[slot].walked = false;
+		for(auto && mode : stack_analyzer[slot].mode)
+		{
+			for(auto && call : mode.call_list)
+			{
+				if(mode.valid)
+					caller_list[stack_slot[call.track_id]].push_back(slot);
+			}
+		}
+	}
+	std::vector<uint32_t> work_list;
+	for(auto && track_id : stack_changes)
+		work_list.push_back(stack_slot[track_id]);
+	stack_changes.clear();
+	while(work_list.size())
+	{
+		Stack_Analyzer& analyzer = stack_analyzer[work_list.back()];
+		auto& callers = caller_list[work_list.back()];
+		work_list.pop_back();
+		if(!analyzer.mode[0].valid && !analyzer.mode[1].valid)
+			continue;
+		analyzer.mode[0].valid = false;
+		analyzer.mode[1].valid = false;
+		work_list.insert(work_list.end(), callers.begin(), callers.end());
+	}
+
+	// Analyze tracks. A track is entered with the drum mode of the calling
+	// track, while drum mode notes always enter with drum mode off.
+	struct Frame
+	{
+		uint32_t slot;
+		uint8_t mode;
+		uint32_t position;
+		int loop_depth;
+		int16_t drum_mode;
+	};
+	std::vector<Frame> frame_list;
+	auto enter = [&](uint32_t slot, int16_t drum_mode)
+	{
+		Stack_Analyzer& analyzer = stack_analyzer[slot];
+		Stack_Analyzer::Mode& mode = analyzer.mode[drum_mode != 0];
+		analyzer.walked = true;
+		mode = {};
+		mode.parsing = true;
+		frame_list.push_back({slot, (uint8_t)(drum_mode != 0), 0, 0, drum_mode});
+	};
+	for(auto && track_it : track_map)
+	{
+		uint32_t root = stack_slot[track_it.first];
+		if(!stack_analyzer[root].mode[0].valid)
+			enter(root, 0);
+		while(frame_list.size())
+		{
+			Frame& frame = frame_list.back();
+			Stack_Analyzer::Mode& mode = stack_analyzer[frame.slot].mode[frame.mode];
+			auto& events = song->get_track(stack_analyzer[frame.slot].track_id).get_events();
+			bool call = false;
+			for(; frame.position < events.size(); frame.position++)
+			{
+				auto& event = events[frame.position];
+				bool drum_note = frame.drum_mode && event.type == Event::NOTE;
+
+				// A resumed frame restarts at the JUMP or drum note that made the
+				// call, never at a LOOP_START, so loops are only counted once.
+				if(event.type == Event::LOOP_START)
+					frame.loop_depth++;
+
+				int usage = frame.loop_depth * 2;
+				if(event.type == Event::JUMP || drum_note)
+				{
+					usage++;
+					int32_t dest_slot = get_slot(event.param);
+					if(dest_slot >= 0)
+					{
+						uint8_t dest_mode = (event.type == Event::JUMP) ? (frame.drum_mode != 0) : 0;
+						auto& dest = stack_analyzer[dest_slot].mode[dest_mode];
+						if(!dest.valid && !dest.parsing)
+						{
+							enter(dest_slot, dest_mode ? frame.drum_mode : 0);
+							call = true;
+							break;
+						}
+						mode.call_list.push_back({(uint16_t)event.param, dest_mode, (int16_t)usage});
+						usage += dest.max_usage;
+						if(event.type == Event::JUMP && dest.valid && dest.set_drum_mode)
+						{
+							frame.drum_mode = dest.drum_mode;
+							mode.set_drum_mode = true;
+							mode.drum_mode = frame.drum_mode;
+						}
+					}
+				}
+				else if(event.type == Event::DRUM_MODE)
+				{
+					frame.drum_mode = event.param;
+					mode.set_drum_mode = true;
+					mode.drum_mode = frame.drum_mode;
+				}
+				else if(event.type == Event::LOOP_END)
+				{
+					frame.loop_depth--;
+				}
+
+				mode.event_list.push_back(usage);
+				if(usage > mode.max_usage)
+					mode.max_usage = usage;
+			}
+			if(!call)
+			{
+				mode.valid = true;
+				mode.parsing = false;
+				frame_list.pop_back();
+			}
+		}
+	}
+
+	// Find the modes each track is entered with, starting from the tracks that
+	// are not called by another track.
+	std::vector<bool> called(stack_analyzer.size(), false);
+	for(auto && analyzer : stack_analyzer)
+	{
+		for(auto && mode : analyzer.mode)
+		{
+			for(auto && call : mode.call_list)
+			{
+				if(mode.valid)
+					called[stack_slot[call.track_id]] = true;
+			}
+		}
+	}
+	std::vector<uint8_t> old_used(stack_analyzer.size());
+	for(uint32_t slot = 0; slot < stack_analyzer.size(); slot++)
+	{
+		old_used[slot] = stack_analyzer[slot].used;
+		stack_analyzer[slot].used = 0;
+	}
+	std::vector<std::pair<uint32_t, uint8_t>> order; // postorder
+	std::vector<std::pair<uint32_t, uint8_t>> node_list;
+	std::vector<uint32_t> root_list;
+	auto visit = [&](uint32_t root)
 	{
-		for(auto && it : stack_analyzer)
+		root_list.push_back(root);
+		stack_analyzer[root].used |= 1;
+		node_list.push_back({root, 0});
+		std::vector<uint32_t> call_index = {0};
+		while(node_list.size())
 		{
-			Stack_Analyzer& dest = stack_analyzer[it.first];
-			if(dest.base_usage)
-				printf("Track %d base usage = %d, stack usage = %d\n", it.first, it.second.base_usage, it.second.max_usage);
+			auto node = node_list.back();
+			auto& call_list = stack_analyzer[node.first].mode[node.second].call_list;
+			uint32_t& index = call_index.back();
+			if(index < call_list.size())
+			{
+				auto& call = call_list[index++];
+				uint32_t slot = stack_slot[call.track_id];
+				if(!(stack_analyzer[slot].used & (1 << call.mode)))
+				{
+					stack_analyzer[slot].used |= 1 << call.mode;
+					node_list.push_back({slot, call.mode});
+					call_index.push_back(0);
+				}
+			}
 			else
-				printf("Track %d stack usage = %d\n", it.first, dest.max_usage);
+			{
+				order.push_back(node);
+				node_list.pop_back();
+				call_index.pop_back();
+			}
 		}
+	};
+	for(uint32_t slot = 0; slot < stack_analyzer.size(); slot++)
+	{
+		if(!called[slot])
+			visit(slot);
 	}
-#endif
+	// Tracks only called by unreachable tracks
+	for(auto && track_it : track_map)
+	{
+		uint32_t slot = stack_slot[track_it.first];
+		if(!stack_analyzer[slot].used)
+			visit(slot);
+	}
+
+	// Propagate the base usage
+	for(auto && analyzer : stack_analyzer)
+	{
+		analyzer.mode[0].base_usage = 0;
+		analyzer.mode[1].base_usage = 0;
+	}
+	for(auto it = order.rbegin(); it != order.rend(); it++)
+	{
+		auto& mode = stack_analyzer[it->first].mode[it->second];
+		for(auto && call : mode.call_list)
+		{
+			auto& dest = stack_analyzer[stack_slot[call.track_id]].mode[call.mode];
+			if(dest.base_usage < mode.base_usage + call.usage)
+				dest.base_usage = mode.base_usage + call.usage;
+		}
+	}
+
+	for(uint32_t slot = 0; slot < stack_analyzer.size(); slot++)
+	{
+		Stack_Analyzer& analyzer = stack_analyzer[slot];
+		analyzer.base_usage = 0;
+		analyzer.max_usage = 0;
+		for(int i = 0; i < 2; i++)
+		{
+			if(analyzer.used & (1 << i))
+			{
+				analyzer.base_usage = std::max(analyzer.base_usage, analyzer.mode[i].base_usage);
+				analyzer.max_usage = std::max(analyzer.max_usage, analyzer.mode[i].max_usage);
+			}
+		}
+		if(analyzer.walked || analyzer.used != old_used[slot])
+		{
+			if(analyzer.used == 3)
+			{
+				analyzer.event_list = analyzer.mode[0].event_list;
+				for(uint32_t pos = 0; pos < analyzer.event_list.size(); pos++)
+					analyzer.event_list[pos] = std::max(analyzer.event_list[pos], analyzer.mode[1].event_list[pos]);
+			}
+			else
+			{
+				analyzer.event_list = analyzer.mode[analyzer.used >> 1].event_list;
+			}
+		}
+	}
+
+	// Don't optimized unused tracks or macro tracks. TODO: Platform specific
+	for(auto && slot : root_list)
+	{
+		if(stack_analyzer[slot].track_id > 15)
+			stack_analyzer[slot].base_usage = 100;
+	}
+}
+
+//! Get the stack usage of a track.
+/*!
+ *  \exception std::out_of_range if the track has not been analyzed.
+ */
+Optimizer::Stack_Analyzer& Optimizer::get_stack_analyzer(uint16_t track_id)
+{
+	if(track_id >= stack_slot.size() || stack_slot[track_id] < 0)
+		throw std::out_of_range("Optimizer::get_stack_analyzer");
+	return stack_analyzer[stack_slot[track_id]];
 }
 
-unsigned int Optimizer::find_match_length(uint32_t src_track, uint32_t src_start, uint32_t dst_track, uint32_t dst_start, unsigned int* loop_length)
+const Optimizer::Stack_Analyzer& Optimizer::get_stack_analyzer(uint16_t track_id) const
+{
+	if(track_id >= stack_slot.size() || stack_slot[track_id] < 0)
+		throw std::out_of_range("Optimizer::get_stack_analyzer");
+	return stack_analyzer[stack_slot[track_id]];
+}
+
+//! Find the number of matching events between two positions.
+/*!
+ *  If \p transpose is set, the notes at the destination must be
+ *  transposed by that number of semitones. Jumps and transpose commands
+ *  can't be part of a transposed match.
+ */
+unsigned int Optimizer::find_match_length(uint32_t src_track, uint32_t src_start, uint32_t dst_track, uint32_t dst_start, unsigned int* loop_length, int16_t transpose)
 {
 	int loop_depth = 0;
 
@@ -190,6 +561,9 @@ unsigned int Optimizer::find_match_length(uint32_t src_track, uint32_t src_start
 	Track& src = song->get_track(src_track);
 	Track& dst = song->get_track(dst_track);
 
+	// This is called from multiple threads, so the map must not be modified here.
+	const Stack_Analyzer& dst_stack = get_stack_analyzer(dst_track);
+
 	int src_count = src.get_event_count();
 	int dst_count = dst.get_event_count();
 
@@ -202,25 +576,31 @@ unsigned int Optimizer::find_match_length(uint32_t src_track, uint32_t src_start
 		auto& src_event = src.get_event(src_end);
 		auto& dst_event = dst.get_event(dst_end);
 
-		int stack_depth = stack_analyzer[dst_track].event_list[dst_end] + stack_analyzer[dst_track].base_usage;
+		int stack_depth = dst_stack.event_list[dst_end] + dst_stack.base_usage;
 
-		if(stack_depth >= max_loop_stack)
+		if(stack_depth >= max_loop_stack || stack_depth >= max_stack_depth)
 			loop_length = nullptr;
-		if(stack_depth >= max_sub_stack)
+		if(stack_depth >= max_sub_stack || stack_depth >= max_stack_depth)
 			break;
 		else if(dst_event.type == Event::SEGNO || dst_event.type == Event::DRUM_MODE)
 			break;
 		else if((dst_event.type == Event::LOOP_END || dst_event.type == Event::LOOP_BREAK) && !loop_depth)
 			break;
+		else if(transpose && (dst_event.type == Event::JUMP || dst_event.type == Event::TRANSPOSE))
+			break;
 
 		if(dst_event.type == Event::LOOP_START)
 			loop_depth++;
 		else if(dst_event.type == Event::LOOP_END)
 			loop_depth--;
 
+		int16_t src_param = src_event.param;
+		if(src_event.type == Event::NOTE)
+			src_param += transpose;
+
 		//printf("%d==%d,%d\n",src_event.param,dst_event.param,loop_depth);
 		if((src_event.type == dst_event.type &&
-			src_event.param == dst_event.param &&
+			src_param == dst_event.param &&
 			src_event.on_time == dst_event.on_time &&
 			src_event.off_time == dst_event.off_time) ||
 		   (src_event.type == dst_event.type && src_event.type == Event::LOOP_BREAK)) // Player modifies the param though it's normally unused
@@ -232,7 +612,7 @@ unsigned int Optimizer::find_match_length(uint32_t src_track, uint32_t src_start
 			{
 				dst_safe = dst_end;
 				if(loop_length)
-					(*loop_length)++;
+					*loop_length = dst_safe - dst_start;
 			}
 		}
 		else
@@ -244,81 +624,496 @@ unsigned int Optimizer::find_match_length(uint32_t src_track, uint32_t src_start
 	return dst_safe - dst_start;
 }
 
-Optimizer::Match Optimizer::find_match(uint32_t src_track, uint32_t src_start)
+//! Find the transposition between two positions.
+/*!
+ *  This is the interval between the first note at the source position
+ *  and the note at the same offset from the destination position.
+ *
+ *  \return false if there is no note, or if the notes are the same.
+ */
+bool Optimizer::find_transpose(uint32_t src_track, uint32_t src_start, uint32_t dst_track, uint32_t dst_start, int16_t& transpose)
+{
+	Track& src = song->get_track(src_track);
+	Track& dst = song->get_track(dst_track);
+
+	for(uint32_t offset = 0; src_start + offset < src.get_event_count(); offset++)
+	{
+		auto& src_event = src.get_event(src_start + offset);
+		if(src_event.type != Event::NOTE)
+			continue;
+		if(dst_start + offset >= dst.get_event_count())
+			return false;
+		auto& dst_event = dst.get_event(dst_start + offset);
+		if(dst_event.type != Event::NOTE || dst_event.param == src_event.param)
+			return false;
+		transpose = dst_event.param - src_event.param;
+		return true;
+	}
+	return false;
+}
+
+//! Canonicalise an event for the suffix array.
+/*!
+ *  Events that are considered equal by find_match_length() must
+ *  have the same key.
+ */
+static inline uint64_t event_key(const Event& event)
+{
+	// Player modifies the param though it's normally unused
+	if(event.type == Event::LOOP_BREAK)
+		return (uint64_t)event.type << 48;
+	return ((uint64_t)event.type << 48) | ((uint64_t)(uint16_t)event.param << 32) | ((uint64_t)event.on_time << 16) | event.off_time;
+}
+
+//! Canonicalise an event for the interval suffix array.
+/*!
+ *  Notes are keyed by the interval from the previous note.
+ */
+static inline uint64_t interval_key(const Event& event, int16_t& last_note)
+{
+	if(event.type != Event::NOTE)
+		return event_key(event);
+	Event interval = event;
+	interval.param = event.param - last_note;
+	last_note = event.param;
+	return event_key(interval);
+}
+
+// Separators are unique and sort after all events.
+static const uint64_t separator = (uint64_t)Event::CMD_COUNT << 48;
+
+//! Build the suffix array, LCP array and loop hierarchy tables.
+/*!
+ *  If \p interval is set, the interval suffix array is built, along
+ *  with the note index table.
+ */
+void Optimizer::Suffix_Array::build(Song& song, bool interval)
+{
+	track_offset.clear();
+	positions.clear();
+	keys.clear();
+	loop_depth.clear();
+	loop_barrier.clear();
+	note_index.clear();
+
+	uint32_t track_count = 0;
+	for(auto && track_it : song.get_track_map())
+	{
+		auto& events = track_it.second.get_events();
+		uint32_t offset = keys.size();
+		int16_t last_note = 0;
+		track_offset[track_it.first] = offset;
+
+		// Find the first position after each event where the loop
+		// hierarchy would be broken by creating a loop. A loop starting
+		// at a LOOP_START may contain the whole loop.
+		std::vector<std::pair<uint32_t, int32_t>> pending; // index, loop depth
+		int32_t depth = 0;
+		for(uint32_t pos = 0; pos < events.size(); pos++)
+		{
+			auto type = events[pos].type;
+			bool barrier = (type == Event::LOOP_END || type == Event::LOOP_BREAK);
+			while(pending.size() && (type == Event::SEGNO || (barrier && pending.back().second >= depth)))
+			{
+				loop_barrier[pending.back().first] = offset + pos;
+				pending.pop_back();
+			}
+			pending.push_back({offset + pos, depth});
+			if(type == Event::LOOP_START)
+				depth++;
+			else if(type == Event::LOOP_END)
+				depth--;
+
+			if(interval)
+				keys.push_back(interval_key(events[pos], last_note));
+			else
+				keys.push_back(event_key(events[pos]));
+			positions.push_back({track_it.first, pos});
+			loop_depth.push_back(depth);
+			loop_barrier.push_back(0);
+			if(type != Event::LOOP_START)
+				pending.back().second = depth;
+		}
+		for(auto && i : pending)
+			loop_barrier[i.first] = offset + events.size();
+
+		keys.push_back(separator + track_count++);
+		positions.push_back({track_it.first, (uint32_t)events.size()});
+		loop_depth.push_back(depth);
+		loop_barrier.push_back(offset + events.size());
+
+		if(interval)
+		{
+			uint32_t next_note = keys.size() - 1;
+			note_index.resize(keys.size());
+			note_index[next_note] = next_note;
+			for(uint32_t pos = events.size(); pos-- > 0;)
+			{
+				if(events[pos].type == Event::NOTE)
+					next_note = offset + pos;
+				note_index[offset + pos] = next_note;
+			}
+		}
+	}
+
+	// Prefix doubling
+	uint32_t size = keys.size();
+	std::vector<uint32_t> new_rank(size);
+	suffix.resize(size);
+	rank.resize(size);
+	for(uint32_t i = 0; i < size; i++)
+		suffix[i] = i;
+	std::sort(suffix.begin(), suffix.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+	for(uint32_t i = 0; i < size; i++)
+		rank[suffix[i]] = (i && keys[suffix[i]] == keys[suffix[i-1]]) ? rank[suffix[i-1]] : i;
+
+	for(uint32_t k = 1; size && k < size; k <<= 1)
+	{
+		auto compare = [&](uint32_t a, uint32_t b)
+		{
+			if(rank[a] != rank[b])
+				return rank[a] < rank[b];
+			int64_t rank_a = (a + k < size) ? rank[a + k] : -1;
+			int64_t rank_b = (b + k < size) ? rank[b + k] : -1;
+			return rank_a < rank_b;
+		};
+		std::sort(suffix.begin(), suffix.end(), compare);
+		new_rank[suffix[0]] = 0;
+		for(uint32_t i = 1; i < size; i++)
+			new_rank[suffix[i]] = new_rank[suffix[i-1]] + compare(suffix[i-1], suffix[i]);
+		rank.swap(new_rank);
+		if(rank[suffix[size-1]] == size-1)
+			break;
+	}
+
+	// Kasai's LCP algorithm. Separators are unique, so the
+	// common prefix never extends beyond the end of a track.
+	lcp.assign(size, 0);
+	uint32_t length = 0;
+	for(uint32_t i = 0; i < size; i++)
+	{
+		if(rank[i] == 0)
+		{
+			length = 0;
+			continue;
+		}
+		uint32_t j = suffix[rank[i] - 1];
+		while(i + length < size && j + length < size && keys[i + length] == keys[j + length])
+			length++;
+		lcp[rank[i]] = length;
+		if(length)
+			length--;
+	}
+}
+
+//! Get the suffix array index of a track position.
+/*!
+ * \exception std::out_of_range if the track is not found.
+ */
+uint32_t Optimizer::Suffix_Array::get_index(uint16_t track_id, uint32_t position) const
+{
+	return track_offset.at(track_id) + position;
+}
+
+//! Check if the index points to the separator at the end of a track.
+bool Optimizer::Suffix_Array::is_separator(uint32_t index) const
+{
+	return keys[index] >= separator;
+}
+
+//! Get the longest common prefix with any other position.
+uint32_t Optimizer::Suffix_Array::get_max_length(uint32_t index) const
+{
+	uint32_t start = rank[index];
+	uint32_t length = lcp[start];
+	if(start + 1 < lcp.size() && lcp[start + 1] > length)
+		length = lcp[start + 1];
+	return length;
+}
+
+//! Find all positions with a common prefix of at least \p min_length events.
+/*!
+ *  Only positions after \p index are added. The candidate list is
+ *  sorted by track id and position.
+ */
+void Optimizer::Suffix_Array::find_candidates(uint32_t index, uint32_t min_length, std::vector<Candidate>& candidates) const
+{
+	candidates.clear();
+	uint32_t start = rank[index];
+	uint32_t length = UINT32_MAX;
+	for(uint32_t i = start; i > 0 && lcp[i] >= min_length; i--)
+	{
+		length = std::min(length, lcp[i]);
+		if(suffix[i-1] > index)
+			candidates.push_back({suffix[i-1], length});
+	}
+	length = UINT32_MAX;
+	for(uint32_t i = start + 1; i < suffix.size() && lcp[i] >= min_length; i++)
+	{
+		length = std::min(length, lcp[i]);
+		if(suffix[i] > index)
+			candidates.push_back({suffix[i], length});
+	}
+	std::sort(candidates.begin(), candidates.end(),
+		[](const Candidate& a, const Candidate& b) { return a.index < b.index; });
+}
+
+//! Get the total size of a range of events.
+uint32_t Optimizer::Track_Cost::get_size(uint32_t position, uint32_t length) const
+{
+	return offset[position + length] - offset[position];
+}
+
+//! Get the size added to a range of events if the state is reset at the start.
+/*!
+ *  This counts the state registers where the first use in the range
+ *  reused the previous value.
+ */
+uint32_t Optimizer::Track_Cost::get_reset_cost(uint32_t start, uint32_t end) const
+{
+	uint32_t cost = 0;
+	for(unsigned int state = 0; state < next_use.size(); state++)
+	{
+		uint32_t pos = next_use[state][start];
+		if(pos < end && (reuse[pos] & (1 << state)))
+			cost++;
+	}
+	return cost;
+}
+
+//! Calculate the event costs of all tracks.
+void Optimizer::update_cost()
+{
+	const unsigned int state_count = cost_model->get_state_count();
+	std::vector<Cost_Model::Event_Cost> cost_list;
+
+	track_cost.clear();
+	for(auto && track_it : song->get_track_map())
+	{
+		Track_Cost& cost = track_cost[track_it.first];
+		cost_model->get_track_cost(*song, track_it.second, cost_list);
+		uint32_t size = cost_list.size();
+
+		cost.offset.resize(size + 1);
+		cost.reuse.resize(size);
+		cost.offset[0] = 0;
+		for(uint32_t pos = 0; pos < size; pos++)
+		{
+			cost.offset[pos + 1] = cost.offset[pos] + cost_list[pos].size;
+			cost.reuse[pos] = cost_list[pos].reuse;
+		}
+
+		cost.next_use.assign(state_count, std::vector<uint32_t>(size + 1, size));
+		cost.last_use.assign(state_count, std::vector<uint32_t>(size + 1, 0));
+		for(unsigned int state = 0; state < state_count; state++)
+		{
+			auto& next_use = cost.next_use[state];
+			auto& last_use = cost.last_use[state];
+			for(uint32_t pos = size; pos-- > 0;)
+				next_use[pos] = (cost_list[pos].use & (1 << state)) ? pos : next_use[pos + 1];
+			for(uint32_t pos = 0; pos < size; pos++)
+				last_use[pos + 1] = (cost_list[pos].use & (1 << state)) ? pos : last_use[pos];
+		}
+	}
+}
+
+//! Get the range of events that the cost of a span depends on.
+/*!
+ *  The size of an event depends on the state set by the previous events,
+ *  and a match may change the size of the events after it.
+ */
+Optimizer::Span Optimizer::get_cost_context(const Span& span) const
 {
+	const Track_Cost& cost = track_cost.at(span.track_id);
+	Span context = span;
+	if(context.start)
+		context.start--;
+	for(unsigned int state = 0; state < cost.next_use.size(); state++)
+	{
+		uint32_t end = std::min<uint32_t>(span.end + 1, cost.reuse.size());
+		context.start = std::min(context.start, cost.last_use[state][span.start]);
+		context.end = std::max(context.end, cost.next_use[state][end]);
+	}
+	context.end = std::min<uint32_t>(context.end, cost.reuse.size());
+	return context;
+}
+
+//! Find the loop and subroutine matches for a source position.
+/*!
+ *  \param spans If not nullptr, the ranges of events that were read
+ *         to find the match are written here. This is used by the
+ *         match cache.
+ */
+Optimizer::Match Optimizer::find_match(uint32_t src_track, uint32_t src_start, std::vector<Span>* spans)
+{
+	struct Match_Candidate
+	{
+		uint32_t index;
+		uint32_t length; // upper bound of the match length
+		int16_t transpose;
+	};
+
 	Optimizer::Match match = {};
 	std::map<uint32_t,uint32_t> subroutine_count;
+	std::map<uint32_t,int32_t> subroutine_gain;
 	std::map<uint32_t,uint32_t> last_match;
+	std::vector<Suffix_Array::Candidate> candidates;
+	std::vector<Match_Candidate> match_candidates;
+
+	// Positions with a shorter common prefix can not produce a match.
+	uint32_t src_index = suffix_array.get_index(src_track, src_start);
+	suffix_array.find_candidates(src_index, std::min(min_sub_score, min_loop_score), candidates);
+	for(auto && candidate : candidates)
+		match_candidates.push_back({candidate.index, candidate.length, 0});
+
+	// Transposed phrases have the same intervals after the first note. The
+	// transposed matches must include the first note, so they never overlap
+	// with the exact matches.
+	uint32_t note_offset = 0;
+	if(use_transpose && !interval_array.is_separator(interval_array.note_index[src_index]))
+	{
+		note_offset = interval_array.note_index[src_index] - src_index;
+		interval_array.find_candidates(src_index + note_offset + 1, min_sub_score - 1, candidates);
 
-	auto& track_map = song->get_track_map();
+		int16_t src_note = song->get_track(src_track).get_event(src_start + note_offset).param;
+		for(auto && candidate : candidates)
+		{
+			auto& pos = interval_array.positions[candidate.index];
+			if(pos.position < note_offset + 1)
+				continue;
+			auto& dst_note = song->get_track(pos.track_id).get_event(pos.position - 1);
+			if(dst_note.type != Event::NOTE || dst_note.param == src_note)
+				continue;
+			match_candidates.push_back({candidate.index - note_offset - 1,
+				candidate.length + note_offset + 1, (int16_t)(dst_note.param - src_note)});
+		}
+		std::stable_sort(match_candidates.begin(), match_candidates.end(),
+			[](const Match_Candidate& a, const Match_Candidate& b) { return a.index < b.index; });
+	}
 
-	for(auto && dst : track_map)
+	if(spans)
 	{
-		last_match.clear();
-		if(dst.first < src_track)
-			continue;
-		else if(dst.first == src_track)
+		spans->clear();
+		spans->push_back({(uint16_t)src_track, src_start, src_start + suffix_array.get_max_length(src_index)});
+	}
+
+	const Track_Cost& src_cost = track_cost.at(src_track);
+	const uint32_t src_end = src_cost.reuse.size();
+	const int32_t jump_cost = cost_model->get_jump_cost();
+	const int32_t transpose_cost = cost_model->get_transpose_cost();
+
+	// The subroutine must be larger than the transpose commands.
+	uint32_t transpose_length = note_offset + 1;
+	while(use_transpose && src_start + transpose_length <= src_end && src_cost.get_size(src_start, transpose_length)
+			+ src_cost.get_reset_cost(src_start, src_start + transpose_length)
+			<= (uint32_t)(jump_cost + transpose_cost))
+		transpose_length++;
+
+	uint32_t last_track = src_track;
+	const Track_Cost* dst_cost = &src_cost;
+	for(auto && candidate : match_candidates)
+	{
+		uint32_t index = candidate.index;
+		uint32_t dst_track = suffix_array.positions[index].track_id;
+		uint32_t dst_pos = suffix_array.positions[index].position;
+		if(dst_track != last_track)
 		{
-			int loop_depth = 0;
-			bool loop_valid = true;
-			for(unsigned int dst_pos = src_start + 1; dst_pos < dst.second.get_event_count(); dst_pos++)
+			last_match.clear();
+			last_track = dst_track;
+			dst_cost = &track_cost.at(dst_track);
+			if(spans)
+				spans->push_back({(uint16_t)dst_track, dst_pos, dst_pos});
+		}
+		if(spans)
+		{
+			spans->back().end = std::max(spans->back().end, dst_pos + candidate.length);
+			if(candidate.transpose)
+				spans->front().end = std::max(spans->front().end, src_start + candidate.length);
+		}
+
+		// Space saved by replacing an occurence with a subroutine call. The state is
+		// reset after the call.
+		auto sub_gain = [&](uint32_t length) -> int32_t
+		{
+			uint32_t end = dst_pos + length;
+			int32_t gain = dst_cost->get_size(dst_pos, length) - jump_cost
+				- dst_cost->get_reset_cost(end, dst_cost->reuse.size());
+			if(candidate.transpose)
+				gain -= transpose_cost;
+			return gain;
+		};
+
+		// Matches of the same length cannot overlap so we check the distance from the
+		// previous match with the same length
+		auto add_occurences = [&](unsigned int length, unsigned int min_length)
+		{
+			for(; length >= min_length; length--)
 			{
-				// Keep track of the loop depth, as we cannot break the loop hierarchy when creating a new loop
-				auto param = dst.second.get_event(dst_pos).type;
-				if(param == Event::SEGNO)
-					loop_valid = false;
-				else if((param == Event::LOOP_END || param == Event::LOOP_BREAK) && !loop_depth)
-					loop_valid = false; //can't do loop matches beyond this point
-				else if(param == Event::LOOP_END)
-					loop_depth--;
-				else if(param == Event::LOOP_START)
-					loop_depth++;
-
-				unsigned int loop_length = 0;
-				unsigned int length = find_match_length(src_track, src_start, dst.first, dst_pos, &loop_length);
-				if(!length)
-					continue;
-
-				// is it a loop?
-				if(loop_valid && !loop_depth && loop_length >= min_loop_score && loop_length > match.loop_length)
+				if(dst_track == src_track)
 				{
-					match.loop_length = loop_length;
-					match.loop_position = dst_pos;
+					if(dst_pos - last_match[length] < length)
+						continue;
+					last_match[length] = dst_pos;
 				}
-				// subroutine cannot be longer than the distance between the start and itself
-				if(length > (dst_pos - src_start))
-					length = dst_pos - src_start;
-				// Matches of the same length cannot overlap so we check the distance from the
-				// previous match with the same length
-				while(length > min_sub_score)
+				else
 				{
-					if(dst_pos - last_match[length] >= length)
-					{
-						last_match[length] = dst_pos;
-						subroutine_count[length]++;
-					}
-					length--;
+					// special case here since we don't have to worry about overlap for the first
+					// match and can't initialize the default element of the map
+					if(last_match[length] && dst_pos - last_match[length] < (length + 1))
+						continue;
+					last_match[length] = dst_pos + 1;
 				}
+				subroutine_count[length]++;
+				subroutine_gain[length] += sub_gain(length);
 			}
+		};
+
+		if(candidate.transpose)
+		{
+			unsigned int length = find_match_length(src_track, src_start, dst_track, dst_pos, nullptr, candidate.transpose);
+			if(dst_track == src_track && length > (dst_pos - src_start))
+				length = dst_pos - src_start;
+			add_occurences(length, std::max<unsigned int>(transpose_length, min_sub_score + (dst_track == src_track)));
 		}
-		else if(dst.first > src_track)
+		else if(dst_track == src_track)
 		{
-			for(unsigned int dst_pos = 0; dst_pos < dst.second.get_event_count(); dst_pos++)
+			// Keep track of the loop depth, as we cannot break the loop hierarchy when creating a new loop
+			int loop_depth = suffix_array.loop_depth[index] - suffix_array.loop_depth[src_index];
+			bool loop_valid = index < suffix_array.loop_barrier[src_index];
+
+			unsigned int loop_length = 0;
+			unsigned int length = find_match_length(src_track, src_start, dst_track, dst_pos, &loop_length);
+			if(!length)
+				continue;
+
+			// is it a loop?
+			if(loop_valid && !loop_depth && loop_length >= min_loop_score)
 			{
-				//printf("comparing with track %d pos %d\n", dst.first, dst_pos);
-				unsigned int length = find_match_length(src_track, src_start, dst.first, dst_pos);
-				while(length >= min_sub_score)
+				// The state is reset at the start of the loop, and at the end if
+				// there is a break point.
+				uint32_t loop_end = dst_pos + loop_length;
+				bool loop_break = loop_length % (dst_pos - src_start);
+				int32_t score = src_cost.get_size(dst_pos, loop_length)
+					- cost_model->get_loop_cost(loop_break)
+					- src_cost.get_reset_cost(src_start, dst_pos);
+				if(loop_break)
+					score -= src_cost.get_reset_cost(loop_end, src_end);
+				if(score > match.loop_score)
 				{
-					// special case here since we don't have to worry about overlap for the first
-					// match and can't initialize the default element of the map
-					if(!last_match[length] || dst_pos - last_match[length] >= (length + 1))
-					{
-						last_match[length] = dst_pos + 1;
-						subroutine_count[length]++;
-					}
-					length--;
+					match.loop_length = loop_length;
+					match.loop_position = dst_pos;
+					match.loop_score = score;
 				}
 			}
+			// subroutine cannot be longer than the distance between the start and itself
+			if(length > (dst_pos - src_start))
+				length = dst_pos - src_start;
+			add_occurences(length, min_sub_score + 1);
+		}
+		else
+		{
+			unsigned int length = find_match_length(src_track, src_start, dst_track, dst_pos);
+			add_occurences(length, min_sub_score);
 		}
 	}
 	match.track_id = src_track;
@@ -326,7 +1121,13 @@ Optimizer::Match Optimizer::find_match(uint32_t src_track, uint32_t src_start)
 
 	for(auto && i : subroutine_count)
 	{
-		int32_t score = ((i.first - 1) * i.second) - 1;
+		// The source is replaced with a call as well, but the events are moved
+		// to the subroutine where the state is reset at the start.
+		uint32_t end = src_start + i.first;
+		int32_t score = subroutine_gain[i.first] - jump_cost
+			- src_cost.get_reset_cost(end, src_end)
+			- src_cost.get_reset_cost(src_start, end)
+			- cost_model->get_subroutine_cost();
 		if(score > match.sub_score)
 		{
 			match.sub_length = i.first;
@@ -335,34 +1136,71 @@ Optimizer::Match Optimizer::find_match(uint32_t src_track, uint32_t src_start)
 		}
 	}
 
+	// The cost also depends on the surrounding events
+	if(spans)
+	{
+		for(unsigned int i = 0, count = spans->size(); i < count; i++)
+			spans->push_back(get_cost_context((*spans)[i]));
+	}
+
 	return match;
 }
 
 void Optimizer::find_best_match()
 {
-	auto& track_map = song->get_track_map();
 	best_match = {};
+	suffix_array.build(*song);
+
+	// Notes in drum mode are subroutine calls and can't be transposed.
+	use_transpose = transpose;
+	for(auto && track_it : song->get_track_map())
+	{
+		for(auto && event : track_it.second.get_events())
+		{
+			if(event.type == Event::DRUM_MODE && event.param)
+				use_transpose = false;
+		}
+	}
+	if(use_transpose)
+		interval_array.build(*song, true);
+
+	update_cost();
+	update_cache();
 
 	if(verbose > 1)
 		printf("\n");
 
-	for(auto && src : track_map)
+	// Score the positions that are not in the cache
+	std::vector<uint32_t> index_list;
+	for(auto && src : match_cache)
+	{
+		for(unsigned int src_pos = 0; src_pos < src.second.size(); src_pos++)
+		{
+			if(!src.second[src_pos].valid)
+				index_list.push_back(suffix_array.get_index(src.first, src_pos));
+		}
+	}
+	score_matches(index_list);
+
+	std::vector<Cache_Entry*> batch;
+	for(auto && src : match_cache)
 	{
 		if(verbose)
 			print_progress(src.first);
 
-		for(unsigned int src_pos = 0; src_pos < src.second.get_event_count(); src_pos++)
+		for(auto && entry : src.second)
 		{
-			Optimizer::Match match = find_match(src.first, src_pos);
-			if(match.best_score() > best_match.best_score())
-				best_match = match;
+			if(entry.match.best_score() > best_match.best_score())
+				best_match = entry.match;
+			if(batch_size > 1 && entry.match.best_score() > min_score)
+				batch.push_back(&entry);
 		}
 	}
 
 	if(verbose > 1)
 	{
 		printf("\nbest match: track %d, pos %d\n", best_match.track_id, best_match.position);
-		printf("loop pos %d, loop len %d, score %d\n", best_match.loop_position, best_match.loop_length, best_match.loop_score());
+		printf("loop pos %d, loop len %d, score %d\n", best_match.loop_position, best_match.loop_length, best_match.loop_score);
 		printf("sub length %d, repeat %d, sub score %d\n", best_match.sub_length, best_match.sub_repeats, best_match.sub_score);
 	}
 
@@ -370,11 +1208,437 @@ void Optimizer::find_best_match()
 	{
 		if(verbose > 1)
 		{
-			auto& ref = song->get_track(best_match.track_id).get_event(best_match.position).reference;
-			printf("Reference line %d, col %d\n", ref->get_line() + 1, ref->get_column() + 1);
+			auto ref = song->get_source_map().get_reference(song->get_track(best_match.track_id).get_reference(best_match.position));
+			if(ref)
+				printf("Reference line %d, col %d\n", ref->get_line() + 1, ref->get_column() + 1);
+		}
+		if(batch.size() > 1)
+		{
+			// Pick the best matches. The sort is stable, so ties are resolved
+			// in the same order as the best match.
+			std::stable_sort(batch.begin(), batch.end(), [](Cache_Entry* a, Cache_Entry* b)
+				{ return a->match.best_score() > b->match.best_score(); });
+			std::vector<Cache_Entry> best_list;
+			for(unsigned int i = 0; i < batch.size() && i < batch_size; i++)
+				best_list.push_back(*batch[i]);
+			apply_batch(best_list);
 		}
+		else
+		{
+			apply_match();
+		}
+	}
+}
+
+//! Score a list of source positions and write the results to the match cache.
+/*!
+ *  If more than one job is used, the positions are handed out to
+ *  worker threads in small chunks. Each position has its own cache
+ *  entry, so the result does not depend on the number of threads.
+ */
+void Optimizer::score_matches(const std::vector<uint32_t>& index_list)
+{
+	static const uint32_t chunk_size = 64;
+	const uint32_t size = index_list.size();
+
+	std::atomic<uint32_t> next_index(0);
+	std::vector<std::thread> workers;
+
+	auto worker = [&]()
+	{
+		while(1)
+		{
+			uint32_t start = next_index.fetch_add(chunk_size);
+			if(start >= size)
+				break;
+			uint32_t end = std::min(start + chunk_size, size);
+			for(uint32_t i = start; i < end; i++)
+			{
+				auto& pos = suffix_array.positions[index_list[i]];
+				Cache_Entry& entry = match_cache.at(pos.track_id)[pos.position];
+				entry.match = find_match(pos.track_id, pos.position, &entry.spans);
+				entry.valid = true;
+			}
+		}
+	};
+
+	for(unsigned int id = 1; id < jobs; id++)
+		workers.emplace_back(worker);
+	worker();
+	for(auto && thread : workers)
+		thread.join();
+}
+
+//! Replay an edit on the spans of a cache entry.
+/*!
+ *  \return false if the edit overlaps one of the spans, otherwise the
+ *          spans are moved to follow the edit.
+ */
+static bool replay_edit(const Optimizer::Edit& edit, Optimizer::Cache_Entry& entry)
+{
+	int32_t delta = edit.new_length - edit.old_length;
+	for(auto && span : entry.spans)
+	{
+		if(span.track_id != edit.track_id)
+			continue;
+		if(edit.position <= span.end &&
+			(edit.position > span.start || edit.position + edit.old_length > span.start))
+		{
+			return false;
+		}
+		else if(edit.position <= span.start)
+		{
+			span.start += delta;
+			span.end += delta;
+		}
+	}
+	return true;
+}
+
+//! Replay an edit on a list of values, inserting \p value for new events.
+template<typename T>
+static void replay_edit(const Optimizer::Edit& edit, std::vector<T>& list, T value)
+{
+	list.erase(list.begin() + edit.position, list.begin() + edit.position + edit.old_length);
+	list.insert(list.begin() + edit.position, edit.new_length, value);
+}
+
+//! Check if a cache entry spans any of the (sorted) positions of a track.
+static bool spans_position(const Optimizer::Cache_Entry& entry, uint16_t track_id, const std::vector<uint32_t>& positions)
+{
+	for(auto && span : entry.spans)
+	{
+		if(span.track_id != track_id)
+			continue;
+		auto it = std::lower_bound(positions.begin(), positions.end(), span.start);
+		if(it != positions.end() && *it <= span.end)
+			return true;
+	}
+	return false;
+}
+
+//! Find the positions where the stack usage of a track has changed.
+static std::vector<uint32_t> find_stack_changes(const std::vector<int16_t>& old_stack, const std::vector<int16_t>& new_stack)
+{
+	std::vector<uint32_t> changed;
+	for(uint32_t pos = 0; pos < old_stack.size() && pos < new_stack.size(); pos++)
+	{
+		if(old_stack[pos] != new_stack[pos])
+			changed.push_back(pos);
+	}
+	return changed;
+}
+
+//! Get the stack usage at each event of a track.
+std::vector<int16_t> Optimizer::get_stack_usage(uint16_t track_id) const
+{
+	const Stack_Analyzer& analyzer = get_stack_analyzer(track_id);
+	std::vector<int16_t> stack(analyzer.event_list.size());
+	for(uint32_t pos = 0; pos < stack.size(); pos++)
+		stack[pos] = analyzer.event_list[pos] + analyzer.base_usage;
+	return stack;
+}
+
+//! Update the match cache after the edits of the previous pass.
+/*!
+ *  The edits are replayed on the cache, so that the entries follow the
+ *  events they were created from. An entry is invalidated if
+ *    - one of its spans overlaps an edit,
+ *    - the stack usage changed at a position inside one of its spans,
+ *    - it shares a common prefix with a position that reads from the
+ *      edited or added events, as it may have gained a new match.
+ */
+void Optimizer::update_cache()
+{
+	if(!use_cache)
+	{
+		match_cache.clear();
+		cache_stack.clear();
+	}
+
+	std::map<uint16_t, std::vector<bool>> new_content;
+
+	for(auto && edit : edit_list)
+	{
+		for(auto && track : match_cache)
+		{
+			for(auto && entry : track.second)
+			{
+				if(entry.valid)
+					entry.valid = replay_edit(edit, entry);
+			}
+		}
+
+		auto cache_it = match_cache.find(edit.track_id);
+		if(cache_it == match_cache.end())
+			continue;
+		auto& entries = cache_it->second;
+		auto& content = new_content[edit.track_id];
+		if(content.size() != entries.size())
+			content.assign(entries.size(), false);
+
+		replay_edit(edit, entries, Cache_Entry());
+		replay_edit(edit, content, true);
+
+		auto stack_it = cache_stack.find(edit.track_id);
+		if(stack_it != cache_stack.end())
+			replay_edit(edit, stack_it->second, (int16_t)-1);
+	}
+	edit_list.clear();
+
+	for(auto && track_it : song->get_track_map())
+	{
+		uint16_t track_id = track_it.first;
+		uint32_t size = track_it.second.get_event_count();
+
+		// New tracks
+		auto& entries = match_cache[track_id];
+		if(entries.size() != size)
+		{
+			entries.assign(size, Cache_Entry());
+			new_content[track_id].assign(size, true);
+		}
+
+		// Find the positions where the stack usage changed
+		std::vector<int16_t> stack = get_stack_usage(track_id);
+		auto& old_stack = cache_stack[track_id];
+		auto changed = find_stack_changes(old_stack, stack);
+		if(changed.size())
+		{
+			for(auto && track : match_cache)
+			{
+				for(auto && entry : track.second)
+				{
+					if(entry.valid && spans_position(entry, track_id, changed))
+						entry.valid = false;
+				}
+			}
+		}
+		old_stack.swap(stack);
+	}
+
+	// Invalidate positions that may have gained a new match
+	for(auto && content_it : new_content)
+	{
+		auto& content = content_it.second;
+		uint32_t offset = suffix_array.track_offset.at(content_it.first);
+		uint32_t next_edit = UINT32_MAX;
+		std::vector<uint32_t> first_edit(content.size());
+		for(uint32_t pos = content.size(); pos-- > 0;)
+		{
+			if(content[pos])
+				next_edit = pos;
+			first_edit[pos] = next_edit;
+			if(next_edit != UINT32_MAX && next_edit <= pos + suffix_array.get_max_length(offset + pos))
+				invalidate_neighbours(offset + pos);
+		}
+		if(!use_transpose)
+			continue;
+
+		// The interval of a note also depends on the previous note
+		uint32_t last_note = 0;
+		for(uint32_t pos = 0; pos < content.size(); pos++)
+		{
+			if(first_edit[last_note] <= pos + interval_array.get_max_length(offset + pos))
+				invalidate_interval_neighbours(offset + pos);
+			if(interval_array.note_index[offset + pos] == offset + pos)
+				last_note = pos;
+		}
+	}
+
+	// Update positions of the remaining entries
+	for(auto && track : match_cache)
+	{
+		for(uint32_t pos = 0; pos < track.second.size(); pos++)
+		{
+			Match& match = track.second[pos].match;
+			if(!track.second[pos].valid || match.position == pos)
+				continue;
+			if(match.loop_length)
+				match.loop_position += pos - match.position;
+			match.position = pos;
+		}
+	}
+}
+
+//! Invalidate a position and all positions that share a common prefix with it.
+void Optimizer::invalidate_neighbours(uint32_t index)
+{
+	const uint32_t min_length = std::min(min_sub_score, min_loop_score);
+	auto invalidate = [&](uint32_t i)
+	{
+		if(suffix_array.is_separator(i))
+			return;
+		auto& pos = suffix_array.positions[i];
+		match_cache.at(pos.track_id)[pos.position].valid = false;
+	};
+
+	uint32_t start = suffix_array.rank[index];
+	invalidate(index);
+	for(uint32_t i = start; i > 0 && suffix_array.lcp[i] >= min_length; i--)
+		invalidate(suffix_array.suffix[i-1]);
+	for(uint32_t i = start + 1; i < suffix_array.suffix.size() && suffix_array.lcp[i] >= min_length; i++)
+		invalidate(suffix_array.suffix[i]);
+}
+
+//! Invalidate the positions that may find a transposed match at an interval array index.
+/*!
+ *  The transposed matches of a position are found from the index after
+ *  its first note, see find_match().
+ */
+void Optimizer::invalidate_interval_neighbours(uint32_t index)
+{
+	const uint32_t min_length = min_sub_score - 1;
+	auto invalidate = [&](uint32_t i)
+	{
+		uint32_t note = i - 1;
+		if(!i || interval_array.note_index[note] != note || interval_array.is_separator(note))
+			return;
+		for(uint32_t j = note; interval_array.note_index[j] == note; j--)
+		{
+			auto& pos = interval_array.positions[j];
+			match_cache.at(pos.track_id)[pos.position].valid = false;
+			if(!j)
+				break;
+		}
+	};
+
+	uint32_t start = interval_array.rank[index];
+	invalidate(index);
+	for(uint32_t i = start; i > 0 && interval_array.lcp[i] >= min_length; i--)
+		invalidate(interval_array.suffix[i-1]);
+	for(uint32_t i = start + 1; i < interval_array.suffix.size() && interval_array.lcp[i] >= min_length; i++)
+		invalidate(interval_array.suffix[i]);
+}
+
+//! Record an edit for the match cache.
+void Optimizer::add_edit(uint16_t track_id, uint32_t position, uint32_t old_length, uint32_t new_length)
+{
+	edit_list.push_back({track_id, position, old_length, new_length});
+	changed_tracks.insert(track_id);
+	stack_changes.insert(track_id);
+}
+
+//! Validate the tracks changed since the last call.
+/*!
+ *  The changed tracks and all tracks calling them are played with
+ *  Track_Validator. The play and loop lengths are then compared with
+ *  the lengths in the original song, if the track existed there.
+ *
+ *  \exception std::logic_error if the length of a track has changed.
+ *  \exception InputError if any validation errors occur.
+ */
+void Optimizer::validate_pass()
+{
+	// New tracks have not been validated yet
+	for(auto && track_it : song->get_track_map())
+	{
+		if(!track_time.count(track_it.first))
+			changed_tracks.insert(track_it.first);
+	}
+
+	// Update the callers of the changed tracks. Removed calls are left in the map,
+	// which may only cause a track to be validated when it didn't need to be.
+	for(auto && id : changed_tracks)
+	{
+		for(auto && event : song->get_track(id).get_events())
+		{
+			if(event.type == Event::JUMP)
+				callers[event.param].insert(id);
+		}
+	}
+
+	std::set<uint16_t> validate_list;
+	std::vector<uint16_t> stack(changed_tracks.begin(), changed_tracks.end());
+	while(stack.size())
+	{
+		uint16_t id = stack.back();
+		stack.pop_back();
+		if(!validate_list.insert(id).second)
+			continue;
+		auto it = callers.find(id);
+		if(it != callers.end())
+			stack.insert(stack.end(), it->second.begin(), it->second.end());
+	}
+	changed_tracks.clear();
+
+	for(auto && id : validate_list)
+	{
+		Track_Validator validator(*song, song->get_track(id));
+		Track_Time time = {validator.get_play_time(), validator.get_loop_length()};
+		track_time[id] = time;
+
+		auto it = reference_time.find(id);
+		if(it != reference_time.end()
+			&& (it->second.play_time != time.play_time || it->second.loop_length != time.loop_length))
+		{
+			throw std::logic_error(stringf("Optimizer: track %d length changed from %d (loop %d) to %d (loop %d) in pass %d",
+				id, it->second.play_time, it->second.loop_length, time.play_time, time.loop_length, pass));
+		}
+	}
+}
+
+//! Apply a list of matches, sorted by score.
+/*!
+ *  After each match is applied, the edits are replayed on the
+ *  remaining matches and the stack usage is analyzed again. Matches
+ *  that read from an edited range or from a position where the stack
+ *  usage changed are skipped, since they may no longer be valid.
+ */
+void Optimizer::apply_batch(std::vector<Cache_Entry>& batch)
+{
+	Match top_match = best_match;
+	unsigned int edit_start = edit_list.size();
+	unsigned int applied = 0;
+
+	std::map<uint16_t, std::vector<int16_t>> stack_usage;
+	for(auto && track_it : song->get_track_map())
+		stack_usage[track_it.first] = get_stack_usage(track_it.first);
+
+	for(unsigned int i = 0; i < batch.size(); i++)
+	{
+		if(!batch[i].valid)
+			continue;
+
+		// Follow the source position
+		best_match = batch[i].match;
+		int32_t delta = batch[i].spans.front().start - best_match.position;
+		best_match.position += delta;
+		if(best_match.loop_length)
+			best_match.loop_position += delta;
 		apply_match();
+		applied++;
+
+		for(; edit_start < edit_list.size(); edit_start++)
+		{
+			auto& edit = edit_list[edit_start];
+			for(unsigned int j = i + 1; j < batch.size(); j++)
+			{
+				if(batch[j].valid)
+					batch[j].valid = replay_edit(edit, batch[j]);
+			}
+			auto stack_it = stack_usage.find(edit.track_id);
+			if(stack_it != stack_usage.end())
+				replay_edit(edit, stack_it->second, (int16_t)-1);
+		}
+
+		analyze_stack();
+		for(auto && track_it : song->get_track_map())
+		{
+			std::vector<int16_t> stack = get_stack_usage(track_it.first);
+			auto changed = find_stack_changes(stack_usage[track_it.first], stack);
+			for(unsigned int j = i + 1; j < batch.size() && changed.size(); j++)
+			{
+				if(batch[j].valid && spans_position(batch[j], track_it.first, changed))
+					batch[j].valid = false;
+			}
+			stack_usage[track_it.first].swap(stack);
+		}
 	}
+
+	if(verbose > 1)
+		printf("Applied %d of %d matches\n", applied, (int)batch.size());
+	best_match = top_match;
 }
 
 void Optimizer::print_progress(int track_id)
@@ -405,22 +1669,18 @@ void Optimizer::print_progress(int track_id)
 void Optimizer::apply_match()
 {
 	auto& src_track = song->get_track(best_match.track_id);
-	auto& src_events = src_track.get_events();
 
-	if(best_match.loop_score() < best_match.sub_score)
+	if(best_match.loop_score < best_match.sub_score)
 	{
 		// Subroutine
 		if(verbose > 1)
 			printf("Create subroutine id %d\n", sub_id);
 		auto& sub_track = song->make_track(sub_id);
-		auto& sub_events = sub_track.get_events();
 
 		// Copy source events
-		sub_events.insert(sub_events.end(),
-			src_events.begin() + best_match.position,
-			src_events.begin() + best_match.position + best_match.sub_length);
+		sub_track.insert_events(sub_track.get_event_count(), src_track, best_match.position, best_match.sub_length);
 
-		replace_with_subroutine(src_events, best_match.track_id, best_match.position, best_match.sub_length);
+		replace_with_subroutine(src_track, best_match.track_id, best_match.position, best_match.sub_length);
 
 		find_subroutines();
 		sub_id++;
@@ -437,21 +1697,22 @@ void Optimizer::apply_match()
 
 		if(verbose > 1)
 		{
-			auto& ref = song->get_track(best_match.track_id).get_event(best_match.loop_position).reference;
-			printf("Repeat reference line %d, col %d\n", ref->get_line() + 1, ref->get_column() + 1);
+			auto ref = song->get_source_map().get_reference(src_track.get_reference(best_match.loop_position));
+			if(ref)
+				printf("Repeat reference line %d, col %d\n", ref->get_line() + 1, ref->get_column() + 1);
 			printf("Create loop length=%d bp=%d repeats=%d\n", length, break_point, repeats);
 		}
 
 		// Delete the trailing data
-		src_events.erase(src_events.begin() + best_match.loop_position,
-			src_events.begin() + best_match.loop_position + best_match.loop_length);
+		src_track.erase_events(best_match.loop_position, best_match.loop_length);
+		add_edit(best_match.track_id, best_match.loop_position, best_match.loop_length, 0);
 
 		// Add loop commands
-		std::shared_ptr<InputRef> reference = src_events[position].reference;
-		add_event(src_events, best_match.track_id, position + length, Event::LOOP_END, repeats, reference);
+		Source_Location reference = src_track.get_reference(position);
+		add_event(src_track, best_match.track_id, position + length, Event::LOOP_END, repeats, reference);
 		if(break_point)
-			add_event(src_events, best_match.track_id, position + break_point, Event::LOOP_BREAK, 0, reference);
-		add_event(src_events, best_match.track_id, position, Event::LOOP_START, 0, reference);
+			add_event(src_track, best_match.track_id, position + break_point, Event::LOOP_BREAK, 0, reference);
+		add_event(src_track, best_match.track_id, position, Event::LOOP_START, 0, reference);
 	}
 
 #if 0
@@ -468,12 +1729,209 @@ void Optimizer::apply_match()
 #endif
 }
 
+//! Find the loops to create in a range of a track.
+/*!
+ *  The range is scanned from the start. At each position, the loop
+ *  period with the highest score is picked and the scan continues after
+ *  the repeated events. The last iteration may be shorter than the
+ *  period, in which case a loop break is used.
+ *
+ *  The loop body is searched for nested loops, and their score is
+ *  added to the score of the loop, so that a nested loop structure is
+ *  picked even if the loops score poorly on their own.
+ *
+ *  \param extra_usage Stack usage of the new loops enclosing the range.
+ *  \param min_gain Minimum score of a loop.
+ *  \return The estimated number of bytes saved.
+ */
+int32_t Optimizer::find_loops(uint16_t track_id, uint32_t start, uint32_t end, int extra_usage, int32_t min_gain, std::vector<Loop>& loops)
+{
+	const Track::Event_List& events = song->get_track(track_id).get_events();
+	const Track_Cost& cost = track_cost.at(track_id);
+	const Stack_Analyzer& stack = get_stack_analyzer(track_id);
+	const uint32_t track_end = cost.reuse.size();
+	const int stack_limit = std::min(max_loop_stack, max_stack_depth) - extra_usage;
+
+	// The loop body must not break the loop hierarchy.
+	auto valid_body = [&](uint32_t position, uint32_t length)
+	{
+		int depth = 0;
+		for(uint32_t pos = position; pos < position + length; pos++)
+		{
+			auto type = events[pos].type;
+			if(type == Event::SEGNO || type == Event::DRUM_MODE)
+				return false;
+			else if(type == Event::LOOP_START)
+				depth++;
+			else if((type == Event::LOOP_END && --depth < 0) || (type == Event::LOOP_BREAK && !depth))
+				return false;
+		}
+		return !depth;
+	};
+
+	int32_t total_score = 0;
+	for(uint32_t pos = start; pos < end;)
+	{
+		Loop best_loop = {};
+		int32_t best_score = min_gain;
+		for(uint32_t length = 1; pos + length + min_loop_score <= end; length++)
+		{
+			auto& src_event = events[pos];
+			auto& dst_event = events[pos + length];
+			if(src_event.type != dst_event.type || src_event.param != dst_event.param
+				|| src_event.on_time != dst_event.on_time || src_event.off_time != dst_event.off_time)
+				continue;
+
+			unsigned int repeat_length = 0;
+			find_match_length(track_id, pos, track_id, pos + length, &repeat_length);
+			repeat_length = std::min(repeat_length, end - pos - length);
+			if(repeat_length < (unsigned int)min_loop_score)
+				continue;
+
+			uint32_t repeat_end = pos + length + repeat_length;
+			uint32_t break_point = repeat_length % length;
+			int32_t score = cost.get_size(pos + length, repeat_length)
+				- cost_model->get_loop_cost(break_point)
+				- cost.get_reset_cost(pos, pos + length);
+			if(break_point)
+				score -= cost.get_reset_cost(repeat_end, track_end);
+
+			// Nested loops can't save more than the size of the body
+			if(score + (int32_t)cost.get_size(pos, length) <= best_score)
+				continue;
+			if(!valid_body(pos, length))
+				continue;
+			int max_usage = 0;
+			for(uint32_t i = pos; i < repeat_end; i++)
+				max_usage = std::max<int>(max_usage, stack.event_list[i] + stack.base_usage);
+			if(max_usage >= stack_limit)
+				continue;
+
+			std::vector<Loop> inner_loops;
+			if(max_usage + 2 < stack_limit)
+			{
+				if(break_point)
+					score += find_loops(track_id, pos, pos + break_point, extra_usage + 2, 0, inner_loops);
+				score += find_loops(track_id, pos + break_point, pos + length, extra_usage + 2, 0, inner_loops);
+			}
+			if(score > best_score)
+			{
+				best_score = score;
+				best_loop = {pos, length, repeat_length, inner_loops};
+			}
+		}
+		if(best_loop.length)
+		{
+			total_score += best_score;
+			pos += best_loop.length + best_loop.repeat_length;
+			loops.push_back(best_loop);
+		}
+		else
+		{
+			pos++;
+		}
+	}
+	return total_score;
+}
+
+//! Remove the repeated events and insert the loop commands.
+/*!
+ *  Only the loops starting between \p start and \p end are inserted.
+ *  The loops are inserted from the last one, so that the positions of
+ *  the earlier loops are unchanged.
+ */
+static void insert_loops(Track& track, uint32_t start, uint32_t end, const std::vector<Optimizer::Loop>& loops)
+{
+	for(auto it = loops.rbegin(); it != loops.rend(); it++)
+	{
+		auto& loop = *it;
+		if(loop.position < start || loop.position >= end)
+			continue;
+
+		uint32_t body_end = loop.position + loop.length;
+		uint32_t break_point = loop.repeat_length % loop.length;
+		int16_t repeats = loop.repeat_length / loop.length + 1;
+		if(break_point)
+			repeats++;
+
+		Source_Location reference = track.get_reference(loop.position);
+		uint32_t start_time = track.get_play_time(loop.position);
+		uint32_t break_time = track.get_play_time(loop.position + break_point);
+		uint32_t end_time = track.get_play_time(body_end);
+
+		track.erase_events(body_end, loop.repeat_length);
+		track.insert_event(body_end, {Event::LOOP_END, repeats, 0, 0}, end_time, reference);
+		insert_loops(track, loop.position + break_point, body_end, loop.inner_loops);
+		if(break_point)
+		{
+			track.insert_event(loop.position + break_point, {Event::LOOP_BREAK, 0, 0, 0}, break_time, reference);
+			insert_loops(track, loop.position, loop.position + break_point, loop.inner_loops);
+		}
+		track.insert_event(loop.position, {Event::LOOP_START, 0, 0, 0}, start_time, reference);
+	}
+}
+
+//! Replace repeated patterns with nested loops in all tracks.
+/*!
+ *  This is done after the match search. find_match() scores each loop
+ *  on its own, while find_loops() scores nested loops and break points
+ *  together, which catches the repeats left over by the greedy passes.
+ */
+void Optimizer::synthesize_loops()
+{
+	analyze_stack();
+	update_cost();
+	for(auto && track_it : song->get_track_map())
+	{
+		auto& track = track_it.second;
+		uint32_t old_length = track.get_event_count();
+		std::vector<Loop> loops;
+		if(find_loops(track_it.first, 0, old_length, 0, min_score, loops) <= 0)
+			continue;
+
+		insert_loops(track, 0, old_length, loops);
+		if(verbose > 1)
+			printf("Track %d: created %d loops, %d -> %d events\n", track_it.first, (int)loops.size(), old_length, (int)track.get_event_count());
+		add_edit(track_it.first, 0, old_length, track.get_event_count());
+
+		// The base usage of subroutines called inside the loops has changed
+		analyze_stack();
+	}
+}
+
 void Optimizer::find_subroutines()
 {
 	uint32_t src_track = best_match.track_id;
 	uint32_t src_start = best_match.position;
 	auto& track_map = song->get_track_map();
 
+	// Transposed occurences are only replaced if the subroutine is larger than
+	// the transpose commands.
+	bool transposed = false;
+	if(use_transpose)
+	{
+		std::vector<Cost_Model::Event_Cost> cost_list;
+		cost_model->get_track_cost(*song, song->get_track(sub_id), cost_list);
+		uint32_t size = 0;
+		for(auto && cost : cost_list)
+			size += cost.size;
+		transposed = size > cost_model->get_jump_cost() + cost_model->get_transpose_cost();
+	}
+
+	auto replace = [&](Track& dst_track, uint32_t dst_id, unsigned int& dst_pos)
+	{
+		int16_t transpose = 0;
+		unsigned int length = find_match_length(sub_id, 0, dst_id, dst_pos);
+		if(length != best_match.sub_length && transposed && find_transpose(sub_id, 0, dst_id, dst_pos, transpose))
+			length = find_match_length(sub_id, 0, dst_id, dst_pos, nullptr, transpose);
+		if(length == best_match.sub_length)
+		{
+			replace_with_subroutine(dst_track, dst_id, dst_pos, length, transpose);
+			if(transpose)
+				dst_pos += 2;
+		}
+	};
+
 	for(auto && dst : track_map)
 	{
 		if(dst.first < src_track || dst.first == sub_id)
@@ -481,51 +1939,58 @@ void Optimizer::find_subroutines()
 		else if(dst.first == src_track)
 		{
 			for(unsigned int dst_pos = src_start + 1; dst_pos < dst.second.get_event_count(); dst_pos++)
-			{
-				unsigned int length = find_match_length(sub_id, 0, dst.first, dst_pos);
-				if(length == best_match.sub_length)
-					replace_with_subroutine(dst.second.get_events(), dst.first, dst_pos, length);
-			}
+				replace(dst.second, dst.first, dst_pos);
 		}
 		else if(dst.first > src_track)
 		{
 			for(unsigned int dst_pos = 0; dst_pos < dst.second.get_event_count(); dst_pos++)
-			{
-				unsigned int length = find_match_length(sub_id, 0, dst.first, dst_pos);
-				if(length == best_match.sub_length)
-					replace_with_subroutine(dst.second.get_events(), dst.first, dst_pos, length);
-			}
+				replace(dst.second, dst.first, dst_pos);
 		}
 	}
 }
 
-void Optimizer::replace_with_subroutine(std::vector<Event>& event_list, uint32_t track_id, uint32_t position, uint32_t length)
+//! Replace an occurence with a subroutine call.
+/*!
+ *  If \p transpose is set, the call is surrounded by relative transpose
+ *  commands.
+ */
+void Optimizer::replace_with_subroutine(Track& track, uint32_t track_id, uint32_t position, uint32_t length, int16_t transpose)
 {
 	if(verbose > 1)
-		printf("replace subroutine track id=%d, %d, %d\n",track_id,position,length);
+		printf("replace subroutine track id=%d, %d, %d, transpose %d\n",track_id,position,length,transpose);
 
 	// Copy reference + play time
-	std::shared_ptr<InputRef> reference = event_list[position].reference;
-	uint32_t play_time = event_list[position].play_time;
+	Source_Location reference = track.get_reference(position);
+	uint32_t play_time = track.get_play_time(position);
 
 	// Replace occurence
-	event_list.erase(event_list.begin() + position, event_list.begin() + position + length);
-	event_list.insert(event_list.begin() + position, {Event::JUMP,sub_id,0,0,play_time,reference});
+	std::vector<Event> call = {{Event::JUMP,sub_id,0,0}};
+	if(transpose)
+	{
+		call.insert(call.begin(), {Event::TRANSPOSE_REL,transpose,0,0});
+		call.push_back({Event::TRANSPOSE_REL,(int16_t)-transpose,0,0});
+	}
+	track.erase_events(position, length);
+	for(unsigned int i = 0; i < call.size(); i++)
+		track.insert_event(position + i, call[i], play_time, reference);
+	add_edit(track_id, position, length, call.size());
 
 	// update stack depth event list (Not important what we set the replacement value to)
-	auto& stack_list = stack_analyzer[track_id].event_list;
-	stack_list.erase(stack_list.begin() + position, stack_list.begin() + position + length - 1);
+	auto& stack_list = get_stack_analyzer(track_id).event_list;
+	stack_list.erase(stack_list.begin() + position + 1, stack_list.begin() + position + length);
+	stack_list.insert(stack_list.begin() + position + 1, call.size() - 1, stack_list[position]);
 }
 
-void Optimizer::add_event(std::vector<Event>& event_list, uint32_t track_id, uint32_t position, Event::Type type, int16_t param, std::shared_ptr<InputRef>& reference)
+void Optimizer::add_event(Track& track, uint32_t track_id, uint32_t position, Event::Type type, int16_t param, const Source_Location& reference)
 {
 	if(verbose > 1)
 		printf("add event track id=%d, %d, type %d param %d\n",track_id,position,type,param);
 
-	// Copy reference + play time
-	uint32_t play_time = event_list[position].play_time;
+	// Copy play time
+	uint32_t play_time = (position < track.get_event_count()) ? track.get_play_time(position) : UINT_MAX;
 
 	// Replace occurence
-	event_list.insert(event_list.begin() + position, {type,param,0,0,play_time,reference});
+	track.insert_event(position, {type,param,0,0}, play_time, reference);
+	add_edit(track_id, position, 0, 1);
 }
 
@@ -6,20 +6,86 @@
 #include "core.h"
 #include "track.h"
 #include <stack>
+#include <set>
 #include <memory>
+#include <chrono>
 
 class Optimizer;
 
+//! Optimizer cost model.
+/*!
+ *  Estimates the size of the converted track data, so that the
+ *  optimizer can score a match by the space it saves.
+ *
+ *  The size of an event may depend on a number of state registers (for
+ *  example the last used note length). Each event reports the state
+ *  registers it uses, and the ones where it was made smaller by reusing
+ *  the previous value. Jumps and loop starts, as well as loop ends when
+ *  the loop has a break point, are assumed to reset the state.
+ *
+ *  The default implementation counts events.
+ */
+class Cost_Model
+{
+	public:
+		//! Estimated size of an event.
+		struct Event_Cost
+		{
+			uint16_t size;
+			uint8_t use; //!< Bitmask of the state registers used by the event.
+			uint8_t reuse; //!< Bitmask of the state registers where the previous value was reused.
+		};
+
+		virtual ~Cost_Model()
+		{
+		}
+
+		virtual unsigned int get_state_count() const;
+		virtual void get_track_cost(Song& song, Track& track, std::vector<Event_Cost>& cost_list) const;
+		virtual unsigned int get_jump_cost() const;
+		virtual unsigned int get_subroutine_cost() const;
+		virtual unsigned int get_loop_cost(bool loop_break) const;
+		virtual unsigned int get_transpose_cost() const;
+};
+
 /*! Track optimizer
  */
 class Optimizer
 {
 	public:
+		//! Stack usage of a track.
+		/*!
+		 *  A track is analyzed once for each drum mode state it is
+		 *  entered with. The result is kept until the track or one of
+		 *  the subroutines it calls is edited.
+		 */
 		struct Stack_Analyzer
 		{
-			// returns drum mode status
-			int analyze_track(Song&, Track& track, Optimizer& optimizer, int drum_mode);
-			bool parsing = false; // avoid infinite nesting
+			//! Subroutine call or drum mode note.
+			struct Call
+			{
+				uint16_t track_id;
+				uint8_t mode; // drum mode state of the called track
+				int16_t usage; // stack usage at the call, excluding the called track
+			};
+
+			//! Analysis for a drum mode state.
+			struct Mode
+			{
+				bool valid = false;
+				bool parsing = false; // avoid infinite nesting
+				bool set_drum_mode = false; // drum mode is set by the track or its subroutines
+				int16_t drum_mode = 0; // drum mode when returning, if set_drum_mode is set
+				int16_t base_usage = 0;
+				int16_t max_usage = 0;
+				std::vector<int16_t> event_list;
+				std::vector<Call> call_list;
+			};
+
+			uint16_t track_id;
+			bool walked = false; // analyzed again since the last call to analyze_stack()
+			uint8_t used = 0; // bitmask of the modes the track is entered with
+			Mode mode[2]; // entered with drum mode off and on
 
 			int16_t base_usage = 0; // set by calling tracks if subroutine
 			int16_t max_usage = 0;
@@ -37,54 +103,206 @@ class Optimizer
 
 			uint32_t sub_length = 0;
 			uint32_t sub_repeats = 0;
+			int32_t loop_score = 0;
+
 			int32_t sub_score = 0;
 
-			inline int32_t loop_score()
-			{
-				return loop_length - 2;
-			}
 			inline int32_t best_score()
 			{
-				int32_t score = loop_score();
+				int32_t score = loop_score;
 				return (sub_score > score) ? sub_score : score;
 			}
 			// internally used to determine the best score
 			//<sub length,sub count>
 		};
 
-		Optimizer(Song& song, int verbose = 0);
+		//! Suffix array over the canonicalised events of all tracks.
+		/*!
+		 *  The tracks are concatenated in track map order, each followed
+		 *  by a unique separator so that no match can cross a track
+		 *  boundary. The LCP array is then used to find all positions
+		 *  sharing a common prefix with a source position without having
+		 *  to compare against every position in the song.
+		 *
+		 *  An interval suffix array keys notes by the interval from the
+		 *  previous note instead, and is used to find transposed matches.
+		 */
+		struct Suffix_Array
+		{
+			struct Position
+			{
+				uint16_t track_id;
+				uint32_t position;
+			};
+
+			struct Candidate
+			{
+				uint32_t index;
+				uint32_t length; // common prefix length
+			};
 
+			void build(Song& song, bool interval = false);
+			uint32_t get_index(uint16_t track_id, uint32_t position) const;
+			bool is_separator(uint32_t index) const;
+			uint32_t get_max_length(uint32_t index) const;
+			void find_candidates(uint32_t index, uint32_t min_length, std::vector<Candidate>& candidates) const;
+
+			std::map<uint16_t, uint32_t> track_offset; // track id -> index of first event
+			std::vector<Position> positions; // index -> track id/event position
+			std::vector<uint64_t> keys; // canonicalised events
+			std::vector<uint32_t> suffix; // sorted suffix indexes
+			std::vector<uint32_t> rank; // inverse of suffix
+			std::vector<uint32_t> lcp; // lcp[i] = common prefix length of suffix[i-1] and suffix[i]
+			std::vector<int32_t> loop_depth; // loop depth after the event
+			std::vector<uint32_t> loop_barrier; // first index where a loop can no longer be created
+			std::vector<uint32_t> note_index; // interval array only: index of the first note at or after the index
+		};
+
+		//! Event costs of a track, see Cost_Model.
+		struct Track_Cost
+		{
+			uint32_t get_size(uint32_t position, uint32_t length) const;
+			uint32_t get_reset_cost(uint32_t start, uint32_t end) const;
+
+			std::vector<uint32_t> offset; // sum of the event sizes before each position
+			std::vector<uint8_t> reuse;
+			std::vector<std::vector<uint32_t>> next_use; // [state][position] first position >= position using the state
+			std::vector<std::vector<uint32_t>> last_use; // [state][position] last position < position using the state
+		};
+
+		//! Range of events read by find_match().
+		struct Span
+		{
+			uint16_t track_id;
+			uint32_t start;
+			uint32_t end; // inclusive
+		};
+
+		//! Match cache entry.
+		/*!
+		 *  The match is kept between passes until an edit or a change
+		 *  in stack usage overlaps one of the spans.
+		 */
+		struct Cache_Entry
+		{
+			bool valid = false;
+			Match match;
+			std::vector<Span> spans;
+		};
+
+		//! Loop found by find_loops().
+		struct Loop
+		{
+			uint32_t position; // start of the loop body
+			uint32_t length; // length of the loop body
+			uint32_t repeat_length; // length of the repeated events after the body
+			std::vector<Loop> inner_loops;
+		};
+
+		//! Edit made to a track by apply_match().
+		struct Edit
+		{
+			uint16_t track_id;
+			uint32_t position;
+			uint32_t old_length;
+			uint32_t new_length;
+		};
+
+		//! Play and loop length of a track, see validate_pass().
+		struct Track_Time
+		{
+			unsigned int play_time;
+			unsigned int loop_length;
+		};
+
+		Optimizer(Song& song, int verbose = 0, unsigned int jobs = 1);
+
+		void read_options(const Tag& tag);
+		unsigned int get_size() const;
+		bool budget_exceeded() const;
 		void optimize();
 		void analyze_stack();
+		Stack_Analyzer& get_stack_analyzer(uint16_t track_id);
+		const Stack_Analyzer& get_stack_analyzer(uint16_t track_id) const;
 
-		unsigned int find_match_length(uint32_t src_track, uint32_t src_start, uint32_t dst_track, uint32_t dst_start, unsigned int* loop_length = nullptr);
-		Match find_match(uint32_t src_track, uint32_t src_start);
+		unsigned int find_match_length(uint32_t src_track, uint32_t src_start, uint32_t dst_track, uint32_t dst_start, unsigned int* loop_length = nullptr, int16_t transpose = 0);
+		bool find_transpose(uint32_t src_track, uint32_t src_start, uint32_t dst_track, uint32_t dst_start, int16_t& transpose);
+		Match find_match(uint32_t src_track, uint32_t src_start, std::vector<Span>* spans = nullptr);
 		void find_best_match();
+		void score_matches(const std::vector<uint32_t>& index_list);
 		void apply_match();
 
+		void apply_batch(std::vector<Cache_Entry>& batch);
+
+		void update_cost();
+		Span get_cost_context(const Span& span) const;
+
+		void update_cache();
+		void invalidate_neighbours(uint32_t index);
+		void invalidate_interval_neighbours(uint32_t index);
+		void add_edit(uint16_t track_id, uint32_t position, uint32_t old_length, uint32_t new_length);
+		std::vector<int16_t> get_stack_usage(uint16_t track_id) const;
+
+		void validate_pass();
+
+		int32_t find_loops(uint16_t track_id, uint32_t start, uint32_t end, int extra_usage, int32_t min_gain, std::vector<Loop>& loops);
+		void synthesize_loops();
+
 		void find_subroutines();
-		void replace_with_subroutine(std::vector<Event>& event_list, uint32_t track_id, uint32_t position, uint32_t length);
-		void add_event(std::vector<Event>& event_list, uint32_t track_id, uint32_t position, Event::Type type, int16_t param, std::shared_ptr<InputRef>& reference);
+		void replace_with_subroutine(Track& track, uint32_t track_id, uint32_t position, uint32_t length, int16_t transpose = 0);
+		void add_event(Track& track, uint32_t track_id, uint32_t position, Event::Type type, int16_t param, const Source_Location& reference);
 
 		void print_progress(int track_id);
 
-		static const int max_stack_depth;
 		static const int min_sub_score;
 		static const int min_loop_score;
-		static const int max_sub_stack;
-		static const int max_loop_stack;
 
 		int16_t sub_id;
 		int pass;
 
 		int verbose;
+		unsigned int jobs; // number of worker threads used by find_best_match()
+		bool use_cache; // keep matches between passes
+		unsigned int batch_size; // max number of matches to apply per pass
+		bool transpose; // share subroutines between transposed phrases
+		bool loop_synthesis; // create nested loops after searching for matches
+		bool use_transpose; // transpose is set and the song doesn't use drum mode
 		int min_score;
+		int max_stack_depth; // max stack usage where a loop or subroutine may be created
+		int max_sub_stack;
+		int max_loop_stack;
+
+		// Budget, zero means no limit.
+		double max_time; // seconds
+		int max_passes;
+		unsigned int target_size; // estimated size, see get_size()
+		std::chrono::steady_clock::time_point start_time;
+
 		int last_score;
 		int top_score;
 
 		Song* song;
+		std::shared_ptr<Cost_Model> cost_model;
 		Match best_match;
-		std::map<int, Stack_Analyzer> stack_analyzer;
+		Suffix_Array suffix_array;
+		Suffix_Array interval_array;
+		std::map<uint16_t, Track_Cost> track_cost;
+		std::vector<Stack_Analyzer> stack_analyzer;
+		std::vector<int32_t> stack_slot; // track id -> index in stack_analyzer, or -1
+		std::set<uint16_t> stack_changes; // tracks edited since the last call to analyze_stack()
+
+		// Match cache. This assumes that the song is only modified by apply_match()
+		// between calls to find_best_match().
+		std::map<uint16_t, std::vector<Cache_Entry>> match_cache;
+		std::map<uint16_t, std::vector<int16_t>> cache_stack; // stack usage when the cache was updated
+		std::vector<Edit> edit_list; // edits since the cache was updated
+
+		// Validation cache. Only the tracks changed by apply_match() and the tracks
+		// calling them are validated again.
+		std::map<uint16_t, Track_Time> reference_time; // lengths in the original song
+		std::map<uint16_t, Track_Time> track_time;
+		std::map<uint16_t, std::set<uint16_t>> callers; // may contain stale entries
+		std::set<uint16_t> changed_tracks; // changed since the last validation
 };
 
 #endif
@@ -168,101 +168,84 @@ uint8_t MD_Channel::get_psg_volume(uint16_t volume) const
 }
 
 //! Platform-exclusive command parser
-uint32_t MD_Channel::parse_platform_event(const Tag& tag, int16_t* platform_state)
-{
-	if(iequal(tag[0], "mode"))
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'mode' command");
-		platform_state[EVENT_CHANNEL_MODE] = std::strtol(tag[1].c_str(), 0, 0);
-		return (1 << EVENT_CHANNEL_MODE);
-	}
-	else if(iequal(tag[0], "lfo"))
-	{
-		if(tag.size() < 3)
-			error("not enough parameters for 'lfo' command");
-		platform_state[EVENT_LFO] = (std::strtol(tag[1].c_str(), 0, 0) << 4) | (std::strtol(tag[2].c_str(), 0, 0));
-		return (1 << EVENT_LFO);
-	}
-	else if(iequal(tag[0], "lfodelay"))
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'lfodelay' command");
-		platform_state[EVENT_LFO_DELAY] = std::strtol(tag[1].c_str(), 0, 0);
-		return (1 << EVENT_LFO_DELAY);
-	}
-	else if(iequal(tag[0], "lforate"))
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'lforate' command");
-		platform_state[EVENT_LFO_CONFIG] = std::strtol(tag[1].c_str(), 0, 0);
-		return (1 << EVENT_LFO_CONFIG);
-	}
-	else if(iequal(tag[0], "fm3"))
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'fm3' command");
-		platform_state[EVENT_FM3] = (std::strtol(tag[1].c_str(), 0, 2) ^ 0x0f) & 0x0f;
-		return (1 << EVENT_FM3);
-	}
-	else if(iequal(tag[0], "write"))
-	{
-		if(tag.size() < 3)
-			error("not enough parameters for 'write' command");
-		platform_state[EVENT_WRITE_ADDR] = std::strtol(tag[1].c_str(), 0, 0);
-		platform_state[EVENT_WRITE_DATA] = std::strtol(tag[2].c_str(), 0, 0);
-		platform_state[EVENT_TL_MODIFY] = 0;
-		return (1 << EVENT_WRITE_DATA);
-	}
-	else if(iequal(tag[0], "pcmrate"))
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'pcmrate' command");
-		uint8_t data = std::strtol(tag[1].c_str(), 0, 0);
-		if(data < 1 || data > 8)
-			error("pcmrate argument must be between 1 and 8");
-		if(driver->pcm_mode && pcm_channel_valid)
+uint32_t MD_Channel::parse_platform_event(const Platform_Command& command, int16_t* platform_state)
+{
+	switch(command.opcode)
+	{
+		case MDSDRV_Platform::CMD_MODE:
+			if(command.word_count < 2)
+				error("not enough parameters for 'mode' command");
+			platform_state[EVENT_CHANNEL_MODE] = command.args[0];
+			return (1 << EVENT_CHANNEL_MODE);
+		case MDSDRV_Platform::CMD_LFO:
+			if(command.word_count < 3)
+				error("not enough parameters for 'lfo' command");
+			platform_state[EVENT_LFO] = (command.args[0] << 4) | command.args[1];
+			return (1 << EVENT_LFO);
+		case MDSDRV_Platform::CMD_LFODELAY:
+			if(command.word_count < 2)
+				error("not enough parameters for 'lfodelay' command");
+			platform_state[EVENT_LFO_DELAY] = command.args[0];
+			return (1 << EVENT_LFO_DELAY);
+		case MDSDRV_Platform::CMD_LFORATE:
+			if(command.word_count < 2)
+				error("not enough parameters for 'lforate' command");
+			platform_state[EVENT_LFO_CONFIG] = command.args[0];
+			return (1 << EVENT_LFO_CONFIG);
+		case MDSDRV_Platform::CMD_FM3:
+			if(command.word_count < 2)
+				error("not enough parameters for 'fm3' command");
+			platform_state[EVENT_FM3] = (command.args[0] ^ 0x0f) & 0x0f;
+			return (1 << EVENT_FM3);
+		case MDSDRV_Platform::CMD_WRITE:
+			if(command.word_count < 3)
+				error("not enough parameters for 'write' command");
+			platform_state[EVENT_WRITE_ADDR] = command.args[0];
+			platform_state[EVENT_WRITE_DATA] = command.args[1];
+			platform_state[EVENT_TL_MODIFY] = 0;
+			return (1 << EVENT_WRITE_DATA);
+		case MDSDRV_Platform::CMD_PCMRATE:
 		{
-			driver->pcm.set_pitch(pcm_channel_id, data);
-			pcm_channel_enable = true;
+			if(command.word_count < 2)
+				error("not enough parameters for 'pcmrate' command");
+			uint8_t data = command.args[0];
+			if(data < 1 || data > 8)
+				error("pcmrate argument must be between 1 and 8");
+			if(driver->pcm_mode && pcm_channel_valid)
+			{
+				driver->pcm.set_pitch(pcm_channel_id, data);
+				pcm_channel_enable = true;
+			}
+			break;
 		}
-	}
-	else if(iequal(tag[0], "pcmmode"))
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'pcmmode' command");
-		uint8_t data = std::strtol(tag[1].c_str(), 0, 0);
-		if(data < 2 || data > 3)
-			error("pcmmode argument must be between 2 or 3");
-		driver->pcm_rate = driver->pcm.set_mode(data);
-		driver->pcm_counter = 0;
-		driver->pcm_delta = driver->get_rate()/driver->pcm_rate;
-		printf("set rate to %f", driver->pcm_delta);
-	}
-	else if(iequal(tag[0], "carry"))
-	{
-		macro_carry = true;
-	}
-	else if(MDSDRV_get_register(tag[0]))
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'write' command");
-
-		uint8_t reg = MDSDRV_get_register(tag[0]);
-		int16_t val = std::strtol(tag[1].c_str(), 0, 0);
-
-		if(tag[1].size() > 0)
+		case MDSDRV_Platform::CMD_PCMMODE:
 		{
-			uint8_t sign = tag[1][0];
-			if(sign == '+' || sign == '-')
-				platform_state[EVENT_TL_MODIFY] = 1;
-			else
-				platform_state[EVENT_TL_MODIFY] = 0;
+			if(command.word_count < 2)
+				error("not enough parameters for 'pcmmode' command");
+			uint8_t data = command.args[0];
+			if(data < 2 || data > 3)
+				error("pcmmode argument must be between 2 or 3");
+			driver->pcm_rate = driver->pcm.set_mode(data);
+			driver->pcm_counter = 0;
+			driver->pcm_delta = driver->get_rate()/driver->pcm_rate;
+			printf("set rate to %f", driver->pcm_delta);
+			break;
 		}
+		case MDSDRV_Platform::CMD_CARRY:
+			macro_carry = true;
+			break;
+		case MDSDRV_Platform::CMD_REGISTER:
+			if(command.word_count < 2)
+				error("not enough parameters for 'write' command");
 
-		platform_state[EVENT_WRITE_ADDR] = reg;
-		platform_state[EVENT_WRITE_DATA] = val;
-		return (1 << EVENT_WRITE_DATA);
+			if(~command.flags & MDSDRV_Platform::CMD_EMPTY_VALUE)
+				platform_state[EVENT_TL_MODIFY] = (command.flags & MDSDRV_Platform::CMD_RELATIVE) ? 1 : 0;
+
+			platform_state[EVENT_WRITE_ADDR] = command.variant;
+			platform_state[EVENT_WRITE_DATA] = (int16_t)command.args[0];
+			return (1 << EVENT_WRITE_DATA);
+		default:
+			break;
 	}
 	return 0;
 }
@@ -685,8 +668,8 @@ void MD_MacroTrack::event_hook()
 		case Event::PLATFORM:
 			try
 			{
-				const Tag& tag = get_song()->get_platform_command(event.param);
-				channel.platform_update(tag);
+				auto& command = get_song()->get_compiled_platform_command(event.param);
+				channel.platform_update(command);
 				channel.update_state();
 			}
 			catch (std::out_of_range &)
@@ -1100,8 +1083,36 @@ void MD_Dummy::v_update_envelope()
 {
 }
 
-bool MD_PCMDriver::tables_initialized;
-int8_t MD_PCMDriver::vol_table[16][256];
+//! Get the sample volume table.
+/*!
+ *  The table is built on the first call, and shared by all PCM drivers.
+ *  It is indexed by the attenuation and the unsigned sample.
+ */
+const int8_t (*MD_PCMDriver::get_vol_table())[256]
+{
+	struct Table
+	{
+		int8_t data[16][256];
+
+		Table()
+		{
+			static const uint8_t volt[16] = {
+				255, 203, 161, 128, 102, 81, 64, 51, 40, 32, 26, 20, 16, 13, 10, 8
+			};
+			for(int tab = 0; tab < 16; tab++)
+			{
+				uint8_t tvol = volt[tab];
+				for(int i=0; i<256; i++)
+				{
+					int8_t ivol = i ^ 0x80;
+					data[tab][i] = (ivol * tvol) >> 8;
+				}
+			}
+		}
+	};
+	static const Table table;
+	return table.data;
+}
 
 const uint8_t MD_PCMDriver::pitch_table[2][8] = {
 	{
@@ -1131,25 +1142,8 @@ const uint8_t MD_PCMDriver::pitch_table[2][8] = {
 MD_PCMDriver::MD_PCMDriver(MD_Driver& driver)
 	: driver(&driver)
 	, mode(0)
+	, vol_table(get_vol_table())
 {
-	if(!tables_initialized)
-	{
-		tables_initialized = true;
-
-		static const uint8_t volt[16] = {
-			255, 203, 161, 128, 102, 81, 64, 51, 40, 32, 26, 20, 16, 13, 10, 8
-		};
-		for(int tab = 0; tab < 16; tab++)
-		{
-			uint8_t tvol = volt[tab];
-			for(int i=0; i<256; i++)
-			{
-				int8_t ivol = i ^ 0x80;
-				vol_table[tab][i] = (ivol * tvol) >> 8;
-			}
-		}
-	}
-
 	// init channels
 	for(int i=0; i<3; i++)
 		channels[i] = {false, 0, 0, 0, 0, 0, 0, 0};
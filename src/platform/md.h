@@ -79,7 +79,7 @@ class MD_Channel : public Player
 		bool macro_carry;
 
 	private:
-		uint32_t parse_platform_event(const Tag& tag, int16_t* platform_state) override;
+		uint32_t parse_platform_event(const Platform_Command& command, int16_t* platform_state) override;
 		void write_event() override;
 
 		void update_tempo();
@@ -263,8 +263,9 @@ class MD_PCMDriver
 
 		int8_t mix_channel(int16_t accumulator, int channel);
 
-		static bool tables_initialized;
-		static int8_t vol_table[16][256];
+		static const int8_t (*get_vol_table())[256];
+
+		const int8_t (*vol_table)[256]; // shared by all instances, see get_vol_table()
 		static const uint8_t pitch_table[2][8];
 };
 
@@ -0,0 +1,760 @@
+#include <algorithm>
+#include <stdexcept>
+#include <climits>
+#include <cstdint>
+#include "mds_input.h"
+#include "../song.h"
+#include "../stringf.h"
+#include "../riff.h"
+#include "../util.h"
+
+//! Constructs a MDS_Input.
+MDS_Input::MDS_Input(Song* song)
+	: Input(song)
+	, seq()
+	, data_base(0)
+	, entry_count(0)
+	, position(0)
+	, envelopes()
+	, extended_pitch()
+	, samples()
+	, pcm_data()
+	, pending()
+	, converted()
+	, instruments()
+	, pitch_envelopes()
+	, platform_commands()
+{
+}
+
+MDS_Input::~MDS_Input()
+{
+}
+
+//! Convert FM instrument data to an `fm` instrument definition.
+/*!
+ *  \exception std::invalid_argument if the data is not an FM instrument.
+ */
+std::string MDS_Input::fm_instrument(const std::vector<uint8_t>& data)
+{
+	if(data.size() != 30)
+		throw std::invalid_argument("MDS_Input::fm_instrument");
+	std::string out = stringf("fm %d %d", data[28] & 7, (data[28] >> 3) & 7);
+	// physical operator order is 1,3,2,4
+	static const int order[4] = {0, 2, 1, 3};
+	for(int i : order)
+	{
+		out += stringf(" %d %d %d %d %d %d %d %d %d %d",
+			data[4 + i] & 31,			// AR
+			data[8 + i] & 31,			// DR
+			data[12 + i] & 31,			// SR
+			data[16 + i] & 15,			// RR
+			data[16 + i] >> 4,			// SL
+			data[24 + i],				// TL
+			data[4 + i] >> 6,			// KS
+			data[0 + i] & 15,			// MUL
+			data[0 + i] >> 4,			// DT
+			(data[20 + i] & 15) + ((data[8 + i] & 0x80) ? 100 : 0)); // SSG-EG, AM
+	}
+	out += stringf(" %d", (data[29] >> 1) - 24);
+	return out;
+}
+
+//! Convert PSG envelope data to a `psg` instrument definition.
+/*!
+ *  \exception std::invalid_argument if the data is not a PSG envelope.
+ */
+std::string MDS_Input::psg_instrument(const std::vector<uint8_t>& data)
+{
+	size_t end;
+	size_t loop = SIZE_MAX;
+	if(data.size() >= 2 && data[data.size() - 2] == 0x02)
+	{
+		end = data.size() - 2;
+		loop = data.back();
+	}
+	else if(data.size() >= 1 && data.back() == 0x00)
+	{
+		end = data.size() - 1;
+	}
+	else
+	{
+		throw std::invalid_argument("MDS_Input::psg_instrument");
+	}
+
+	std::string out = "psg";
+	for(size_t i = 0; i < end; i++)
+	{
+		if(i == loop)
+			out += " |";
+		if(data[i] == 0x01)
+			out += " /";
+		else if(data[i] < 0x10)
+			throw std::invalid_argument("MDS_Input::psg_instrument");
+		else if(data[i] < 0x20)
+			out += stringf(" %d", 15 - (data[i] & 15));
+		else
+			out += stringf(" %d:%d", 15 - (data[i] & 15), data[i] >> 4);
+	}
+	if(loop != SIZE_MAX && loop >= end)
+		throw std::invalid_argument("MDS_Input::psg_instrument");
+	return out;
+}
+
+//! Convert pitch envelope data to a pitch envelope definition.
+/*!
+ *  The nodes are written with their exact start and end values, so that
+ *  MDSDRV_Data creates the same nodes again.
+ *
+ *  \param data     Envelope data.
+ *  \param extended True if the data has the extended (16-bit delta)
+ *                  format.
+ *  \exception std::invalid_argument if the data is not a pitch envelope.
+ */
+std::string MDS_Input::pitch_envelope(const std::vector<uint8_t>& data, bool extended)
+{
+	std::string out;
+	unsigned int node_size = extended ? 6 : 4;
+	unsigned int node_count = 0;
+	int loop = -1;
+	bool end = false;
+	size_t pos = 0;
+	while(!end)
+	{
+		if(!extended && pos + 2 == data.size() && data[pos] == 0x7f)
+		{
+			loop = data[pos + 1];
+			break;
+		}
+		if(pos + node_size > data.size())
+			throw std::invalid_argument("MDS_Input::pitch_envelope");
+
+		int16_t initial = (data[pos] << 8) | data[pos + 1];
+		int16_t delta;
+		unsigned int length = data[pos + node_size - (extended ? 2 : 1)];
+		if(extended)
+		{
+			delta = (data[pos + 2] << 8) | data[pos + 3];
+			uint8_t next = data[pos + 5];
+			if(pos + node_size == data.size())
+			{
+				end = true;
+				if(length != 0xff || next != node_count)
+					loop = next;
+			}
+		}
+		else
+		{
+			delta = (int8_t)data[pos + 2];
+			if(length == 0xff)
+			{
+				if(pos + node_size != data.size())
+					throw std::invalid_argument("MDS_Input::pitch_envelope");
+				end = true;
+			}
+		}
+		// The last node continues forever, only its delta is needed
+		length = (length == 0xff && loop < 0) ? 1 : length + 1;
+
+		double start = initial / 256.;
+		double target = (initial + delta * (int)length) / 256.;
+		if(out.size())
+			out += " ";
+		if(delta)
+			out += stringf("%.15g>%.15g:%d", start, target, length);
+		else if(length > 1)
+			out += stringf("%.15g:%d", start, length);
+		else
+			out += stringf("%.15g", start);
+		pos += node_size;
+		node_count++;
+	}
+	if(loop >= (int)node_count || !node_count)
+		throw std::invalid_argument("MDS_Input::pitch_envelope");
+	if(loop >= 0)
+	{
+		// Insert the loop position before the node
+		size_t word = 0;
+		for(int i = 0; i < loop; i++)
+			word = out.find(' ', word) + 1;
+		out.insert(word, "| ");
+	}
+	return out;
+}
+
+uint8_t MDS_Input::read_byte()
+{
+	if(position >= seq.size())
+		parse_error("unexpected end of sequence data");
+	return seq[position++];
+}
+
+//! Read a big endian word.
+uint16_t MDS_Input::read_word()
+{
+	uint16_t value = read_byte() << 8;
+	return value | read_byte();
+}
+
+//! Read the chunks of the RIFF container.
+/*!
+ *  \exception std::out_of_range if the container is malformed.
+ */
+void MDS_Input::read_chunks(const std::vector<uint8_t>& file)
+{
+	std::vector<uint8_t> ver = {0, 0};
+	RIFF mds(file);
+	RIFF dblk(0);
+	if(mds.get_type() != RIFF::TYPE_RIFF || mds.get_id() != FOURCC("MDS0"))
+		parse_error("not a .mds file");
+
+	while(!mds.at_end())
+	{
+		auto chunk = RIFF(mds.get_chunk());
+		if(chunk.get_type() == FOURCC("seq "))
+			seq = chunk.get_data();
+		else if(chunk.get_type() == FOURCC("pcmd"))
+			pcm_data = chunk.get_data();
+		else if(chunk.get_type() == RIFF::TYPE_LIST && chunk.get_id() == FOURCC("dblk"))
+			dblk = chunk;
+		else if(chunk.get_type() == FOURCC("ver "))
+			ver = chunk.get_data();
+		else if(chunk.get_type() == FOURCC("grp ") && chunk.get_data().size())
+			get_song().add_tag("#group", std::string(chunk.get_data().begin(), chunk.get_data().end()));
+	}
+
+	try
+	{
+		MDSDRV_Linker::check_version(ver.at(0), ver.at(1));
+	}
+	catch(InputError& error)
+	{
+		parse_error(error.what());
+	}
+
+	if(seq.size() < 4 || dblk.get_type() != RIFF::TYPE_LIST)
+		parse_error(".mds data is malformed");
+
+	dblk.rewind();
+	while(!dblk.at_end())
+	{
+		auto chunk = RIFF(dblk.get_chunk());
+		auto& data = chunk.get_data();
+		if(chunk.get_type() == FOURCC("glob"))
+		{
+			uint32_t id = read_le32(data, 0);
+			envelopes[id & 0x7fffffff].assign(data.begin() + 4, data.end());
+			if(id & 0x80000000)
+				extended_pitch.insert(id & 0x7fffffff);
+		}
+		else if(chunk.get_type() == FOURCC("pcmh"))
+		{
+			samples[read_le32(data, 0)].from_bytes(std::vector<uint8_t>(data.begin() + 4, data.end()));
+		}
+	}
+}
+
+//! Add a platform command event, reusing the command if it has been added before.
+void MDS_Input::add_platform_command(std::vector<Event>& events, const std::string& command)
+{
+	auto it = platform_commands.find(command);
+	int16_t param;
+	if(it != platform_commands.end())
+		param = it->second;
+	else
+		param = platform_commands[command] = get_song().register_platform_command(-1, command);
+	events.push_back({Event::PLATFORM, param, 0, 0});
+}
+
+//! Insert the loop point at the event that starts at \p target.
+void MDS_Input::add_segno(std::vector<Event>& events, const std::map<uint32_t, size_t>& event_index, uint32_t target)
+{
+	auto it = event_index.find(target);
+	if(it == event_index.end())
+		parse_error("invalid jump destination");
+	events.insert(events.begin() + it->second, {Event::SEGNO, 0, 0, 0});
+}
+
+//! Queue a subroutine or macro track for conversion.
+/*!
+ *  \return The track id of the sequence.
+ */
+uint16_t MDS_Input::add_sequence(const Sequence& sequence)
+{
+	if(sequence.entry >= entry_count)
+		parse_error(stringf("invalid sequence number %d", sequence.entry).c_str());
+	if(converted.insert(sequence.entry).second)
+		pending.push_back(sequence);
+	return SUBROUTINE_BASE + sequence.entry;
+}
+
+//! Set the type of an instrument when it is first used.
+void MDS_Input::use_instrument(uint8_t id, int channel)
+{
+	if(instruments.count(id))
+		return;
+	auto it = envelopes.find(id);
+	if(it == envelopes.end())
+		parse_error(stringf("instrument data %d is missing", id).c_str());
+	if(channel >= 0 && channel < 6)
+		instruments[id] = MDSDRV_Data::INS_FM;
+	else if(channel >= 6 && channel < 10)
+		instruments[id] = MDSDRV_Data::INS_PSG;
+	else if(it->second.size() == 30)
+		instruments[id] = MDSDRV_Data::INS_FM;
+	else
+		instruments[id] = MDSDRV_Data::INS_PSG;
+}
+
+//! Convert a command that is used in both tracks and macro tracks.
+/*!
+ *  \param events Events to add to.
+ *  \param type   MDSDRV_Event::Type of the command.
+ *  \param arg    Command argument.
+ *  \param psg    True if the command is for a PSG channel.
+ */
+void MDS_Input::add_command(std::vector<Event>& events, uint8_t type, uint16_t arg, bool psg)
+{
+	// Register names of the FMTL commands
+	static const char* const tl_names[4] = {"tl1", "tl3", "tl2", "tl4"};
+	switch(type)
+	{
+		case MDSDRV_Event::VOL:
+			if(arg & 0x80)
+				events.push_back({Event::VOL, (int16_t)(arg & 0x7f), 0, 0});
+			else
+				events.push_back({Event::VOL_FINE, (int16_t)arg, 0, 0});
+			break;
+		case MDSDRV_Event::VOLM:
+			events.push_back({Event::VOL_FINE_REL, (int8_t)arg, 0, 0});
+			break;
+		case MDSDRV_Event::TRS:
+			events.push_back({Event::TRANSPOSE, (int8_t)arg, 0, 0});
+			break;
+		case MDSDRV_Event::TRSM:
+			events.push_back({Event::TRANSPOSE_REL, (int8_t)arg, 0, 0});
+			break;
+		case MDSDRV_Event::DTN:
+			events.push_back({Event::DETUNE, (int8_t)arg, 0, 0});
+			break;
+		case MDSDRV_Event::PTA:
+			events.push_back({Event::PORTAMENTO, (int16_t)arg, 0, 0});
+			break;
+		case MDSDRV_Event::PAN:
+			if(arg & 0x3f)
+				add_platform_command(events, stringf("cmd 0x%02x 0x%02x", type, arg));
+			else
+				events.push_back({Event::PAN, (int16_t)(arg >> 6), 0, 0});
+			break;
+		case MDSDRV_Event::LFO:
+			// The same command sets the noise mode of PSG channels
+			if(arg == 0xe7)
+				add_platform_command(events, "mode 1");
+			else if(arg == 0xe3)
+				add_platform_command(events, "mode 2");
+			else if(psg && !arg)
+				add_platform_command(events, "mode 0");
+			else if(psg)
+				add_platform_command(events, stringf("cmd 0x%02x 0x%02x", type, arg));
+			else
+				add_platform_command(events, stringf("lfo %d %d", arg >> 4, arg & 15));
+			break;
+		case MDSDRV_Event::FMREG:
+			if((arg >> 8) == 0x22 && (arg & 0xff) != 0 && (arg & 0xff) < 8)
+				add_platform_command(events, stringf("cmd 0x%02x 0x%04x", type, arg));
+			else if((arg >> 8) == 0x22)
+				add_platform_command(events, stringf("lforate %d", (arg & 0xff) ? (arg & 0xff) - 7 : 0));
+			else if((arg >> 8) < 0x30)
+				add_platform_command(events, stringf("write 0x%02x 0x%02x", arg >> 8, arg & 0xff));
+			else
+				add_platform_command(events, stringf("cmd 0x%02x 0x%04x", type, arg));
+			break;
+		case MDSDRV_Event::FMCREG:
+			if((arg >> 8) >= 0x30)
+				add_platform_command(events, stringf("write 0x%02x 0x%02x", arg >> 8, arg & 0xff));
+			else
+				add_platform_command(events, stringf("cmd 0x%02x 0x%04x", type, arg));
+			break;
+		case MDSDRV_Event::FMTL:
+		case MDSDRV_Event::FMTLM:
+			if((arg >> 8) > 3)
+				add_platform_command(events, stringf("cmd 0x%02x 0x%04x", type, arg));
+			else if(type == MDSDRV_Event::FMTL)
+				add_platform_command(events, stringf("%s %d", tl_names[arg >> 8], arg & 0xff));
+			else
+				add_platform_command(events, stringf("%s %+d", tl_names[arg >> 8], (int8_t)arg));
+			break;
+		default:
+			add_platform_command(events, stringf("cmd 0x%02x 0x%02x", type, arg));
+			break;
+	}
+}
+
+//! Convert a track or subroutine.
+void MDS_Input::read_track(Track& track, const Sequence& sequence)
+{
+	// Last note and rest lengths, or -1 if unknown
+	struct Lengths
+	{
+		int rest;
+		int note;
+	};
+	Lengths last = {-1, -1};
+	// Lengths at each loop break
+	std::vector<std::pair<bool, Lengths>> loops;
+	std::vector<Event> events;
+	std::map<uint32_t, size_t> event_index; // position of each command
+	bool psg = sequence.channel >= 6 && sequence.channel < 10;
+	bool drum_mode = sequence.drum_mode;
+	bool end = false;
+	while(!end)
+	{
+		event_index[position] = events.size();
+		uint8_t type = read_byte();
+		if(type <= MDSDRV_Event::REST)
+		{
+			if(type < MDSDRV_Event::REST)
+				last.rest = type;
+			else if(last.rest < 0)
+				parse_error("rest length is not set");
+			events.push_back({Event::REST, 0, 0, (uint16_t)(last.rest + 1)});
+			continue;
+		}
+		else if(type < MDSDRV_Event::SLR)
+		{
+			if(position < seq.size() && seq[position] < 0x80)
+				last.note = read_byte();
+			else if(last.note < 0)
+				parse_error("note length is not set");
+			uint16_t length = last.note + 1;
+			if(type == MDSDRV_Event::TIE)
+				events.push_back({Event::TIE, 0, length, 0});
+			else if(drum_mode)
+				events.push_back({Event::NOTE, (int16_t)add_sequence({(uint16_t)(type - MDSDRV_Event::NOTE), false, sequence.channel, false, true}), length, 0});
+			else
+				events.push_back({Event::NOTE, (int16_t)(type - MDSDRV_Event::NOTE), length, 0});
+			continue;
+		}
+
+		uint8_t arg;
+		switch(type)
+		{
+			case MDSDRV_Event::SLR:
+				events.push_back({Event::SLUR, 0, 0, 0});
+				break;
+			case MDSDRV_Event::VOL: // 8-bit argument
+			case MDSDRV_Event::VOLM:
+			case MDSDRV_Event::TRS:
+			case MDSDRV_Event::TRSM:
+			case MDSDRV_Event::DTN:
+			case MDSDRV_Event::PTA:
+			case MDSDRV_Event::PAN:
+			case MDSDRV_Event::LFO:
+			case MDSDRV_Event::COMM:
+				add_command(events, type, read_byte(), psg);
+				break;
+			case MDSDRV_Event::FMREG: // 16-bit argument
+			case MDSDRV_Event::FMCREG:
+			case MDSDRV_Event::FMTL:
+			case MDSDRV_Event::FMTLM:
+				add_command(events, type, read_word(), psg);
+				break;
+			case MDSDRV_Event::TEMPO:
+				events.push_back({Event::TEMPO, read_byte(), 0, 0});
+				break;
+			case MDSDRV_Event::PCMRATE:
+				add_platform_command(events, stringf("pcmrate %d", read_byte()));
+				break;
+			case MDSDRV_Event::PCMMODE:
+				add_platform_command(events, stringf("pcmmode %d", read_byte()));
+				break;
+			case MDSDRV_Event::FLG:
+				arg = read_byte();
+				if(arg == 8 || arg == 0)
+				{
+					drum_mode = arg;
+					events.push_back({Event::DRUM_MODE, drum_mode, 0, 0});
+				}
+				else if(arg & 0x80)
+				{
+					// The operator mask is written as a binary number
+					arg = (arg ^ 0x0f) & 0x0f;
+					add_platform_command(events, stringf("fm3 %d%d%d%d", (arg >> 3) & 1, (arg >> 2) & 1, (arg >> 1) & 1, arg & 1));
+				}
+				else
+				{
+					add_command(events, type, arg, psg);
+				}
+				break;
+			case MDSDRV_Event::INS:
+				arg = read_byte();
+				use_instrument(arg, sequence.channel);
+				events.push_back({Event::INS, arg, 0, 0});
+				break;
+			case MDSDRV_Event::PCM:
+				arg = read_byte();
+				if(!samples.count(arg))
+					parse_error(stringf("PCM header %d is missing", arg).c_str());
+				instruments[arg] = MDSDRV_Data::INS_PCM;
+				events.push_back({Event::INS, arg, 0, 0});
+				break;
+			case MDSDRV_Event::PEG:
+				arg = read_byte();
+				if(arg && !envelopes.count(arg - 1))
+					parse_error(stringf("pitch envelope data %d is missing", arg - 1).c_str());
+				else if(arg)
+					pitch_envelopes.insert(arg - 1);
+				events.push_back({Event::PITCH_ENVELOPE, arg, 0, 0});
+				break;
+			case MDSDRV_Event::MTAB:
+				arg = read_byte();
+				if(arg)
+					events.push_back({Event::PAN_ENVELOPE, (int16_t)add_sequence({(uint16_t)(arg - 1), true, sequence.channel, false, false}), 0, 0});
+				else
+					events.push_back({Event::PAN_ENVELOPE, 0, 0, 0});
+				break;
+			case MDSDRV_Event::DMFINISH:
+				if(!sequence.in_drum_mode)
+					parse_error("drum mode note outside of a drum mode subroutine");
+				events.push_back({Event::NOTE, read_byte(), 0, 0});
+				end = true;
+				break;
+			case MDSDRV_Event::PAT:
+				arg = read_byte();
+				events.push_back({Event::JUMP, (int16_t)add_sequence({arg, false, sequence.channel, drum_mode, false}), 0, 0});
+				last = {-1, -1};
+				break;
+			case MDSDRV_Event::LP:
+				events.push_back({Event::LOOP_START, 0, 0, 0});
+				loops.push_back({false, last});
+				last = {-1, -1};
+				break;
+			case MDSDRV_Event::LPB:
+			case MDSDRV_Event::LPBL:
+				if(type == MDSDRV_Event::LPB)
+					read_byte();
+				else
+					read_word();
+				if(!loops.size())
+					parse_error("loop break outside of a loop");
+				events.push_back({Event::LOOP_BREAK, 0, 0, 0});
+				loops.back() = {true, last};
+				break;
+			case MDSDRV_Event::LPF:
+				if(!loops.size())
+					parse_error("loop end outside of a loop");
+				events.push_back({Event::LOOP_END, read_byte(), 0, 0});
+				// The loop is exited at the break
+				if(loops.back().first)
+					last = loops.back().second;
+				loops.pop_back();
+				break;
+			case MDSDRV_Event::JUMP:
+			{
+				int16_t offset = read_word();
+				add_segno(events, event_index, position + offset);
+				end = true;
+				break;
+			}
+			case MDSDRV_Event::FINISH:
+				end = true;
+				break;
+			default:
+				parse_error(stringf("unknown command %02x", type).c_str());
+				break;
+		}
+	}
+	for(auto && event : events)
+		track.add_event(event);
+}
+
+//! Convert a macro track.
+void MDS_Input::read_macro_track(Track& track)
+{
+	std::vector<Event> events;
+	std::vector<uint8_t> loop_counts;
+	std::map<uint32_t, size_t> event_index; // position of each command
+	bool end = false;
+	while(!end)
+	{
+		event_index[position] = events.size();
+		uint8_t type = read_byte();
+		uint8_t arg = read_byte();
+		switch(type)
+		{
+			case 0x80:
+				if(arg)
+					add_segno(events, event_index, position + (int8_t)arg * 2);
+				end = true;
+				break;
+			case 0x81:
+				events.push_back({Event::REST, 0, 0, (uint16_t)(arg + 1)});
+				break;
+			case 0x82:
+				events.push_back({Event::NOTE, 0, (uint16_t)(arg + 1), 0});
+				break;
+			case 0x83:
+				add_platform_command(events, "carry");
+				break;
+			case 0x84:
+				events.push_back({Event::LOOP_START, 0, 0, 0});
+				loop_counts.push_back(arg + 1);
+				break;
+			case 0x85:
+				if(!loop_counts.size())
+					parse_error("loop break outside of a loop");
+				events.push_back({Event::LOOP_BREAK, 0, 0, 0});
+				break;
+			case 0x86:
+				if(!loop_counts.size())
+					parse_error("loop end outside of a loop");
+				events.push_back({Event::LOOP_END, loop_counts.back(), 0, 0});
+				loop_counts.pop_back();
+				break;
+			case 0x18:
+				add_command(events, MDSDRV_Event::VOL, arg, false);
+				break;
+			case 0x58:
+				add_command(events, MDSDRV_Event::VOLM, arg, false);
+				break;
+			case 0x16:
+				add_command(events, MDSDRV_Event::TRS, arg, false);
+				break;
+			case 0x56:
+				add_command(events, MDSDRV_Event::TRSM, arg, false);
+				break;
+			case 0x11:
+				add_command(events, MDSDRV_Event::DTN, arg, false);
+				break;
+			case 0x17:
+				add_command(events, MDSDRV_Event::PTA, arg, false);
+				break;
+			case 0x87:
+				add_command(events, MDSDRV_Event::PAN, arg, false);
+				break;
+			case 0x88:
+				add_command(events, MDSDRV_Event::LFO, arg, false);
+				break;
+			case 0x89: // PSG noise mode
+				add_command(events, MDSDRV_Event::LFO, arg, true);
+				break;
+			default:
+				if(type >= 0x36 && type < 0x3a)
+					add_command(events, MDSDRV_Event::FMTL, ((type - 0x36) << 8) | arg, false);
+				else if(type >= 0x76 && type < 0x7a)
+					add_command(events, MDSDRV_Event::FMTLM, ((type - 0x76) << 8) | arg, false);
+				else if(type >= 0xc0)
+					add_command(events, MDSDRV_Event::FMCREG, ((type - 0xc0) << 10) | arg, false);
+				else
+					parse_error(stringf("unknown macro track command %02x", type).c_str());
+				break;
+		}
+	}
+	for(auto && event : events)
+		track.add_event(event);
+}
+
+//! Add the tags of the used instruments and envelopes.
+void MDS_Input::add_instruments()
+{
+	for(auto && it : instruments)
+	{
+		std::string definition;
+		try
+		{
+			if(it.second == MDSDRV_Data::INS_FM)
+			{
+				definition = fm_instrument(envelopes.at(it.first));
+			}
+			else if(it.second == MDSDRV_Data::INS_PSG)
+			{
+				definition = psg_instrument(envelopes.at(it.first));
+			}
+			else
+			{
+				// Store the played part of the sample
+				const Wave_Bank::Sample& header = samples.at(it.first);
+				definition = "pcm data:";
+				for(uint32_t i = 0; i < header.size; i++)
+				{
+					uint64_t pos = (uint64_t)header.position + header.start + i;
+					definition += stringf("%02x", (pos < pcm_data.size()) ? pcm_data[pos] : 0);
+				}
+				definition += stringf(" rate=%u", header.rate);
+			}
+		}
+		catch(std::invalid_argument&)
+		{
+			parse_error(stringf("invalid instrument data %d", it.first).c_str());
+		}
+		get_song().add_tag_list(stringf("@%d", it.first), definition);
+	}
+	for(auto && id : pitch_envelopes)
+	{
+		std::string definition;
+		try
+		{
+			definition = pitch_envelope(envelopes.at(id), extended_pitch.count(id));
+		}
+		catch(std::invalid_argument&)
+		{
+			parse_error(stringf("invalid pitch envelope data %d", id).c_str());
+		}
+		get_song().add_tag_list(stringf("@m%d", id + 1), definition);
+	}
+}
+
+//! Read and convert a .mds file.
+void MDS_Input::parse_file()
+{
+	auto text = read_file();
+	try
+	{
+		read_chunks(std::vector<uint8_t>(text->begin(), text->end()));
+	}
+	catch(std::out_of_range&)
+	{
+		parse_error(".mds data is malformed");
+	}
+	get_song().set_platform("megadrive");
+
+	data_base = (seq[0] << 8) | seq[1];
+	unsigned int track_count = seq[3];
+	if(data_base < 4 + track_count * 4 || data_base > seq.size())
+		parse_error("invalid sequence header");
+	if(seq[2])
+		get_song().add_tag("#volume", stringf("%d", seq[2]));
+
+	// The track header is followed by the offsets of the subroutines,
+	// macro tracks and envelopes, and then the first track.
+	std::vector<std::pair<uint8_t, uint16_t>> tracks;
+	entry_count = UINT16_MAX;
+	for(unsigned int i = 0; i < track_count; i++)
+	{
+		uint16_t offset = (seq[6 + i * 4] << 8) | seq[7 + i * 4];
+		tracks.push_back({seq[4 + i * 4], offset});
+		entry_count = std::min<unsigned int>(entry_count, offset / 2);
+	}
+	if(!track_count)
+		entry_count = 0;
+	if(data_base + entry_count * 2 > seq.size())
+		parse_error("invalid sequence header");
+
+	for(auto && it : tracks)
+	{
+		position = data_base + it.second;
+		read_track(get_song().make_track(it.first), {0, false, it.first, false, false});
+	}
+	while(pending.size())
+	{
+		Sequence sequence = pending.front();
+		pending.pop_front();
+		position = data_base + ((seq[data_base + sequence.entry * 2] << 8) | seq[data_base + sequence.entry * 2 + 1]);
+		Track& track = get_song().make_track(SUBROUTINE_BASE + sequence.entry);
+		if(sequence.macro_track)
+			read_macro_track(track);
+		else
+			read_track(track, sequence);
+	}
+	add_instruments();
+}
@@ -0,0 +1,101 @@
+/*! \file src/platform/mds_input.h
+ *  \brief MDSDRV sequence (.mds) parser
+ */
+#ifndef PLATFORM_MDS_INPUT_H
+#define PLATFORM_MDS_INPUT_H
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include "../input.h"
+#include "../track.h"
+#include "../wave.h"
+#include "mdsdrv.h"
+
+//! MDSDRV sequence (.mds) parser class
+/*!
+ *  Converts a .mds file created by MDSDRV_Converter back to a Song, so
+ *  that it can be played by MD_Driver or converted again.
+ *
+ *  - Each sequence track becomes a Song track with the same id.
+ *    Subroutines and macro tracks are added as tracks
+ *    \ref SUBROUTINE_BASE and up, using their index in the sequence
+ *    header.
+ *  - Loops, subroutine calls, drum mode and the loop point are converted
+ *    to the corresponding events. Reused note and rest lengths are
+ *    expanded.
+ *  - The sequence tempo is set with Event::TEMPO, so the Song ppqn does
+ *    not affect the playback speed.
+ *  - Instruments and envelopes are converted to tags using the data id
+ *    as the instrument number. Pitch envelopes use the `PEG` parameter
+ *    (the data id + 1) as the envelope number. PCM samples are stored
+ *    in the instrument tag with the `data:` form, see
+ *    Wave_Bank::add_sample().
+ *  - Commands without a Song event are converted to platform commands.
+ *
+ *  Some .mds commands mean different things on FM and PSG channels, so
+ *  a subroutine is converted for the channel that calls it first.
+ */
+class MDS_Input: public Input
+{
+	public:
+		//! Track id of the first subroutine or macro track.
+		static const uint16_t SUBROUTINE_BASE = 16;
+
+		MDS_Input(Song* song);
+		MDS_Input(MDS_Input&& other) = default;
+		MDS_Input& operator=(MDS_Input&& other) = default;
+		~MDS_Input();
+
+		static std::string fm_instrument(const std::vector<uint8_t>& data);
+		static std::string psg_instrument(const std::vector<uint8_t>& data);
+		static std::string pitch_envelope(const std::vector<uint8_t>& data, bool extended);
+
+	private:
+		//! Sequence waiting to be converted.
+		struct Sequence
+		{
+			uint16_t entry; //!< Index in the sequence header.
+			bool macro_track;
+			int channel; //!< Track id of the calling track, or -1 if unknown.
+			bool drum_mode; //!< Drum mode is enabled when the subroutine is called.
+			bool in_drum_mode; //!< Subroutine is called by a drum mode note.
+		};
+
+		void parse_file() override;
+		void read_chunks(const std::vector<uint8_t>& file);
+
+		void read_track(Track& track, const Sequence& sequence);
+		void read_macro_track(Track& track);
+		void add_instruments();
+
+		uint16_t add_sequence(const Sequence& sequence);
+		void add_platform_command(std::vector<Event>& events, const std::string& command);
+		void add_segno(std::vector<Event>& events, const std::map<uint32_t, size_t>& event_index, uint32_t target);
+		void use_instrument(uint8_t id, int channel);
+		void add_command(std::vector<Event>& events, uint8_t type, uint16_t arg, bool psg);
+
+		uint8_t read_byte();
+		uint16_t read_word();
+
+		std::vector<uint8_t> seq;
+		uint16_t data_base;
+		unsigned int entry_count;
+		uint32_t position;
+
+		//! Envelope data (glob chunks) by data id.
+		std::map<uint32_t, std::vector<uint8_t>> envelopes;
+		std::set<uint32_t> extended_pitch;
+		//! PCM headers (pcmh chunks) by data id.
+		std::map<uint32_t, Wave_Bank::Sample> samples;
+		std::vector<uint8_t> pcm_data;
+
+		std::deque<Sequence> pending;
+		std::set<uint16_t> converted;
+		std::map<uint32_t, MDSDRV_Data::InstrumentType> instruments;
+		std::set<uint32_t> pitch_envelopes;
+		std::map<std::string, int16_t> platform_commands;
+};
+
+#endif
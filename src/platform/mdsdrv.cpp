@@ -72,26 +72,33 @@ void MDSDRV_Data::read_song(Song& song)
 	envelope_map[0] = add_unique_data({0x10, 0x01, 0x1f, 0x00});
 	ins_transpose[0] = 0;
 	ins_type[0] = MDSDRV_Data::INS_UNDEFINED;
-	Tag& tag_order = song.get_tag_order_list();
+	Tag_Map& tag_map = song.get_tag_map();
 
-	if(song.check_tag("#option"))
+	Tag option_list = song.get_option_list();
+	if(std::find(option_list.begin(), option_list.end(), "noextpitch") != option_list.end())
 	{
-		Tag& tag = song.get_tag("#option");
-		if(std::find(tag.begin(), tag.end(), "noextpitch") != tag.end())
-		{
-			use_extended_pitch = false;
-		}
+		use_extended_pitch = false;
 	}
 
-	for(auto it = tag_order.begin(); it != tag_order.end(); it++)
+	for(auto && key : tag_map.get_order())
 	{
-		uint16_t id;
-		Tag& tag = song.get_tag(*it);
-		if(std::sscanf(it->c_str(), "@%hu", &id) == 1)
+		const Tag& tag = tag_map.at(key);
+		uint16_t id = key.id;
+		Tag_Key::Family family = key.family;
+		if(family == Tag_Key::NAMED && tag_map.get_name(key)[0] == '@')
 		{
-			add_instrument(id, tag);
+			// Numbered keys not in canonical form, such as "@01"
+			std::string name = tag_map.get_name(key);
+			if(std::sscanf(name.c_str(), "@%hu", &id) == 1)
+				family = Tag_Key::INSTRUMENT;
+			else if(std::sscanf(name.c_str(), "@m%hu", &id) == 1)
+				family = Tag_Key::MACRO;
 		}
-		else if(std::sscanf(it->c_str(), "@m%hu", &id) == 1)
+		if(family == Tag_Key::INSTRUMENT)
+		{
+			add_instrument(id, tag, tag_map.get_numbers(key));
+		}
+		else if(family == Tag_Key::MACRO)
 		{
 			try
 			{
@@ -108,19 +115,24 @@ void MDSDRV_Data::read_song(Song& song)
 }
 
 //! Add an instrument to the data bank.
-void MDSDRV_Data::add_instrument(uint16_t id, const Tag& tag)
+/*!
+ *  \param id Instrument number.
+ *  \param tag Instrument definition.
+ *  \param numbers The words of \p tag converted to numbers, see Tag_Map::get_numbers().
+ */
+void MDSDRV_Data::add_instrument(uint16_t id, const Tag& tag, const std::vector<int32_t>& numbers)
 {
 	auto it = tag.begin();
 	std::string type = *it++;
 	if(iequal("fm", type))
 	{
-		add_ins_fm_4op(id, Tag(it, tag.end()));
+		add_ins_fm_4op(id, numbers);
 		message += "read FM envelope " + dump_data(id, envelope_map[id]) + "\n";
 		return;
 	}
 	else if(iequal("2op", type))
 	{
-		add_ins_fm_2op(id, Tag(it, tag.end()));
+		add_ins_fm_2op(id, numbers);
 		message += "read 2op envelope " + dump_data(id, envelope_map[id]) + "\n";
 		return;
 	}
@@ -145,22 +157,24 @@ void MDSDRV_Data::add_instrument(uint16_t id, const Tag& tag)
 
 
 //! Add 4op FM instrument. Data stored in operator order.
-void MDSDRV_Data::add_ins_fm_4op(uint16_t id, const Tag& tag)
+/*!
+ *  \p numbers is the converted instrument tag, including the type.
+ */
+void MDSDRV_Data::add_ins_fm_4op(uint16_t id, const std::vector<int32_t>& numbers)
 {
 	std::vector<uint8_t> fm_data(30, 0);
 	std::vector<uint8_t> tag_data(42, 0);
-	auto it = tag.begin();
+	auto it = numbers.begin() + 1;
 	for(int i=0; i<42; i++)
 	{
-		if(it == tag.end())
+		if(it == numbers.end())
 			throw InputError(nullptr, stringf("error: not enough parameters for fm instrument @%d", id).c_str());
-		tag_data[i] = std::strtol(it->c_str(), NULL, 10);
-		it++;
+		tag_data[i] = *it++;
 	}
 
 	// Transpose
-	if(it != tag.end())
-		fm_data[29] = (std::strtol(it->c_str(), NULL, 10) + 24) << 1;
+	if(it != numbers.end())
+		fm_data[29] = (*it + 24) << 1;
 	else
 		fm_data[29] = 24 << 1;
 
@@ -202,18 +216,17 @@ void MDSDRV_Data::add_ins_fm_4op(uint16_t id, const Tag& tag)
 /*!
  * Tag format: InsID,Mul1,Mul2,Mul3,Mul4,Transpose
  */
-void MDSDRV_Data::add_ins_fm_2op(uint16_t id, const Tag& tag)
+void MDSDRV_Data::add_ins_fm_2op(uint16_t id, const std::vector<int32_t>& numbers)
 {
 	std::vector<uint8_t> fm_data(30, 0);
 	std::vector<uint8_t> tag_data(6, 0);
 
-	auto it = tag.begin();
+	auto it = numbers.begin() + 1;
 	for(int i=0; i<6; i++)
 	{
-		if(it == tag.end())
+		if(it == numbers.end())
 			throw InputError(nullptr, stringf("error: not enough parameters for 2op fm instrument @%d", id).c_str());
-		tag_data[i] = std::strtol(it->c_str(), NULL, 10);
-		it++;
+		tag_data[i] = *it++;
 	}
 
 	int ins_id = tag_data[0];
@@ -671,8 +684,8 @@ void MDSDRV_Track_Writer::event_hook()
 		case Event::PLATFORM:
 			try
 			{
-				const Tag& tag = mdsdrv.song->get_platform_command(event.param);
-				parse_platform_event(tag);
+				auto& command = mdsdrv.song->get_compiled_platform_command(event.param);
+				parse_platform_event(command);
 			}
 			catch (std::out_of_range &)
 			{
@@ -785,108 +798,116 @@ void MDSDRV_Track_Writer::end_hook()
 		converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FINISH,0));
 }
 
-void MDSDRV_Track_Writer::parse_platform_event(const Tag& tag)
+void MDSDRV_Track_Writer::parse_platform_event(const Platform_Command& command)
 {
-	if(iequal(tag[0], "mode")) // PSG noise mode
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'mode' command");
-		uint16_t param = std::strtol(tag[1].c_str(), 0, 0);
-		if(param == 1)
-			param = 0xe7;
-		else if(param == 2)
-			param = 0xe3;
-		else
-			param = 0x100; // Should be replaced with 00 in the actual file
-		converted_events.push_back(MDSDRV_Event(MDSDRV_Event::LFO, param));
-	}
-	else if(iequal(tag[0], "lfo")) // LFO depth
-	{
-		if(tag.size() < 3)
-			error("not enough parameters for 'lfo' command");
-		converted_events.push_back(MDSDRV_Event(MDSDRV_Event::LFO,
-					((std::strtol(tag[1].c_str(), 0, 0) << 4) | (std::strtol(tag[2].c_str(), 0, 0) & 0x3f))));
-	}
-	else if(iequal(tag[0], "lforate")) // LFO rate
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'lforate' command");
-		uint8_t param = std::strtol(tag[1].c_str(), 0, 0);
-		if(param)
-			param += 7;
-		converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMREG, 0x2200 | param));
-	}
-	else if(iequal(tag[0], "fm3")) // FM3 mode
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'fm3' command");
-		converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FLG,
-					0x80 | ((std::strtol(tag[1].c_str(), 0, 2) ^ 0x0f) & 0x0f)));
-	}
-	else if(iequal(tag[0], "write")) // FM register write
+	switch(command.opcode)
 	{
-		if(tag.size() < 3)
-			error("not enough parameters for 'write' command");
-		uint8_t write_addr = std::strtol(tag[1].c_str(), 0, 0);
-		uint16_t write_data = (write_addr << 8) | (std::strtol(tag[2].c_str(), 0, 0) & 0xff);
-		if(write_addr >= 0x30)
-			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMCREG, write_data));
-		else
-			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMREG, write_data));
-	}
-	else if(iequal(tag[0], "pcmrate")) // PCM channel sample rate
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'pcmrate' command");
-		uint8_t data = std::strtol(tag[1].c_str(), 0, 0);
-		if(data < 1 || data > 8)
-			error("pcmrate argument must be between 1 and 8");
-		converted_events.push_back(MDSDRV_Event(MDSDRV_Event::PCMRATE, data));
-	}
-	else if(iequal(tag[0], "pcmmode")) // PCM mixing mode
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'pcmmode' command");
-		uint8_t data = std::strtol(tag[1].c_str(), 0, 0);
-		if(data < 2 || data > 3)
-			error("pcmmode argument must be between 2 and 3");
-		converted_events.push_back(MDSDRV_Event(MDSDRV_Event::PCMMODE, data));
-	}
-	else if(iequal(tag[0], "cmd")) // Direct command
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'cmd' command");
-		MDSDRV_Event::Type type = (MDSDRV_Event::Type)std::strtol(tag[1].c_str(), 0, 0);
-		uint16_t data = 0;
-		if(tag.size() > 2)
-			data = std::strtol(tag[2].c_str(), 0, 0);
-		converted_events.push_back(MDSDRV_Event(type, data));
-	}
-	else if(iequal(tag[0], "carry"))
-	{
-		converted_events.push_back(MDSDRV_Event(MDSDRV_Event::CARRY, 0));
-	}
-	else if(MDSDRV_get_register(tag[0]))
-	{
-		if(tag.size() < 2)
-			error("not enough parameters for 'write' command");
+		case MDSDRV_Platform::CMD_MODE: // PSG noise mode
+		{
+			if(command.word_count < 2)
+				error("not enough parameters for 'mode' command");
+			uint16_t param = command.args[0];
+			if(param == 1)
+				param = 0xe7;
+			else if(param == 2)
+				param = 0xe3;
+			else
+				param = 0x100; // Should be replaced with 00 in the actual file
+			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::LFO, param));
+			break;
+		}
+		case MDSDRV_Platform::CMD_LFO: // LFO depth
+			if(command.word_count < 3)
+				error("not enough parameters for 'lfo' command");
+			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::LFO,
+						((command.args[0] << 4) | (command.args[1] & 0x3f))));
+			break;
+		case MDSDRV_Platform::CMD_LFORATE: // LFO rate
+		{
+			if(command.word_count < 2)
+				error("not enough parameters for 'lforate' command");
+			uint8_t param = command.args[0];
+			if(param)
+				param += 7;
+			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMREG, 0x2200 | param));
+			break;
+		}
+		case MDSDRV_Platform::CMD_FM3: // FM3 mode
+			if(command.word_count < 2)
+				error("not enough parameters for 'fm3' command");
+			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FLG,
+						0x80 | ((command.args[0] ^ 0x0f) & 0x0f)));
+			break;
+		case MDSDRV_Platform::CMD_WRITE: // FM register write
+		{
+			if(command.word_count < 3)
+				error("not enough parameters for 'write' command");
+			uint8_t write_addr = command.args[0];
+			uint16_t write_data = (write_addr << 8) | (command.args[1] & 0xff);
+			if(write_addr >= 0x30)
+				converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMCREG, write_data));
+			else
+				converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMREG, write_data));
+			break;
+		}
+		case MDSDRV_Platform::CMD_PCMRATE: // PCM channel sample rate
+		{
+			if(command.word_count < 2)
+				error("not enough parameters for 'pcmrate' command");
+			uint8_t data = command.args[0];
+			if(data < 1 || data > 8)
+				error("pcmrate argument must be between 1 and 8");
+			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::PCMRATE, data));
+			break;
+		}
+		case MDSDRV_Platform::CMD_PCMMODE: // PCM mixing mode
+		{
+			if(command.word_count < 2)
+				error("not enough parameters for 'pcmmode' command");
+			uint8_t data = command.args[0];
+			if(data < 2 || data > 3)
+				error("pcmmode argument must be between 2 and 3");
+			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::PCMMODE, data));
+			break;
+		}
+		case MDSDRV_Platform::CMD_CMD: // Direct command
+		{
+			if(command.word_count < 2)
+				error("not enough parameters for 'cmd' command");
+			MDSDRV_Event::Type type = (MDSDRV_Event::Type)command.args[0];
+			uint16_t data = 0;
+			if(command.word_count > 2)
+				data = command.args[1];
+			converted_events.push_back(MDSDRV_Event(type, data));
+			break;
+		}
+		case MDSDRV_Platform::CMD_CARRY:
+			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::CARRY, 0));
+			break;
+		case MDSDRV_Platform::CMD_REGISTER:
+		{
+			if(command.word_count < 2)
+				error("not enough parameters for 'write' command");
 
-		uint8_t reg = MDSDRV_get_register(tag[0]);
-		uint16_t data = (reg << 8) | (std::strtol(tag[1].c_str(), 0, 0) & 0xff);
+			uint8_t reg = command.variant;
+			uint16_t data = (reg << 8) | (command.args[0] & 0xff);
 
-		if(reg >= 0xfc && tag[1].size() > 0)
-		{
-			data -= 0xfc00;
-			uint8_t sign = tag[1][0];
-			if(sign == '+' || sign == '-')
-				converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMTLM, data));
+			if(reg >= 0xfc && (~command.flags & MDSDRV_Platform::CMD_EMPTY_VALUE))
+			{
+				data -= 0xfc00;
+				if(command.flags & MDSDRV_Platform::CMD_RELATIVE)
+					converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMTLM, data));
+				else
+					converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMTL, data));
+			}
+			else if(reg >= 0x30)
+				converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMCREG, data));
 			else
-				converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMTL, data));
+				converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMREG, data));
+			break;
 		}
-		else if(reg >= 0x30)
-			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMCREG, data));
-		else
-			converted_events.push_back(MDSDRV_Event(MDSDRV_Event::FMREG, data));
+		default:
+			break;
 	}
 }
 
@@ -1826,8 +1847,218 @@ int MDSDRV_Linker::find_unique_data(const std::vector<uint8_t>& data) const
 
 //=====================================================================
 
+unsigned int MDSDRV_Cost_Model::get_state_count() const
+{
+	return 2;
+}
+
+//! Get the size of each event in a track.
+/*!
+ *  This follows the conversion done by MDSDRV_Track_Writer and
+ *  MDSDRV_Converter::convert_track(). Consecutive rests are merged into
+ *  one rest command, which is counted at the event that starts it.
+ */
+void MDSDRV_Cost_Model::get_track_cost(Song& song, Track& track, std::vector<Event_Cost>& cost_list) const
+{
+	auto& event_list = track.get_events();
+	uint16_t last_rest = 0xffff;
+	uint16_t last_note = 0xffff;
+	bool note_without_length = false;
+	uint32_t rest_time = 0;
+	uint32_t rest_position = 0;
+	std::stack<bool> loop_break;
+
+	cost_list.assign(event_list.size(), {0, 0, 0});
+
+	auto reset = [&](Event_Cost& cost)
+	{
+		last_rest = 0xffff;
+		last_note = 0xffff;
+		cost.use |= NOTE_STATE | REST_STATE;
+	};
+
+	auto add_rest = [&]()
+	{
+		if(!rest_time)
+			return;
+		Event_Cost& cost = cost_list[rest_position];
+		uint32_t arg = rest_time - 1;
+		cost.use |= REST_STATE;
+		while(arg >= 128)
+		{
+			// A note without length must be followed by one to prevent ambiguity
+			if(note_without_length)
+				cost.size++;
+			note_without_length = false;
+			cost.size++;
+			last_rest = 0x7f;
+			arg -= 128;
+		}
+		if(arg == last_rest)
+		{
+			if(note_without_length)
+				cost.reuse |= REST_STATE;
+		}
+		else if(note_without_length)
+		{
+			cost.size++;
+		}
+		cost.size++;
+		last_rest = arg;
+		note_without_length = false;
+		rest_time = 0;
+	};
+
+	for(uint32_t position = 0; position < event_list.size(); position++)
+	{
+		const Event& event = event_list[position];
+		Event_Cost& cost = cost_list[position];
+		if(event.type != Event::REST)
+			add_rest();
+		else if(rest_time)
+		{
+			// Splitting the rest here adds another rest command
+			cost.use |= REST_STATE;
+			cost.reuse |= REST_STATE;
+		}
+
+		bool note = false;
+		switch(event.type)
+		{
+			default:
+				cost.size = 2;
+				break;
+			case Event::NOP:
+			case Event::REST:
+			case Event::VOL_ENVELOPE:
+				break;
+			case Event::NOTE:
+			case Event::TIE:
+				if(event.on_time)
+				{
+					uint32_t arg = event.on_time - 1;
+					cost.size = 1;
+					cost.use |= NOTE_STATE;
+					while(arg >= 128)
+					{
+						if(last_note != 0x7f)
+							cost.size++;
+						last_note = 0x7f;
+						arg -= 128;
+						cost.size++;
+					}
+					if(arg != last_note)
+					{
+						cost.size++;
+						last_note = arg;
+					}
+					else
+					{
+						cost.reuse |= NOTE_STATE;
+						note = true;
+					}
+				}
+				break;
+			case Event::LOOP_START:
+				cost.size = 1;
+				loop_break.push(false);
+				reset(cost);
+				break;
+			case Event::LOOP_BREAK:
+				cost.size = 2;
+				if(loop_break.size())
+					loop_break.top() = true;
+				break;
+			case Event::LOOP_END:
+				cost.size = 2;
+				if(loop_break.size())
+				{
+					if(loop_break.top())
+						reset(cost);
+					loop_break.pop();
+				}
+				break;
+			case Event::SEGNO:
+				reset(cost);
+				break;
+			case Event::JUMP:
+				cost.size = 2;
+				reset(cost);
+				break;
+			case Event::END:
+			case Event::SLUR:
+				cost.size = 1;
+				break;
+			case Event::PLATFORM:
+				cost.size = get_platform_cost(song, event.param);
+				break;
+		}
+		if(event.type != Event::REST)
+			note_without_length = note;
+
+		if(event.off_time && !rest_time)
+			rest_position = position;
+		rest_time += event.off_time;
+	}
+	add_rest();
+}
+
+//! Get the size of a platform command.
+uint16_t MDSDRV_Cost_Model::get_platform_cost(Song& song, int16_t param) const
+{
+	try
+	{
+		auto& command = song.get_compiled_platform_command(param);
+		if(!command.word_count)
+			return 0;
+		switch(command.opcode)
+		{
+			case MDSDRV_Platform::CMD_CARRY:
+				return 0;
+			case MDSDRV_Platform::CMD_LFORATE:
+			case MDSDRV_Platform::CMD_WRITE:
+			case MDSDRV_Platform::CMD_REGISTER:
+				return 3;
+			default:
+				break;
+		}
+	}
+	catch (std::out_of_range &)
+	{
+		return 0;
+	}
+	return 2;
+}
+
+//! Get the size of a PAT command.
+unsigned int MDSDRV_Cost_Model::get_jump_cost() const
+{
+	return 2;
+}
+
+//! Get the size of a FINISH command and a track table entry.
+unsigned int MDSDRV_Cost_Model::get_subroutine_cost() const
+{
+	return 3;
+}
+
+//! Get the size of the LP, LPF and LPB commands.
+unsigned int MDSDRV_Cost_Model::get_loop_cost(bool loop_break) const
+{
+	return loop_break ? 5 : 3;
+}
+
+//! Get the size of two TRSM commands.
+unsigned int MDSDRV_Cost_Model::get_transpose_cost() const
+{
+	return 4;
+}
+
+//=====================================================================
+
 MDSDRV_Platform::MDSDRV_Platform(int pcm_mode)
 	: pcm_mode(pcm_mode)
+	, cost_model(std::make_shared<MDSDRV_Cost_Model>())
 {
 }
 
@@ -1858,3 +2089,60 @@ std::vector<uint8_t> MDSDRV_Platform::get_export_data(Song& song, int format) co
 		throw std::logic_error("no such exporter");
 	}
 }
+
+std::shared_ptr<Cost_Model> MDSDRV_Platform::get_cost_model() const
+{
+	return cost_model;
+}
+
+//! Compile a platform command.
+/*!
+ *  The command name is looked up once here, so that MD_Channel,
+ *  MD_MacroTrack, MDSDRV_Track_Writer and MDSDRV_Cost_Model can switch
+ *  on the opcode.
+ */
+Platform_Command MDSDRV_Platform::compile_command(const Tag& tag) const
+{
+	Platform_Command command = Platform::compile_command(tag);
+	if(!tag.size())
+		return command;
+
+	const std::string& name = tag[0];
+	if(iequal(name, "mode"))
+		command.opcode = CMD_MODE;
+	else if(iequal(name, "lfo"))
+		command.opcode = CMD_LFO;
+	else if(iequal(name, "lfodelay"))
+		command.opcode = CMD_LFODELAY;
+	else if(iequal(name, "lforate"))
+		command.opcode = CMD_LFORATE;
+	else if(iequal(name, "fm3"))
+	{
+		command.opcode = CMD_FM3;
+		if(tag.size() > 1)
+			command.args[0] = std::strtol(tag[1].c_str(), 0, 2);
+	}
+	else if(iequal(name, "write"))
+		command.opcode = CMD_WRITE;
+	else if(iequal(name, "pcmrate"))
+		command.opcode = CMD_PCMRATE;
+	else if(iequal(name, "pcmmode"))
+		command.opcode = CMD_PCMMODE;
+	else if(iequal(name, "carry"))
+		command.opcode = CMD_CARRY;
+	else if(iequal(name, "cmd"))
+		command.opcode = CMD_CMD;
+	else if(uint8_t reg = MDSDRV_get_register(name))
+	{
+		command.opcode = CMD_REGISTER;
+		command.variant = reg;
+		if(tag.size() > 1)
+		{
+			if(!tag[1].size())
+				command.flags |= CMD_EMPTY_VALUE;
+			else if(tag[1][0] == '+' || tag[1][0] == '-')
+				command.flags |= CMD_RELATIVE;
+		}
+	}
+	return command;
+}
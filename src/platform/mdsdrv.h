@@ -7,6 +7,7 @@
 #include "../track.h"
 #include "../player.h"
 #include "../riff.h"
+#include "../optimizer.h"
 #include <string>
 #include <map>
 #include <set>
@@ -19,6 +20,7 @@ struct MDSDRV_Event;
 class MDSDRV_Track_Writer;
 class MDSDRV_Converter;
 class MDSDRV_Linker;
+class MDSDRV_Cost_Model;
 class MDSDRV_Platform;
 
 // Current sequence version
@@ -60,15 +62,15 @@ class MDSDRV_Data
 		MDSDRV_Data();
 
 		void read_song(Song& song);
-		void add_instrument(uint16_t id, const Tag& tag);
+		void add_instrument(uint16_t id, const Tag& tag, const std::vector<int32_t>& numbers);
 		void add_pitch_envelope(uint16_t id, const Tag& tag);
 		void add_extended_pitch_envelope(uint16_t id, const Tag& tag);
 
 	private:
 		static const int data_count_max = 256;
 
-		void add_ins_fm_4op(uint16_t id, const Tag& tag);
-		void add_ins_fm_2op(uint16_t id, const Tag& tag);
+		void add_ins_fm_4op(uint16_t id, const std::vector<int32_t>& numbers);
+		void add_ins_fm_2op(uint16_t id, const std::vector<int32_t>& numbers);
 		void add_ins_psg(uint16_t id, const Tag& tag);
 		void add_ins_pcm(uint16_t id, const Tag& tag);
 
@@ -168,7 +170,7 @@ class MDSDRV_Track_Writer : public Basic_Player
 		bool loop_hook() override;
 		void end_hook() override;
 
-		void parse_platform_event(const Tag& tag);
+		void parse_platform_event(const Platform_Command& command);
 		uint8_t bpm_to_delta(uint16_t bpm);
 		void check_instrument(int16_t param);
 
@@ -238,11 +240,12 @@ class MDSDRV_Linker
 		std::string get_asm_header() const;
 		std::string get_c_header() const;
 
+		static void check_version(uint8_t major, uint8_t minor);
+
 	private:
 		int add_unique_data(const std::vector<uint8_t>& data);
 		int find_unique_data(const std::vector<uint8_t>& data) const;
 		std::vector<uint8_t> get_pcm_header(const Wave_Bank::Sample& sample) const;
-		void check_version(uint8_t major, uint8_t minor);
 
 		std::string keyify_string(const std::string& input) const;
 		std::string unique_string(const std::string& input, String_Counter& map) const;
@@ -253,17 +256,67 @@ class MDSDRV_Linker
 		Wave_Bank wave_rom;
 };
 
+//! MDSDRV optimizer cost model
+/*!
+ *  Estimates the size of the sequence data produced by MDSDRV_Converter.
+ */
+class MDSDRV_Cost_Model : public Cost_Model
+{
+	public:
+		enum State
+		{
+			NOTE_STATE = 1<<0, //!< Last note length
+			REST_STATE = 1<<1, //!< Last rest length
+		};
+
+		unsigned int get_state_count() const;
+		void get_track_cost(Song& song, Track& track, std::vector<Event_Cost>& cost_list) const;
+		unsigned int get_jump_cost() const;
+		unsigned int get_subroutine_cost() const;
+		unsigned int get_loop_cost(bool loop_break) const;
+		unsigned int get_transpose_cost() const;
+
+	private:
+		uint16_t get_platform_cost(Song& song, int16_t param) const;
+};
+
 class MDSDRV_Platform : public Platform
 {
 	public:
+		//! Platform command opcodes, see compile_command().
+		enum Command_Opcode
+		{
+			CMD_UNKNOWN = 0,
+			CMD_MODE,		//!< PSG noise mode
+			CMD_LFO,		//!< LFO depth
+			CMD_LFODELAY,	//!< LFO delay
+			CMD_LFORATE,	//!< LFO rate
+			CMD_FM3,		//!< FM3 mode. The operator mask is parsed as a binary number.
+			CMD_WRITE,		//!< FM register write
+			CMD_PCMRATE,	//!< PCM channel sample rate
+			CMD_PCMMODE,	//!< PCM mixing mode
+			CMD_CARRY,		//!< Carry the macro track
+			CMD_CMD,		//!< Direct command
+			CMD_REGISTER,	//!< Named FM register write. The register address is in the variant.
+		};
+		//! Flags for \ref CMD_REGISTER.
+		enum Command_Flag
+		{
+			CMD_RELATIVE = 1<<0,	//!< The value starts with a '+' or '-' sign.
+			CMD_EMPTY_VALUE = 1<<1,	//!< The value is an empty string.
+		};
+
 		MDSDRV_Platform(int pcm_mode);
 
 		std::shared_ptr<Driver> get_driver(unsigned int rate, VGM_Interface* vgm_interface) const;
 		const Platform::Format_List& get_export_formats() const;
 		std::vector<uint8_t> get_export_data(Song& song, int format) const;
+		std::shared_ptr<Cost_Model> get_cost_model() const;
+		Platform_Command compile_command(const Tag& tag) const;
 
 	private:
 		int pcm_mode;
+		std::shared_ptr<Cost_Model> cost_model; // stateless, shared by all optimizers
 };
 
 #endif
@@ -2,6 +2,7 @@
 #include "../input.h"
 #include "../mml_input.h"
 #include "../stringf.h"
+#include "../song_cache.h"
 #include "mdsdrv.h"
 
 #include <iostream>
@@ -20,8 +21,9 @@ void print_usage(const char* exename)
 	std::cout << "\t-o <mdsseq.bin> <mdsbin.bin> : Specify output filenames\n";
 	std::cout << "\t-i <mdsseq.inc>              : Specify ASM headers\n";
 	std::cout << "\t-h <mdsseq.h>                : Specify C headers\n";
+	std::cout << "\t--cache <directory>          : Reuse parsed songs if the input files are unchanged\n";
 	std::cout << "Note:\n";
-	std::cout << "\tInput files can be in .mml or .mds format\n\n";
+	std::cout << "\tInput files can be in .mml, .mid or .mds format\n\n";
 	std::cout << "MDSDRV version " << MDSDRV_SEQ_VERSION_MAJOR << "." << MDSDRV_SEQ_VERSION_MINOR << " ";
 	std::cout << "(minimum compatible version " << MDSDRV_MIN_SEQ_VERSION_MAJOR << "." << MDSDRV_MIN_SEQ_VERSION_MINOR << ")\n\n";
 }
@@ -52,11 +54,27 @@ std::string get_filename(const std::string& input_filename)
 		return input_filename.substr(0, epos);
 }
 
-Song convert_file(const char* filename)
+Song convert_file(const char* filename, const std::string& cache_directory)
 {
-	Song song;
-	MML_Input input = MML_Input(&song);
-	input.open_file(filename);
+	Song song(std::make_shared<Arena>());
+	if(!cache_directory.size())
+	{
+		auto input = Input::get_input(&song, filename);
+		input->open_file(filename);
+	}
+	else
+	{
+		Song_Cache cache(cache_directory);
+		if(!cache.load(song, filename))
+		{
+			auto provider = std::make_shared<Recording_File_Provider>(std::make_shared<Disk_File_Provider>());
+			auto input = Input::get_input(&song, filename);
+			input->set_file_provider(provider);
+			input->open_file(filename);
+			if(!cache.save(song, provider->get_dependencies()))
+				std::cerr << "Failed to write cache file " << cache.get_cache_filename(filename) << "\n";
+		}
+	}
 	auto validator = Song_Validator(song);
 	for(auto it = validator.get_track_map().begin(); it != validator.get_track_map().end(); it++)
 	{
@@ -75,6 +93,7 @@ int main(int argc, char* argv[])
 	std::string pcm_filename = "mdspcm.bin";
 	std::string c_header_filename = "";
 	std::string asm_header_filename = "";
+	std::string cache_directory = "";
 
 	for(int arg = 1; arg < argc; arg++)
 	{
@@ -87,6 +106,14 @@ int main(int argc, char* argv[])
 			c_header_filename = argv[++arg];
 		else if((!strcmp(argv[arg], "-i") || !strcmp(argv[arg], "--asm-header")) && arg < argc)
 			asm_header_filename = argv[++arg];
+		else if(!strcmp(argv[arg], "--cache") && arg + 1 < argc)
+			cache_directory = argv[++arg];
+		else if(!strcmp(argv[arg], "--cache"))
+		{
+			print_usage(argv[0]);
+			std::cerr << "--cache requires a directory\n";
+			return -1;
+		}
 		else
 			input.push_back(argv[arg]);
 	}
@@ -129,7 +156,7 @@ int main(int argc, char* argv[])
 			}
 			else
 			{
-				auto song = convert_file(it->c_str());
+				auto song = convert_file(it->c_str(), cache_directory);
 				auto converter = MDSDRV_Converter(song);
 				mds = converter.get_mds();
 			}
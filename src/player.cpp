@@ -14,7 +14,8 @@
  *  \param[in,out] track reference to a Track.
  */
 Basic_Player::Basic_Player(Song& song, Track& track)
-	: play_time(0)
+	: reference({0, 0})
+	, play_time(0)
 	, loop_play_time(-1)
 	, on_time(0)
 	, off_time(0)
@@ -57,22 +58,23 @@ void Basic_Player::step_event()
 	try
 	{
 		// Read the next event
-		track_event = &track->get_event(position++);
+		track_event = &track->get_event(position);
 		// Set the event time
-		if(track_event->play_time > play_time)
-			track_event->play_time = play_time;
+		if(track->get_play_time(position) > play_time)
+			track->set_play_time(position, play_time);
+		reference = track->get_reference(position);
+		position++;
 		event = *track_event;
 	}
 	catch(std::out_of_range&)
 	{
 		// reached the end
-		event = {Event::END, 0, 0, 0, UINT_MAX, reference};
+		event = {Event::END, 0, 0, 0};
 		track_event = nullptr;
 	}
 	// Set new on/off time
 	on_time = event.on_time;
 	off_time = event.off_time;
-	reference = event.reference;
 	// Handle events
 	switch(event.type)
 	{
@@ -258,15 +260,16 @@ const Event& Basic_Player::get_event() const
 //! Get a list of references to the current track position and calling commands.
 std::vector<std::shared_ptr<InputRef>> Basic_Player::get_references()
 {
+	auto& source_map = song->get_source_map();
 	std::vector<std::shared_ptr<InputRef>> reflist;
-	reflist.push_back(track->get_events().at(position-1).reference);
+	reflist.push_back(source_map.get_reference(track->get_reference(position-1)));
 
 	std::stack<Player_Stack> copy_stack = stack;
 	while(!copy_stack.empty())
 	{
 		auto frame = copy_stack.top();
 		if(frame.type != Player_Stack::LOOP)
-			reflist.push_back(frame.track->get_events().at(frame.position-1).reference);
+			reflist.push_back(source_map.get_reference(frame.track->get_reference(frame.position-1)));
 		copy_stack.pop();
 	}
 	return reflist;
@@ -366,7 +369,7 @@ Song* Basic_Player::get_song()
  */
 void Basic_Player::error(const char* message) const
 {
-	throw InputError(reference, message);
+	throw InputError(song->get_source_map().get_reference(reference), message);
 }
 
 //! Throw an error with appropriate message for a stack underflow.
@@ -482,7 +485,7 @@ void Player::play_tick()
 		// key off
 		if(!on_time && off_time)
 		{
-			event = {Event::REST, 0, 0, 0, UINT_MAX, reference};
+			event = {Event::REST, 0, 0, 0};
 			write_event();
 		}
 	}
@@ -668,8 +671,9 @@ int16_t Player::get_last_note() const
  *  The override function should modify the \p platform_state as appropriate
  *  and then return a bitmask indicating the changed state.
  *
- *  \param[in] tag Reference to a Tag containing the platform command,
- *                 as created by Song::register_platform_command().
+ *  \param[in] command The platform command, as compiled by
+ *                 Platform::compile_command() when it was registered
+ *                 with Song::register_platform_command().
  *  \param[in,out] platform_state Pointer to the internal platform
  *                 command state array.
  *  \return Override functions should return a bitmask representing the
@@ -679,7 +683,7 @@ int16_t Player::get_last_note() const
  *
  *  \see Song::register_platform_command()
  */
-uint32_t Player::parse_platform_event(const Tag& tag, int16_t* platform_state)
+uint32_t Player::parse_platform_event(const Platform_Command& command, int16_t* platform_state)
 {
 	return 0;
 }
@@ -687,13 +691,13 @@ uint32_t Player::parse_platform_event(const Tag& tag, int16_t* platform_state)
 
 //! Custom platform update
 /*!
- *  Call parse_platform_event() manually with the specified Tag
+ *  Call parse_platform_event() manually with the specified command
  *
- *  \param tag parameter passed to parse_platform_event()
+ *  \param command parameter passed to parse_platform_event()
  */
-void Player::platform_update(const Tag& tag)
+void Player::platform_update(const Platform_Command& command)
 {
-	platform_update_mask |= parse_platform_event(tag, platform_state);
+	platform_update_mask |= parse_platform_event(command, platform_state);
 }
 
 //! Event handler.
@@ -775,8 +779,8 @@ void Player::handle_event()
 		case Event::PLATFORM:
 			try
 			{
-				const Tag& tag = song->get_platform_command(event.param);
-				platform_update_mask |= parse_platform_event(tag, platform_state);
+				auto& command = song->get_compiled_platform_command(event.param);
+				platform_update_mask |= parse_platform_event(command, platform_state);
 			}
 			catch (std::out_of_range &)
 			{
@@ -834,7 +838,7 @@ bool Player::loop_hook()
 
 void Player::end_hook()
 {
-	event = {Event::END, 0, 0, 0, UINT_MAX, reference};
+	event = {Event::END, 0, 0, 0};
 	write_event();
 }
 
@@ -96,7 +96,7 @@ class Basic_Player
 		//! Pointer to current event in the track.
 		Event *track_event;
 		//! Current reference
-		std::shared_ptr<InputRef> reference;
+		Source_Location reference;
 		//! Playing time
 		unsigned int play_time;
 		//! Playing time at loop point
@@ -166,7 +166,7 @@ class Player : public Basic_Player
 		void set_var(Event::Type type, int16_t val);
 		void set_coarse_volume_flag(bool state);
 
-		void platform_update(const Tag& tag);
+		void platform_update(const Platform_Command& command);
 
 	protected:
 		bool get_platform_flag(unsigned int type) const;
@@ -175,7 +175,7 @@ class Player : public Basic_Player
 		void set_update_flag(Event::Type type);
 		void clear_update_flag(Event::Type type);
 		int16_t get_last_note() const;
-		virtual uint32_t parse_platform_event(const Tag& tag, int16_t* platform_state);
+		virtual uint32_t parse_platform_event(const Platform_Command& command, int16_t* platform_state);
 		virtual void write_event();
 
 	private:
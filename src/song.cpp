@@ -7,24 +7,310 @@
 #include "vgm.h"
 #include "driver.h"
 #include "track.h"
+#include "optimizer.h"
 #include "stringf.h"
 #include "platform/mdsdrv.h"
 
+//! Numbered tag key prefixes, see Tag_Key.
+static const struct
+{
+	const char* prefix;
+	Tag_Key::Family family;
+} tag_key_prefixes[] = {
+	{"@e", Tag_Key::ENVELOPE},
+	{"@m", Tag_Key::MACRO},
+	{"@p", Tag_Key::PCM},
+	{"@", Tag_Key::INSTRUMENT},
+	{"cmd_", Tag_Key::PLATFORM_COMMAND},
+};
+
+//! Parse a numbered tag key.
+/*!
+ *  Only numbers written in canonical form (no leading zeroes, and no
+ *  sign except for negative platform commands) are accepted, so that
+ *  two different strings never map to the same key.
+ *
+ *  \return true if the key is numbered.
+ */
+static bool parse_numbered_key(const std::string& key, Tag_Key& out)
+{
+	for(auto && prefix : tag_key_prefixes)
+	{
+		size_t length = strlen(prefix.prefix);
+		if(key.compare(0, length, prefix.prefix) != 0)
+			continue;
+		const char* s = key.c_str() + length;
+		bool negative = false;
+		if(prefix.family == Tag_Key::PLATFORM_COMMAND && *s == '-')
+		{
+			negative = true;
+			s++;
+		}
+		if(!isdigit(*s) || (*s == '0' && (negative || s[1])))
+			return false;
+		long value = 0;
+		for(; isdigit(*s) && value <= 65535; s++)
+			value = value * 10 + (*s - '0');
+		if(*s)
+			return false;
+		if(prefix.family == Tag_Key::PLATFORM_COMMAND)
+		{
+			if(negative)
+				value = -value;
+			if(value < -32768 || value > 32767)
+				return false;
+			value += 32768;
+		}
+		else if(value > 65535)
+		{
+			return false;
+		}
+		out = {prefix.family, (uint16_t)value};
+		return true;
+	}
+	return false;
+}
+
+//! Constructs an empty Tag_Map.
+Tag_Map::Tag_Map()
+	: entries()
+	, order()
+	, atom_ids()
+	, atom_names()
+{
+}
+
+//! Gets the key for the specified string, creating a new atom if necessary.
+Tag_Key Tag_Map::intern(const std::string& key)
+{
+	Tag_Key out;
+	if(parse_numbered_key(key, out))
+		return out;
+	auto it = atom_ids.find(key);
+	if(it != atom_ids.end())
+		return {Tag_Key::NAMED, it->second};
+	if(atom_names.size() > UINT16_MAX)
+		throw std::length_error("Tag_Map::intern: too many tag keys");
+	uint16_t id = atom_names.size();
+	atom_ids.emplace(key, id);
+	atom_names.push_back(key);
+	return {Tag_Key::NAMED, id};
+}
+
+//! Gets the key for the specified string, without creating a new atom.
+/*!
+ *  \return false if the string has not been interned.
+ */
+bool Tag_Map::lookup(const std::string& key, Tag_Key& out) const
+{
+	if(parse_numbered_key(key, out))
+		return true;
+	auto it = atom_ids.find(key);
+	if(it == atom_ids.end())
+		return false;
+	out = {Tag_Key::NAMED, it->second};
+	return true;
+}
+
+//! Gets the string for the specified key.
+std::string Tag_Map::get_name(Tag_Key key) const
+{
+	if(key.family == Tag_Key::NAMED)
+		return atom_names.at(key.id);
+	for(auto && prefix : tag_key_prefixes)
+	{
+		if(prefix.family == key.family)
+		{
+			int value = key.id;
+			if(key.family == Tag_Key::PLATFORM_COMMAND)
+				value -= 32768;
+			return prefix.prefix + std::to_string(value);
+		}
+	}
+	throw std::out_of_range("Tag_Map::get_name");
+}
+
+Tag_Map::Entry* Tag_Map::get_entry(Tag_Key key)
+{
+	auto& table = entries[key.family];
+	if(key.id >= table.size() || !table[key.id].defined)
+		return nullptr;
+	return &table[key.id];
+}
+
+const Tag_Map::Entry* Tag_Map::get_entry(Tag_Key key) const
+{
+	auto& table = entries[key.family];
+	if(key.id >= table.size() || !table[key.id].defined)
+		return nullptr;
+	return &table[key.id];
+}
+
+//! Gets the tag with the specified key, or nullptr if it does not exist.
+Tag* Tag_Map::find(Tag_Key key)
+{
+	Entry* entry = get_entry(key);
+	return entry ? &entry->tag : nullptr;
+}
+
+//! Gets the tag with the specified key, or nullptr if it does not exist.
+const Tag* Tag_Map::find(Tag_Key key) const
+{
+	const Entry* entry = get_entry(key);
+	return entry ? &entry->tag : nullptr;
+}
+
+//! Gets the tag with the specified key.
+/*!
+ * \exception std::out_of_range if not found
+ */
+Tag& Tag_Map::at(Tag_Key key)
+{
+	Tag* tag = find(key);
+	if(!tag)
+		throw std::out_of_range("Tag_Map::at");
+	return *tag;
+}
+
+//! Gets the tag with the specified key.
+/*!
+ * \exception std::out_of_range if not found
+ */
+const Tag& Tag_Map::at(Tag_Key key) const
+{
+	const Tag* tag = find(key);
+	if(!tag)
+		throw std::out_of_range("Tag_Map::at");
+	return *tag;
+}
+
+//! Gets the tag with the specified key.
+/*!
+ * \exception std::out_of_range if not found
+ */
+Tag& Tag_Map::at(const std::string& key)
+{
+	Tag_Key tag_key;
+	if(!lookup(key, tag_key))
+		throw std::out_of_range("Tag_Map::at");
+	return at(tag_key);
+}
+
+//! Gets the tag with the specified key.
+/*!
+ * \exception std::out_of_range if not found
+ */
+const Tag& Tag_Map::at(const std::string& key) const
+{
+	Tag_Key tag_key;
+	if(!lookup(key, tag_key))
+		throw std::out_of_range("Tag_Map::at");
+	return at(tag_key);
+}
+
+//! Gets the tag with the specified key, creating an empty tag if necessary.
+/*!
+ *  This invalidates the get_numbers() cache of the tag.
+ */
+Tag& Tag_Map::operator[](Tag_Key key)
+{
+	auto& table = entries[key.family];
+	if(key.id >= table.size())
+		table.resize(key.id + 1);
+	Entry& entry = table[key.id];
+	if(!entry.defined)
+	{
+		entry.defined = true;
+		order.push_back(key);
+	}
+	entry.parsed = false;
+	return entry.tag;
+}
+
+//! Gets the tag with the specified key, creating an empty tag if necessary.
+Tag& Tag_Map::operator[](const std::string& key)
+{
+	return (*this)[intern(key)];
+}
+
+//! Returns 1 if the key is present, otherwise 0.
+size_t Tag_Map::count(const std::string& key) const
+{
+	Tag_Key tag_key;
+	return lookup(key, tag_key) && count(tag_key);
+}
+
+//! Gets the words of a tag converted to numbers.
+/*!
+ *  The words are converted with strtol() in base 10, and words that
+ *  are not numbers become 0. The result is cached until the tag is
+ *  accessed with operator[].
+ *
+ * \exception std::out_of_range if not found
+ */
+const std::vector<int32_t>& Tag_Map::get_numbers(Tag_Key key) const
+{
+	const Entry* entry = get_entry(key);
+	if(!entry)
+		throw std::out_of_range("Tag_Map::get_numbers");
+	if(!entry->parsed)
+	{
+		entry->numbers.resize(entry->tag.size());
+		for(unsigned int i = 0; i < entry->tag.size(); i++)
+			entry->numbers[i] = strtol(entry->tag[i].c_str(), NULL, 10);
+		entry->parsed = true;
+	}
+	return entry->numbers;
+}
+
+//! Removes all tags.
+void Tag_Map::clear()
+{
+	for(auto && table : entries)
+		table.clear();
+	order.clear();
+}
+
 //! Constructs a Song.
 Song::Song()
-	: tag_map()
+	: Song(nullptr)
+{
+}
+
+//! Constructs a Song using an Arena.
+/*!
+ *  The event lists of the tracks are allocated from \p arena, so that
+ *  they are freed at once when the Song (and any other owner of the
+ *  arena) is destroyed. Copies of the tracks use the heap.
+ *
+ *  \param arena Arena to allocate from, or nullptr to use the heap.
+ */
+Song::Song(std::shared_ptr<Arena> arena)
+	: arena(arena)
+	, tag_map()
 	, track_map()
 	, ppqn(24)
 	, platform_command_index(-32768)
+	, platform(Platform::get_platform("megadrive"))
+	, platform_key("megadrive")
 {
-	platform = new MDSDRV_Platform(0);
 }
 
 //! Destructs a Song
 Song::~Song()
 {
-	if(platform)
-		delete platform;
+}
+
+//! Makes a deep copy of the Song.
+/*!
+ *  The tracks of the copy are allocated from the heap, and the Platform
+ *  is shared with the original.
+ */
+Song Song::clone() const
+{
+	Song copy(*this);
+	copy.arena = nullptr;
+	return copy;
 }
 
 //! Get a reference to the tag map.
@@ -39,7 +325,7 @@ Tag_Map& Song::get_tag_map()
  */
 bool Song::check_tag(const std::string& key) const
 {
-	return tag_map.find(key) != tag_map.end();
+	return tag_map.count(key);
 }
 
 //! Gets the tag with the specified key.
@@ -57,16 +343,19 @@ Tag& Song::get_tag(const std::string& key)
  */
 Tag& Song::get_or_make_tag(const std::string& key)
 {
-	auto lookup = tag_map.find(key);
-	if(lookup != tag_map.end())
-	{
-		return lookup->second;
-	}
-	else
-	{
-		tag_map["tag_order"].push_back(key);
+	return get_or_make_tag(tag_map.intern(key));
+}
+
+//! Gets the tag with the specified key, otherwise creates a new tag.
+/*!
+ * If a new tag is created, an entry is added to the 'tag_order' tag.
+ */
+Tag& Song::get_or_make_tag(Tag_Key key)
+{
+	if(tag_map.count(key))
 		return tag_map[key];
-	}
+	tag_map["tag_order"].push_back(tag_map.get_name(key));
+	return tag_map[key];
 }
 
 //! Gets the tag order list.
@@ -90,12 +379,37 @@ const std::string& Song::get_tag_front(const std::string& key) const
  */
 std::string Song::get_tag_front_safe(const std::string& key) const
 {
-	if(tag_map.count(key) && tag_map.at(key).size())
-		return tag_map.at(key).front();
+	Tag_Key tag_key;
+	const Tag* tag = tag_map.lookup(key, tag_key) ? tag_map.find(tag_key) : nullptr;
+	if(tag && tag->size())
+		return tag->front();
 	else
 		return "";
 }
 
+//! Gets the words of the \c \#option tag.
+/*!
+ *  Options are separated by spaces or commas. If the tag is not present,
+ *  an empty list is returned.
+ */
+Tag Song::get_option_list() const
+{
+	Tag option_list;
+	if(!tag_map.count("#option"))
+		return option_list;
+	for(auto && value : tag_map.at("#option"))
+	{
+		std::string::size_type start = 0;
+		while((start = value.find_first_not_of(" \t,", start)) != std::string::npos)
+		{
+			auto end = value.find_first_of(" \t,", start);
+			option_list.push_back(value.substr(start, end - start));
+			start = end;
+		}
+	}
+	return option_list;
+}
+
 //! Appends a value to the tag with the specified key.
 /*!
  *  Appends the value as a new item to the tag.
@@ -181,6 +495,15 @@ static char* add_tag_enclosed(Tag *tag, char* s)
  *  \see add_tag() set_tag()
  */
 void Song::add_tag_list(const std::string& key, const std::string& value)
+{
+	add_tag_list(tag_map.intern(key), value);
+}
+
+//! Append multiple values to the tag with the specified key.
+/*!
+ *  \see add_tag_list(const std::string&, const std::string&)
+ */
+void Song::add_tag_list(Tag_Key key, const std::string& value)
 {
 	Tag *tag = &get_or_make_tag(key);
 	char *str = strdup(value.c_str());
@@ -242,10 +565,25 @@ int16_t Song::register_platform_command(int16_t param, const std::string& value)
 {
 	if(param == -1)
 		param = platform_command_index++;
-	add_tag_list(stringf("cmd_%d", param), value);
+	add_tag_list(Tag_Key::platform_command(param), value);
+	compile_platform_command(param);
 	return param;
 }
 
+//! Compile the platform command with the specified id.
+/*!
+ *  This is done when a command is registered and when the platform
+ *  is changed.
+ */
+void Song::compile_platform_command(int16_t param)
+{
+	uint16_t index = param + 32768;
+	if(index >= platform_commands.size())
+		platform_commands.resize(index + 1);
+	platform_commands[index] = platform->compile_command(get_platform_command(param));
+	platform_commands[index].defined = true;
+}
+
 //! Gets the registered platform command with the specified id.
 /*!
  * \param param Command id.
@@ -254,7 +592,23 @@ int16_t Song::register_platform_command(int16_t param, const std::string& value)
  */
 Tag& Song::get_platform_command(int16_t param)
 {
-	return tag_map.at(stringf("cmd_%d", param));
+	return tag_map.at(Tag_Key::platform_command(param));
+}
+
+//! Gets the compiled platform command with the specified id.
+/*!
+ * \param param Command id.
+ * \return Reference to the compiled command.
+ * \exception std::out_of_range if not found
+ *
+ * \see Platform::compile_command()
+ */
+const Platform_Command& Song::get_compiled_platform_command(int16_t param) const
+{
+	uint16_t index = param + 32768;
+	if(index >= platform_commands.size() || !platform_commands[index].defined)
+		throw std::out_of_range("Song::get_compiled_platform_command");
+	return platform_commands[index];
 }
 
 //! Get a reference to the track map.
@@ -279,7 +633,7 @@ Track& Song::get_track(uint16_t id)
 Track& Song::make_track(uint16_t id)
 {
 	if(!track_map.count(id))
-		return track_map.emplace(id, Track(ppqn)).first->second;
+		return track_map.emplace(id, Track(ppqn, arena.get())).first->second;
 	else
 		return track_map.at(id);
 }
@@ -299,35 +653,90 @@ void Song::set_ppqn(uint16_t new_ppqn)
 //! Gets the platform
 const Platform* Song::get_platform() const
 {
-	return platform;
+	return platform.get();
 }
 
 //! Sets the platform
 /*!
+ *  \param key Platform name, as used by the \c #platform tag. See
+ *             Platform::get_platform().
  *  \return 1 on failure
  *  \return 0 on success
  */
 bool Song::set_platform(const std::string& key)
 {
-	if(iequal(key, "megadrive"))
-	{
-		delete platform;
-		platform = new MDSDRV_Platform(0);
-	}
-	else if(iequal(key, "mdsdrv"))
+	auto new_platform = Platform::get_platform(key);
+	if(!new_platform)
+		return 1;
+	platform = new_platform;
+	platform_key = key;
+	for(unsigned int index = 0; index < platform_commands.size(); index++)
 	{
-		delete platform;
-		platform = new MDSDRV_Platform(2);
+		if(platform_commands[index].defined)
+			compile_platform_command(index - 32768);
 	}
-	//type = key;
 	return 0;
 }
 
+//! Get the Arena used by the tracks, or nullptr if the heap is used.
+Arena* Song::get_arena() const
+{
+	return arena.get();
+}
+
+//! Get a reference to the source map.
+/*!
+ *  This is used to look up the input file references of Events.
+ */
+Source_Map& Song::get_source_map()
+{
+	return source_map;
+}
+
 std::shared_ptr<Driver> Platform::get_driver(unsigned int rate, VGM_Interface* vgm_interface) const
 {
 	throw std::logic_error("No available driver");
 }
 
+//! Get the shared instance of a platform.
+/*!
+ *  The platforms are created on the first call, and live until the
+ *  program exits. This may be called from several threads.
+ *
+ *  \param key Platform name, not case sensitive.
+ *  \return nullptr if there is no such platform.
+ */
+std::shared_ptr<const Platform> Platform::get_platform(const std::string& key)
+{
+	static const std::vector<std::pair<std::string, std::shared_ptr<const Platform>>> registry = {
+		{"megadrive", std::make_shared<MDSDRV_Platform>(0)},
+		{"mdsdrv", std::make_shared<MDSDRV_Platform>(2)},
+	};
+	for(auto && entry : registry)
+	{
+		if(iequal(entry.first, key))
+			return entry.second;
+	}
+	return nullptr;
+}
+
+//! Compile a platform command.
+/*!
+ *  The default implementation converts the words after the command name
+ *  to numbers and leaves the opcode at 0. Platforms should override this
+ *  to set the opcode and any other fields.
+ *
+ *  \param tag The command, as registered by Song::register_platform_command().
+ */
+Platform_Command Platform::compile_command(const Tag& tag) const
+{
+	Platform_Command command = {};
+	command.word_count = (tag.size() > UINT8_MAX) ? UINT8_MAX : tag.size();
+	for(unsigned int i = 0; i < Platform_Command::MAX_ARGS && i + 1 < tag.size(); i++)
+		command.args[i] = strtol(tag[i + 1].c_str(), 0, 0);
+	return command;
+}
+
 const Platform::Format_List& Platform::get_export_formats() const
 {
 	static const Platform::Format_List out = {{"vgm", "VGM"}};
@@ -346,18 +755,20 @@ std::vector<uint8_t> Platform::get_export_data(Song& song, int format) const
 	}
 }
 
+//! Get the cost model used by the optimizer.
+std::shared_ptr<Cost_Model> Platform::get_cost_model() const
+{
+	return std::make_shared<Cost_Model>();
+}
+
 static inline std::string safe_get_tag(Song& song, const std::string& tagname)
 {
-	if(song.get_tag_map()[tagname].size())
-		return song.get_tag_map()[tagname].front();
-	else
-		return "";
+	return song.get_tag_front_safe(tagname);
 }
 
 static inline VGM_Tag get_tags(Song& song)
 {
 	VGM_Tag tag;
-	Tag_Map tag_map = song.get_tag_map();
 
 	tag.title = safe_get_tag(song,"#title");
 	tag.title_j = safe_get_tag(song,"#titlej");
@@ -4,8 +4,148 @@
 #include <stdint.h>
 #include <memory>
 #include <utility>
+#include <string>
+#include <unordered_map>
 
 #include "core.h"
+#include "input.h"
+#include "track.h"
+
+//! Pre-compiled platform command.
+/*!
+ *  Platform commands are compiled by Platform::compile_command() when
+ *  they are registered, so that players can dispatch on the opcode
+ *  instead of parsing the command Tag every time the event is played.
+ */
+struct Platform_Command
+{
+	//! Maximum number of numeric arguments.
+	static const int MAX_ARGS = 3;
+
+	//! Set if the command has been registered.
+	bool defined;
+	//! Platform-specific opcode. 0 if the command was not recognized.
+	uint8_t opcode;
+	//! Platform-specific sub-opcode, for example a register address.
+	uint8_t variant;
+	//! Platform-specific flags.
+	uint8_t flags;
+	//! Number of words in the command Tag, including the command name.
+	uint8_t word_count;
+	//! The words following the command name, converted to numbers.
+	int32_t args[MAX_ARGS];
+};
+
+//! Interned tag key.
+/*!
+ *  Instrument, envelope and platform command tags have numbered keys
+ *  such as \c @1, \c @m3 or \c cmd_-32768. These are stored by family
+ *  and number, so that they can be looked up without formatting or
+ *  comparing strings. All other keys are interned as atoms in the
+ *  Tag_Map and stored with the \ref NAMED family.
+ */
+struct Tag_Key
+{
+	//! Key family.
+	enum Family : uint8_t
+	{
+		NAMED = 0,			//!< Any other key. The id is an atom.
+		INSTRUMENT,			//!< \c \@n
+		ENVELOPE,			//!< \c \@en
+		MACRO,				//!< \c \@mn. Pitch envelopes in MDSDRV.
+		PCM,				//!< \c \@pn
+		PLATFORM_COMMAND,	//!< \c cmd_n. The id is the command id + 32768.
+		FAMILY_COUNT
+	};
+
+	Family family;
+	uint16_t id;
+
+	inline bool operator==(const Tag_Key& other) const
+	{
+		return family == other.family && id == other.id;
+	}
+	inline bool operator!=(const Tag_Key& other) const
+	{
+		return !(*this == other);
+	}
+
+	//! Key of a platform command tag.
+	static inline Tag_Key platform_command(int16_t param)
+	{
+		return {PLATFORM_COMMAND, (uint16_t)(param + 32768)};
+	}
+};
+
+//! Tag map.
+/*!
+ *  Stores the Song tags by Tag_Key. Tags can also be accessed with
+ *  string keys, which are converted with lookup() or intern().
+ *
+ *  The tags are kept in insertion order, see get_order().
+ *
+ *  Numeric tags, such as instrument definitions, can be read with
+ *  get_numbers(), which converts the words of the tag once and caches
+ *  the result until the tag is accessed for writing with operator[].
+ *  Tags returned by find() and at() should only be read.
+ */
+class Tag_Map
+{
+	public:
+		Tag_Map();
+
+		Tag_Key intern(const std::string& key);
+		bool lookup(const std::string& key, Tag_Key& out) const;
+		std::string get_name(Tag_Key key) const;
+
+		Tag* find(Tag_Key key);
+		const Tag* find(Tag_Key key) const;
+		Tag& at(Tag_Key key);
+		const Tag& at(Tag_Key key) const;
+		Tag& at(const std::string& key);
+		const Tag& at(const std::string& key) const;
+		Tag& operator[](Tag_Key key);
+		Tag& operator[](const std::string& key);
+
+		//! Returns 1 if the key is present, otherwise 0.
+		inline size_t count(Tag_Key key) const
+		{
+			return find(key) != nullptr;
+		}
+		size_t count(const std::string& key) const;
+
+		//! Returns the number of tags.
+		inline size_t size() const
+		{
+			return order.size();
+		}
+		//! Returns the keys in insertion order.
+		inline const std::vector<Tag_Key>& get_order() const
+		{
+			return order;
+		}
+
+		const std::vector<int32_t>& get_numbers(Tag_Key key) const;
+
+		void clear();
+
+	private:
+		struct Entry
+		{
+			bool defined;
+			mutable bool parsed;
+			Tag tag;
+			mutable std::vector<int32_t> numbers;
+		};
+
+		Entry* get_entry(Tag_Key key);
+		const Entry* get_entry(Tag_Key key) const;
+
+		std::vector<Entry> entries[Tag_Key::FAMILY_COUNT];
+		std::vector<Tag_Key> order;
+		std::unordered_map<std::string,uint16_t> atom_ids;
+		std::vector<std::string> atom_names;
+};
 
 //! Song class.
 /*!
@@ -15,29 +155,43 @@
  *
  * The tags represent song metadata (for example title and author) as well as envelopes and other platform-specific data
  * that cannot be easily represented in a portable way. Tags consists of a string vector and tag map keys are also strings.
- * The # prefix is used for song metadata, @ for instruments or envelope data.
+ * The # prefix is used for song metadata, @ for instruments or envelope data. Numbered keys are interned by
+ * the Tag_Map, see Tag_Key.
  *
  * The 'cmd_' prefix is special and used for platform-specific events. Use the register_platform_command() and
  * get_platform_command() to set and retrieve these tags.
+ *
+ * Songs can be moved cheaply, but not copied. Use clone() to make a deep copy. Objects that refer to a Song, such as
+ * an Input or a Player, must not be used after the Song has been moved.
  */
 class Song
 {
+	friend class Song_Cache;
 	public:
 		Song();
+		Song(std::shared_ptr<Arena> arena);
+		Song(Song&& other) = default;
+		Song& operator=(Song&& other) = default;
 		virtual ~Song();
 
+		Song clone() const;
+
 		Tag_Map& get_tag_map();
 		void add_tag(const std::string& key, std::string value);
 		void add_tag_list(const std::string &key, const std::string &value);
+		void add_tag_list(Tag_Key key, const std::string &value);
 		void set_tag(const std::string& key, std::string value);
 		bool check_tag(const std::string& key) const;
 		Tag& get_tag(const std::string& key);
 		Tag& get_or_make_tag(const std::string& key);
+		Tag& get_or_make_tag(Tag_Key key);
 		const std::string& get_tag_front(const std::string& key) const;
 		std::string get_tag_front_safe(const std::string& key) const;
+		Tag get_option_list() const;
 
 		int16_t register_platform_command(int16_t param, const std::string& value);
 		Tag& get_platform_command(int16_t param);
+		const Platform_Command& get_compiled_platform_command(int16_t param) const;
 		Tag& get_tag_order_list();
 
 		Track& get_track(uint16_t id);
@@ -51,19 +205,34 @@ class Song
 		bool set_platform(const std::string& key);
 		const Platform* get_platform() const;
 
+		Source_Map& get_source_map();
+		Arena* get_arena() const;
+
 	private:
+		Song(const Song& other) = default; // use clone()
+		Song& operator=(const Song& other) = delete;
+
+		void compile_platform_command(int16_t param);
+
+		std::shared_ptr<Arena> arena; // must be destroyed after track_map
 		Tag_Map tag_map;
 		Track_Map track_map;
 		uint16_t ppqn;
 		int16_t platform_command_index;
+		std::vector<Platform_Command> platform_commands; // indexed by param + 32768
 
-		Platform* platform;
+		std::shared_ptr<const Platform> platform;
+		std::string platform_key; // last key accepted by set_platform()
+		Source_Map source_map;
 };
 
 //! Platform base class
 /*!
  *  This contains platform-specific functions that can convert or create objects that work with
  *  Songs.
+ *
+ *  Platforms are immutable. One instance of each platform is created per process, and shared by all Songs that
+ *  use it. See get_platform().
  */
 class Platform
 {
@@ -74,9 +243,13 @@ class Platform
 		{
 		}
 
+		static std::shared_ptr<const Platform> get_platform(const std::string& key);
+
 		virtual std::shared_ptr<Driver> get_driver(unsigned int rate, VGM_Interface* vgm_interface) const;
 		virtual const Format_List& get_export_formats() const;
 		virtual std::vector<uint8_t> get_export_data(Song& song, int format) const;
+		virtual std::shared_ptr<Cost_Model> get_cost_model() const;
+		virtual Platform_Command compile_command(const Tag& tag) const;
 	protected:
 		virtual std::vector<uint8_t> vgm_export(Song& song, unsigned int max_seconds = 3600, unsigned int num_loops = 1) const;
 };
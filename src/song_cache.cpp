@@ -0,0 +1,352 @@
+#include <cstring>
+#include <climits>
+#include <fstream>
+#include <stdexcept>
+#include "song_cache.h"
+#include "song.h"
+#include "track.h"
+#include "stringf.h"
+
+//! Magic number, "CTRC" in native byte order.
+static const uint32_t CACHE_MAGIC = 0x43525443;
+//! Written in native byte order to detect files from other machines.
+static const uint32_t CACHE_BYTE_ORDER = 0x01020304;
+
+//! Append a value in native byte order.
+template<typename T>
+static void put(std::string& out, T value)
+{
+	out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+//! Append a string with its length.
+static void put_string(std::string& out, const std::string& str)
+{
+	put<uint32_t>(out, str.size());
+	out.append(str);
+}
+
+//! Reads the values written by put() and put_string().
+/*!
+ *  All functions throw std::out_of_range if the data is too short.
+ */
+class Cache_Reader
+{
+	public:
+		Cache_Reader(const char* start, const char* end)
+			: position(start)
+			, end(end)
+		{
+		}
+
+		const char* get_position() const
+		{
+			return position;
+		}
+
+		//! Get a pointer to an array, and skip past it.
+		const char* get_array(size_t count, size_t size)
+		{
+			if(size && count > (size_t)(end - position) / size)
+				throw std::out_of_range("Song_Cache::read");
+			const char* array = position;
+			position += count * size;
+			return array;
+		}
+
+		template<typename T>
+		T get()
+		{
+			T value;
+			std::memcpy(&value, get_array(1, sizeof(T)), sizeof(T));
+			return value;
+		}
+
+		std::string get_string()
+		{
+			uint32_t length = get<uint32_t>();
+			return std::string(get_array(length, 1), length);
+		}
+
+	private:
+		const char* position;
+		const char* end;
+};
+
+//! Constructs a Song_Cache.
+/*!
+ *  \param directory Directory to store the cache files in. It must
+ *                   already exist.
+ */
+Song_Cache::Song_Cache(const std::string& directory)
+	: directory(directory)
+	, file_provider(std::make_shared<Disk_File_Provider>())
+{
+}
+
+//! Set the File_Provider used to read cache files and dependencies.
+void Song_Cache::set_file_provider(std::shared_ptr<File_Provider> provider)
+{
+	file_provider = provider;
+}
+
+//! Get the name of the cache file of an input file.
+/*!
+ *  Each input file has one cache file, which is replaced when the
+ *  input file has been modified.
+ */
+std::string Song_Cache::get_cache_filename(const std::string& filename) const
+{
+	return directory + "/" + stringf("%016llx.cache", (unsigned long long)hash(filename));
+}
+
+//! Load a Song from the cache.
+/*!
+ *  \param song     Song to load to. Must be newly constructed.
+ *  \param filename Input file name.
+ *  \return false if the cache file does not exist or is out of date.
+ *          The Song is then not modified, and must be parsed instead.
+ */
+bool Song_Cache::load(Song& song, const std::string& filename)
+{
+	auto data = file_provider->read_file(get_cache_filename(filename));
+	return data && read(song, *data, filename, *file_provider);
+}
+
+//! Save a parsed Song to the cache.
+/*!
+ *  \param song         Song to save. This should be done before the Song
+ *                      is modified by a Player or the Optimizer.
+ *  \param dependencies Files read while parsing the Song. The first
+ *                      file is the input file.
+ *  \return false if the cache file could not be written.
+ */
+bool Song_Cache::save(Song& song, const std::vector<Dependency>& dependencies)
+{
+	if(dependencies.empty())
+		return false;
+	std::string data = write(song, dependencies);
+	std::ofstream out(get_cache_filename(dependencies.front().filename), std::ios::binary);
+	out.write(data.data(), data.size());
+	return out.good();
+}
+
+//! Convert a Song to a cache file.
+std::string Song_Cache::write(Song& song, const std::vector<Dependency>& dependencies)
+{
+	std::string payload;
+	put_string(payload, CTRMML_VERSION);
+	put<uint32_t>(payload, dependencies.size());
+	for(auto && dependency : dependencies)
+	{
+		put_string(payload, dependency.filename);
+		put<uint64_t>(payload, dependency.hash);
+	}
+
+	put<uint16_t>(payload, song.ppqn);
+	put<int16_t>(payload, song.platform_command_index);
+	put_string(payload, song.platform_key);
+	std::vector<int16_t> commands;
+	for(unsigned int index = 0; index < song.platform_commands.size(); index++)
+	{
+		if(song.platform_commands[index].defined)
+			commands.push_back(index - 32768);
+	}
+	put<uint32_t>(payload, commands.size());
+	for(auto && param : commands)
+		put<int16_t>(payload, param);
+
+	const Tag_Map& tag_map = song.tag_map;
+	put<uint32_t>(payload, tag_map.size());
+	for(auto && key : tag_map.get_order())
+	{
+		const Tag& tag = tag_map.at(key);
+		put_string(payload, tag_map.get_name(key));
+		put<uint32_t>(payload, tag.size());
+		for(auto && word : tag)
+			put_string(payload, word);
+	}
+
+	const Source_Map& source_map = song.source_map;
+	put<uint32_t>(payload, source_map.files.size());
+	for(auto && file : source_map.files)
+		put_string(payload, file);
+	put<uint32_t>(payload, source_map.texts.size());
+	for(auto && text : source_map.texts)
+		put_string(payload, *text);
+	put<uint16_t>(payload, source_map.scratch_text);
+	put<uint32_t>(payload, source_map.lines.size());
+	payload.append(reinterpret_cast<const char*>(source_map.lines.data()), source_map.lines.size() * sizeof(Source_Map::Line));
+
+	put<uint32_t>(payload, song.track_map.size());
+	for(auto && it : song.track_map)
+	{
+		const Track& track = it.second;
+		put<uint16_t>(payload, it.first);
+		put<uint32_t>(payload, track.events.size());
+		payload.append(reinterpret_cast<const char*>(track.events.data()), track.events.size() * sizeof(Event));
+		payload.append(reinterpret_cast<const char*>(track.references.data()), track.references.size() * sizeof(Source_Location));
+	}
+
+	std::string out;
+	put<uint32_t>(out, CACHE_MAGIC);
+	put<uint32_t>(out, VERSION);
+	put<uint32_t>(out, CACHE_BYTE_ORDER);
+	put<uint32_t>(out, sizeof(Event) | sizeof(Source_Location) << 8 | sizeof(Source_Map::Line) << 16);
+	put<uint64_t>(out, hash(payload));
+	out.append(payload);
+	return out;
+}
+
+//! Load a Song from a cache file.
+/*!
+ *  The file is only loaded if it was written by this version of ctrmml
+ *  for \p filename, and if all files that were read while parsing the
+ *  Song still have the same contents.
+ *
+ *  \param song     Song to load to. Must be newly constructed.
+ *  \param data     Contents of the cache file.
+ *  \param filename Input file name.
+ *  \param provider Used to read the dependencies.
+ *  \return false if the file could not be loaded. The Song is then not
+ *          modified.
+ *  \exception std::out_of_range if the file is inconsistent, even though
+ *             the checksum is correct.
+ */
+bool Song_Cache::read(Song& song, const std::string& data, const std::string& filename, File_Provider& provider)
+{
+	Cache_Reader header(data.data(), data.data() + data.size());
+	try
+	{
+		if(header.get<uint32_t>() != CACHE_MAGIC
+			|| header.get<uint32_t>() != VERSION
+			|| header.get<uint32_t>() != CACHE_BYTE_ORDER
+			|| header.get<uint32_t>() != (sizeof(Event) | sizeof(Source_Location) << 8 | sizeof(Source_Map::Line) << 16))
+			return false;
+		uint64_t checksum = header.get<uint64_t>();
+		if(hash(header.get_position(), data.data() + data.size() - header.get_position()) != checksum)
+			return false;
+	}
+	catch(std::out_of_range&)
+	{
+		return false;
+	}
+
+	Cache_Reader reader(header.get_position(), data.data() + data.size());
+	if(reader.get_string() != CTRMML_VERSION)
+		return false;
+	uint32_t dependency_count = reader.get<uint32_t>();
+	for(uint32_t i = 0; i < dependency_count; i++)
+	{
+		std::string dependency = reader.get_string();
+		uint64_t dependency_hash = reader.get<uint64_t>();
+		if(i == 0 && dependency != filename)
+			return false;
+		auto text = provider.read_file(dependency);
+		if(!text || hash(*text) != dependency_hash)
+			return false;
+	}
+	if(!dependency_count)
+		return false;
+
+	song.ppqn = reader.get<uint16_t>();
+	song.platform_command_index = reader.get<int16_t>();
+	song.set_platform(reader.get_string());
+	std::vector<int16_t> commands(reader.get<uint32_t>());
+	for(auto && param : commands)
+		param = reader.get<int16_t>();
+
+	uint32_t tag_count = reader.get<uint32_t>();
+	for(uint32_t i = 0; i < tag_count; i++)
+	{
+		Tag& tag = song.tag_map[reader.get_string()];
+		tag.resize(reader.get<uint32_t>());
+		for(auto && word : tag)
+			word = reader.get_string();
+	}
+	for(auto && param : commands)
+		song.compile_platform_command(param);
+
+	Source_Map& source_map = song.source_map;
+	source_map.files.resize(reader.get<uint32_t>());
+	source_map.file_index.clear();
+	for(unsigned int i = 0; i < source_map.files.size(); i++)
+	{
+		source_map.files[i] = reader.get_string();
+		if(i)
+			source_map.file_index[source_map.files[i]] = i;
+	}
+	source_map.texts.resize(reader.get<uint32_t>());
+	for(auto && text : source_map.texts)
+		text = std::make_shared<std::string>(reader.get_string());
+	source_map.scratch_text = reader.get<uint16_t>();
+	uint32_t line_count = reader.get<uint32_t>();
+	source_map.lines.resize(line_count);
+	std::memcpy(source_map.lines.data(), reader.get_array(line_count, sizeof(Source_Map::Line)), line_count * sizeof(Source_Map::Line));
+
+	uint32_t track_count = reader.get<uint32_t>();
+	for(uint32_t i = 0; i < track_count; i++)
+	{
+		Track& track = song.make_track(reader.get<uint16_t>());
+		uint32_t event_count = reader.get<uint32_t>();
+		const char* events = reader.get_array(event_count, sizeof(Event));
+		const char* references = reader.get_array(event_count, sizeof(Source_Location));
+		track.play_times.assign(event_count, UINT_MAX);
+		if(!event_count)
+			continue;
+		track.events.resize(event_count);
+		std::memcpy(track.events.data(), events, event_count * sizeof(Event));
+		track.references.resize(event_count);
+		std::memcpy(track.references.data(), references, event_count * sizeof(Source_Location));
+	}
+	return true;
+}
+
+//! Get the 64-bit FNV-1a hash of a buffer.
+uint64_t Song_Cache::hash(const char* data, size_t size)
+{
+	uint64_t value = 0xcbf29ce484222325;
+	for(size_t i = 0; i < size; i++)
+	{
+		value ^= (unsigned char)data[i];
+		value *= 0x100000001b3;
+	}
+	return value;
+}
+
+//=============================================================================
+
+//! Creates a Recording_File_Provider.
+/*!
+ *  \param provider File_Provider to read the files with.
+ */
+Recording_File_Provider::Recording_File_Provider(std::shared_ptr<File_Provider> provider)
+	: provider(provider)
+	, mutex()
+	, dependencies()
+{
+}
+
+//! Read a file, and record its name and hash if it was read.
+std::shared_ptr<std::string> Recording_File_Provider::read_file(const std::string& filename)
+{
+	auto text = provider->read_file(filename);
+	if(!text)
+		return text;
+	uint64_t text_hash = Song_Cache::hash(*text);
+	std::lock_guard<std::mutex> lock(mutex);
+	for(auto && dependency : dependencies)
+	{
+		if(dependency.filename == filename)
+			return text;
+	}
+	dependencies.push_back({filename, text_hash});
+	return text;
+}
+
+//! Get the files that have been read, in the order they were first read.
+std::vector<Song_Cache::Dependency> Recording_File_Provider::get_dependencies() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return dependencies;
+}
@@ -0,0 +1,90 @@
+/*! \file src/song_cache.h
+ *  \brief Precompiled Song cache
+ *
+ *  \see Song_Cache
+ */
+#ifndef SONG_CACHE_H
+#define SONG_CACHE_H
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include "core.h"
+#include "input.h"
+
+//! Cache of parsed Songs.
+/*!
+ *  A parsed Song (tracks, tags, platform commands and the Source_Map)
+ *  can be written to a binary cache file, so that the input file does
+ *  not need to be parsed again as long as it is unchanged.
+ *
+ *  The cache file lists every file that was read while parsing, with a
+ *  hash of its contents. An entry is only loaded if all of those files
+ *  still have the same contents. Record the files with a
+ *  Recording_File_Provider.
+ *
+ *  The event lists are stored in the native layout, so a cache file can
+ *  only be loaded by the same version of ctrmml on the same kind of
+ *  machine. Other cache files are ignored.
+ *
+ *  Parse warnings are not stored, so they are only shown when the
+ *  Song is actually parsed.
+ */
+class Song_Cache
+{
+	public:
+		//! Cache file format version. Must be increased when the format
+		//! or the stored structures change.
+		static const uint32_t VERSION = 1;
+
+		//! File that was read while parsing a Song.
+		struct Dependency
+		{
+			std::string filename;
+			uint64_t hash; //!< Song_Cache::hash() of the file contents.
+		};
+
+		Song_Cache(const std::string& directory);
+
+		void set_file_provider(std::shared_ptr<File_Provider> provider);
+		std::string get_cache_filename(const std::string& filename) const;
+
+		bool load(Song& song, const std::string& filename);
+		bool save(Song& song, const std::vector<Dependency>& dependencies);
+
+		static std::string write(Song& song, const std::vector<Dependency>& dependencies);
+		static bool read(Song& song, const std::string& data, const std::string& filename, File_Provider& provider);
+		static uint64_t hash(const char* data, size_t size);
+
+		//! Get the hash of a string.
+		static inline uint64_t hash(const std::string& data)
+		{
+			return hash(data.data(), data.size());
+		}
+
+	private:
+		std::string directory;
+		std::shared_ptr<File_Provider> file_provider;
+};
+
+//! File_Provider that records the files that have been read.
+/*!
+ *  Pass this to an Input to get the dependencies of a Song_Cache entry.
+ *  read_file() may be called from several threads.
+ */
+class Recording_File_Provider : public File_Provider
+{
+	public:
+		Recording_File_Provider(std::shared_ptr<File_Provider> provider);
+
+		std::shared_ptr<std::string> read_file(const std::string& filename) override;
+		std::vector<Song_Cache::Dependency> get_dependencies() const;
+
+	private:
+		std::shared_ptr<File_Provider> provider;
+		mutable std::mutex mutex;
+		std::vector<Song_Cache::Dependency> dependencies;
+};
+
+#endif
@@ -11,11 +11,17 @@
 /*!
  *  \param ppqn Pulses per quarter note, used to set the default duration
  *              and can also be used as a reference for input handlers.
+ *  \param arena Arena to allocate the event list from. If nullptr, the
+ *               heap is used. The Track must not outlive the Arena,
+ *               but copies of the Track use the heap.
  */
-Track::Track(uint16_t ppqn)
+Track::Track(uint16_t ppqn, Arena* arena)
 	: enabled(0)
 	, drum_mode(0)
 	, ch(0)
+	, events(Arena_Allocator<Event>(arena))
+	, play_times(Arena_Allocator<uint32_t>(arena))
+	, references(Arena_Allocator<Source_Location>(arena))
 	, last_note_pos(-1)
 	, octave(DEFAULT_OCTAVE)
 	, measure_len(ppqn * 4)
@@ -28,6 +34,8 @@ Track::Track(uint16_t ppqn)
 	, flat_mask(0)
 	, echo_delay(0)
 	, echo_volume(0)
+	, echo_buffer(Arena_Allocator<uint16_t>(arena))
+	, reference({0, 0})
 {
 }
 
@@ -38,6 +46,8 @@ Track::Track(uint16_t ppqn)
 void Track::add_event(Event& new_event)
 {
 	events.push_back(new_event);
+	play_times.push_back(UINT_MAX);
+	references.push_back(reference);
 }
 
 //! Appends a new Event to the event list.
@@ -49,8 +59,8 @@ void Track::add_event(Event& new_event)
  */
 void Track::add_event(Event::Type type, int16_t param, uint16_t on_time, uint16_t off_time)
 {
-	Event a = {type, param, on_time, off_time, UINT_MAX, reference};
-	events.push_back(a);
+	Event a = {type, param, on_time, off_time};
+	add_event(a);
 }
 
 //! Add an Event::NOTE Event with specified parameter and duration.
@@ -164,7 +174,7 @@ int Track::add_slur()
 	add_event(Event::SLUR);
 
 	// backtrack to disable the articulation of the previous note.
-	std::vector<Event>::reverse_iterator it;
+	Event_List::reverse_iterator it;
 	for(it=events.rbegin(); it != events.rend(); ++it)
 	{
 		switch(it->type)
@@ -242,7 +252,7 @@ void Track::reverse_rest(uint16_t duration)
 	shuffle = -shuffle;
 
 	// backtrack to disable the articulation of the previous note.
-	std::vector<Event>::reverse_iterator it;
+	Event_List::reverse_iterator it;
 	for(it=events.rbegin(); it != events.rend(); ++it)
 	{
 		switch(it->type)
@@ -286,7 +296,7 @@ void Track::reverse_rest(uint16_t duration)
  *  This is used to associate source files with events so that
  *  sensible error messages can be generated outside the parser.
  */
-void Track::set_reference(const std::shared_ptr<InputRef>& ref)
+void Track::set_reference(const Source_Location& ref)
 {
 	reference = ref;
 }
@@ -383,7 +393,11 @@ void Track::clear_echo_buffer()
 }
 
 //! Get the events list.
-std::vector<Event>& Track::get_events()
+/*!
+ *  Use insert_event(), insert_events() and erase_events() to modify
+ *  the list, so that the play times and references are kept in sync.
+ */
+const Track::Event_List& Track::get_events() const
 {
 	return events;
 }
@@ -404,6 +418,75 @@ unsigned long Track::get_event_count() const
 	return events.size();
 }
 
+//! Get the play time of the Event at the specified position.
+/*!
+ *  This is the earliest time a Player reached the event, or UINT_MAX
+ *  if the event has not been played.
+ *
+ *  \exception std::out_of_range if position exceeds event count.
+ */
+uint32_t Track::get_play_time(unsigned long position) const
+{
+	return play_times.at(position);
+}
+
+//! Set the play time of the Event at the specified position.
+/*!
+ *  \exception std::out_of_range if position exceeds event count.
+ */
+void Track::set_play_time(unsigned long position, uint32_t time)
+{
+	play_times.at(position) = time;
+}
+
+//! Get the input file reference of the Event at the specified position.
+/*!
+ *  Look up with Source_Map::get_reference().
+ *
+ *  \exception std::out_of_range if position exceeds event count.
+ */
+const Source_Location& Track::get_reference(unsigned long position) const
+{
+	return references.at(position);
+}
+
+//! Insert an Event at the specified position.
+/*!
+ *  \param time Play time of the event.
+ *  \param ref  Input file reference of the event.
+ */
+void Track::insert_event(unsigned long position, const Event& event, uint32_t time, const Source_Location& ref)
+{
+	events.insert(events.begin() + position, event);
+	play_times.insert(play_times.begin() + position, time);
+	references.insert(references.begin() + position, ref);
+}
+
+//! Insert a copy of Events from another track.
+/*!
+ *  \param position Position to insert the events at.
+ *  \param source   Track to copy events from. May not be the same track.
+ *  \param start    Position of the first event to copy.
+ *  \param count    Number of events to copy.
+ */
+void Track::insert_events(unsigned long position, const Track& source, unsigned long start, unsigned long count)
+{
+	events.insert(events.begin() + position,
+		source.events.begin() + start, source.events.begin() + start + count);
+	play_times.insert(play_times.begin() + position,
+		source.play_times.begin() + start, source.play_times.begin() + start + count);
+	references.insert(references.begin() + position,
+		source.references.begin() + start, source.references.begin() + start + count);
+}
+
+//! Remove Events from the track.
+void Track::erase_events(unsigned long position, unsigned long count)
+{
+	events.erase(events.begin() + position, events.begin() + position + count);
+	play_times.erase(play_times.begin() + position, play_times.begin() + position + count);
+	references.erase(references.begin() + position, references.begin() + position + count);
+}
+
 //! Return true if track is enabled.
 /*!
  *  This returns bit 7 of the track flag. It is to be used as a
@@ -632,3 +715,156 @@ void Track::push_echo_note(uint16_t note)
 	if(echo_buffer.size() > ECHO_BUFFER_SIZE)
 		echo_buffer.pop_back();
 }
+
+//=============================================================================
+
+//! Constructs an empty Track_Map.
+Track_Map::Track_Map()
+	: slots()
+	, ids()
+{
+}
+
+//! Copies a Track_Map, including all tracks.
+Track_Map::Track_Map(const Track_Map& other)
+	: slots()
+	, ids()
+{
+	*this = other;
+}
+
+//! Replaces the tracks with copies of the tracks from another Track_Map.
+Track_Map& Track_Map::operator=(const Track_Map& other)
+{
+	if(this == &other)
+		return *this;
+	slots.clear();
+	slots.resize(other.slots.size());
+	for(auto id : other.ids)
+		slots[id].reset(new value_type(*other.slots[id]));
+	ids = other.ids;
+	return *this;
+}
+
+//! Get an iterator to the track with the lowest ID.
+Track_Map::iterator Track_Map::begin()
+{
+	return iterator(this, ids.size() ? ids.front() : END, 0);
+}
+
+//! Get an iterator past the track with the highest ID.
+Track_Map::iterator Track_Map::end()
+{
+	return iterator(this, END, ids.size());
+}
+
+//! Get an iterator to the track with the lowest ID.
+Track_Map::const_iterator Track_Map::begin() const
+{
+	return const_iterator(this, ids.size() ? ids.front() : END, 0);
+}
+
+//! Get an iterator past the track with the highest ID.
+Track_Map::const_iterator Track_Map::end() const
+{
+	return const_iterator(this, END, ids.size());
+}
+
+//! Get the number of tracks.
+Track_Map::size_type Track_Map::size() const
+{
+	return ids.size();
+}
+
+//! Return true if there are no tracks.
+bool Track_Map::empty() const
+{
+	return ids.empty();
+}
+
+//! Remove all tracks.
+void Track_Map::clear()
+{
+	slots.clear();
+	ids.clear();
+}
+
+//! Get an iterator to a track.
+/*!
+ *  \return end() if the track does not exist.
+ */
+Track_Map::iterator Track_Map::find(uint16_t id)
+{
+	return iterator(this, count(id) ? id : END);
+}
+
+//! Get an iterator to a track.
+/*!
+ *  \return end() if the track does not exist.
+ */
+Track_Map::const_iterator Track_Map::find(uint16_t id) const
+{
+	return const_iterator(this, count(id) ? id : END);
+}
+
+//! Get a track, creating it with the default settings if needed.
+Track& Track_Map::operator[](uint16_t id)
+{
+	if(count(id))
+		return slots[id]->second;
+	return emplace(id, Track()).first->second;
+}
+
+//! Add a track, unless it already exists.
+/*!
+ *  \return An iterator to the track, and true if the track was added.
+ */
+std::pair<Track_Map::iterator,bool> Track_Map::emplace(uint16_t id, Track&& track)
+{
+	if(count(id))
+		return {iterator(this, id), false};
+	if(id >= slots.size())
+		slots.resize(id + 1);
+	slots[id].reset(new value_type(id, std::move(track)));
+	// Tracks are usually added in ascending order
+	if(ids.empty() || ids.back() < id)
+		ids.push_back(id);
+	else
+		ids.insert(std::lower_bound(ids.begin(), ids.end(), id), id);
+	return {iterator(this, id), true};
+}
+
+//! Remove a track.
+/*!
+ *  \return 1 if the track was removed, otherwise 0.
+ */
+Track_Map::size_type Track_Map::erase(uint16_t id)
+{
+	if(!count(id))
+		return 0;
+	slots[id].reset();
+	ids.erase(std::lower_bound(ids.begin(), ids.end(), id));
+	return 1;
+}
+
+//! Step an iterator to the next track, or END.
+/*!
+ *  \p index is a hint for the position of \p id in the ID list. If a
+ *  track was added or removed since, the position is searched for.
+ */
+void Track_Map::next_id(uint32_t& id, uint32_t& index) const
+{
+	if(index < ids.size() && ids[index] == id)
+		index++;
+	else
+		index = std::upper_bound(ids.begin(), ids.end(), id) - ids.begin();
+	id = (index < ids.size()) ? ids[index] : END;
+}
+
+//! Step an iterator to the previous track.
+void Track_Map::previous_id(uint32_t& id, uint32_t& index) const
+{
+	if(index >= ids.size() || ids[index] != id)
+		index = std::lower_bound(ids.begin(), ids.end(), id) - ids.begin();
+	id = ids[--index];
+}
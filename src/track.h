@@ -10,7 +10,11 @@
 #include <vector>
 #include <deque>
 #include <memory>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
 #include "core.h"
+#include "arena.h"
 
 //! Track event.
 /*!
@@ -25,6 +29,11 @@
  *
  *  All other kinds of events are immediate and both the `on_time` and
  *  `off_time` must be 0.
+ *
+ *  Events are packed into 8 bytes, as they are scanned constantly by
+ *  the players and the optimizer. The play time and input file reference
+ *  of an event are stored separately in the Track, see
+ *  Track::get_play_time() and Track::get_reference().
  */
 struct Event
 {
@@ -34,7 +43,7 @@ struct Event
 	 *  but does not show in Doxygen documentation right now. Just
 	 *  view the source code for more clear documentation.
 	 */
-	enum Type {
+	enum Type : int8_t {
 		// Basic events
 		NOP = 0,		//!< Does nothing and ignores all parameters.
 		REST,			//!< Key off. Reads \ref off_time.
@@ -89,10 +98,6 @@ struct Event
 	uint16_t on_time;
 	//! Key-off time (for \ref NOTE, \ref REST and \ref TIE types only)
 	uint16_t off_time;
-	//! Set by a Player to help look up the play time of an event.
-	uint32_t play_time;
-	//! Pointer to an input file reference.
-	std::shared_ptr<InputRef> reference;
 };
 
 //! Track structure.
@@ -105,6 +110,7 @@ struct Event
  */
 class Track
 {
+	friend class Song_Cache;
 	public:
 		//! Default octave setting.
 		static const int DEFAULT_OCTAVE = 5;
@@ -117,7 +123,10 @@ class Track
 		//! Maximum size of the echo buffer
 		static const uint16_t ECHO_BUFFER_SIZE = 10;
 
-		Track(uint16_t ppqn = DEFAULT_MEASURE_LEN/4);
+		//! Event list type.
+		typedef std::vector<Event, Arena_Allocator<Event>> Event_List;
+
+		Track(uint16_t ppqn = DEFAULT_MEASURE_LEN/4, Arena* arena = nullptr);
 
 		// Methods that add Events
 		void add_event(Event& new_event);
@@ -132,7 +141,7 @@ class Track
 		void reverse_rest(uint16_t duration = 0);
 
 		// Methods that modify following Events
-		void set_reference(const std::shared_ptr<InputRef>& ref);
+		void set_reference(const Source_Location& ref);
 		void set_octave(int param);
 		void change_octave(int param);
 		void set_duration(uint16_t duration);
@@ -143,9 +152,17 @@ class Track
 		void clear_echo_buffer();
 
 		// Methods to retrieve Events
-		std::vector<Event>& get_events();
+		const Event_List& get_events() const;
 		Event& get_event(unsigned long position);
 		unsigned long get_event_count() const;
+		uint32_t get_play_time(unsigned long position) const;
+		void set_play_time(unsigned long position, uint32_t time);
+		const Source_Location& get_reference(unsigned long position) const;
+
+		// Methods that insert or remove Events at any position
+		void insert_event(unsigned long position, const Event& event, uint32_t time, const Source_Location& ref);
+		void insert_events(unsigned long position, const Track& source, unsigned long start, unsigned long count);
+		void erase_events(unsigned long position, unsigned long count);
 
 		// Methods that set Track state
 		void set_measure_len(uint16_t param);
@@ -173,7 +190,9 @@ class Track
 		bool enabled;
 		uint16_t drum_mode;
 		uint8_t ch;
-		std::vector<Event> events;
+		Event_List events;
+		std::vector<uint32_t, Arena_Allocator<uint32_t>> play_times; // set by a Player to help look up the play time of an event
+		std::vector<Source_Location, Arena_Allocator<Source_Location>> references;
 		int last_note_pos; // last event id that was a note
 		int octave;
 		uint16_t measure_len;
@@ -186,8 +205,121 @@ class Track
 		uint8_t flat_mask;
 		uint16_t echo_delay;
 		int16_t echo_volume;
-		std::deque<uint16_t> echo_buffer;
-		std::shared_ptr<InputRef> reference;
+		std::deque<uint16_t, Arena_Allocator<uint16_t>> echo_buffer;
+		Source_Location reference;
+};
+
+//! Track table.
+/*!
+ *  Tracks are stored in a dense table indexed by the track ID, so a
+ *  lookup is an array access. Each track is allocated separately, so
+ *  references to tracks stay valid when other tracks are added.
+ *
+ *  The interface is a subset of `std::map<uint16_t,Track>`. Iteration is
+ *  in ascending ID order, using a sorted list of the IDs in use, and
+ *  iterators stay valid when tracks are added.
+ */
+class Track_Map
+{
+	public:
+		typedef uint16_t key_type;
+		typedef Track mapped_type;
+		typedef std::pair<const uint16_t, Track> value_type;
+		typedef std::size_t size_type;
+
+		//! Bidirectional iterator over the tracks in ID order.
+		template<class Value, class Map>
+		class Iterator
+		{
+			friend class Track_Map;
+			public:
+				typedef std::bidirectional_iterator_tag iterator_category;
+				typedef Value value_type;
+				typedef std::ptrdiff_t difference_type;
+				typedef Value* pointer;
+				typedef Value& reference;
+
+				Iterator() : map(nullptr), id(END), index(0) {}
+				operator Iterator<const Value, const Map>() const { return {map, id, index}; }
+
+				Value& operator*() const { return *map->slots[id]; }
+				Value* operator->() const { return map->slots[id].get(); }
+				Iterator& operator++() { map->next_id(id, index); return *this; }
+				Iterator& operator--() { map->previous_id(id, index); return *this; }
+				Iterator operator++(int) { Iterator it = *this; ++*this; return it; }
+				Iterator operator--(int) { Iterator it = *this; --*this; return it; }
+				bool operator==(const Iterator& other) const { return id == other.id; }
+				bool operator!=(const Iterator& other) const { return id != other.id; }
+
+			private:
+				Iterator(Map* map, uint32_t id, uint32_t index = 0) : map(map), id(id), index(index) {}
+				Map* map;
+				uint32_t id; // END for the end iterator
+				uint32_t index; // position in the ID list, only a hint
+		};
+		typedef Iterator<value_type, Track_Map> iterator;
+		typedef Iterator<const value_type, const Track_Map> const_iterator;
+		typedef std::reverse_iterator<iterator> reverse_iterator;
+		typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+		Track_Map();
+		Track_Map(const Track_Map& other);
+		Track_Map(Track_Map&& other) = default;
+		Track_Map& operator=(const Track_Map& other);
+		Track_Map& operator=(Track_Map&& other) = default;
+
+		iterator begin();
+		iterator end();
+		const_iterator begin() const;
+		const_iterator end() const;
+		reverse_iterator rbegin() { return reverse_iterator(end()); }
+		reverse_iterator rend() { return reverse_iterator(begin()); }
+		const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+		const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+		size_type size() const;
+		bool empty() const;
+		void clear();
+
+		//! Get a track.
+		/*!
+		 *  \exception std::out_of_range if the track does not exist.
+		 */
+		Track& at(uint16_t id)
+		{
+			if(id >= slots.size() || !slots[id])
+				throw std::out_of_range("Track_Map::at");
+			return slots[id]->second;
+		}
+		//! Get a track.
+		/*!
+		 *  \exception std::out_of_range if the track does not exist.
+		 */
+		const Track& at(uint16_t id) const
+		{
+			if(id >= slots.size() || !slots[id])
+				throw std::out_of_range("Track_Map::at");
+			return slots[id]->second;
+		}
+		//! Return 1 if the track exists, otherwise 0.
+		size_type count(uint16_t id) const
+		{
+			return id < slots.size() && slots[id];
+		}
+		iterator find(uint16_t id);
+		const_iterator find(uint16_t id) const;
+
+		Track& operator[](uint16_t id);
+		std::pair<iterator,bool> emplace(uint16_t id, Track&& track);
+		size_type erase(uint16_t id);
+
+	private:
+		static const uint32_t END = 0x10000;
+		void next_id(uint32_t& id, uint32_t& index) const;
+		void previous_id(uint32_t& id, uint32_t& index) const;
+
+		std::vector<std::unique_ptr<value_type>> slots; // indexed by track ID
+		std::vector<uint16_t> ids; // sorted IDs of the existing tracks
 };
 #endif
 
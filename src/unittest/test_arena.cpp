@@ -0,0 +1,90 @@
+#include <stdexcept>
+#include <memory>
+#include <cppunit/extensions/HelperMacros.h>
+#include "../arena.h"
+#include "../track.h"
+#include "../song.h"
+
+class Arena_Test : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(Arena_Test);
+	CPPUNIT_TEST(test_allocate);
+	CPPUNIT_TEST(test_large_allocation);
+	CPPUNIT_TEST(test_deallocate_last);
+	CPPUNIT_TEST(test_track_events);
+	CPPUNIT_TEST(test_track_copy_uses_heap);
+	CPPUNIT_TEST(test_song_arena);
+	CPPUNIT_TEST_SUITE_END();
+private:
+	Arena *arena;
+public:
+	void setUp()
+	{
+		arena = new Arena(1024);
+	}
+	void tearDown()
+	{
+		delete arena;
+	}
+	void test_allocate()
+	{
+		char* a = static_cast<char*>(arena->allocate(3, 1));
+		uint32_t* b = static_cast<uint32_t*>(arena->allocate(4, 4));
+		CPPUNIT_ASSERT_EQUAL((uintptr_t)0, (uintptr_t)b & 3);
+		CPPUNIT_ASSERT((char*)b >= a + 3);
+		CPPUNIT_ASSERT_EQUAL(2ul, arena->get_allocation_count());
+		CPPUNIT_ASSERT_EQUAL(1ul, arena->get_chunk_count());
+		CPPUNIT_ASSERT_EQUAL((size_t)7, arena->get_bytes_allocated());
+		CPPUNIT_ASSERT_EQUAL((size_t)1024, arena->get_bytes_reserved());
+	}
+	void test_large_allocation()
+	{
+		arena->allocate(16, 8);
+		arena->allocate(2000, 8);
+		arena->allocate(16, 8);
+		// The large allocation gets its own chunk
+		CPPUNIT_ASSERT_EQUAL(2ul, arena->get_chunk_count());
+		CPPUNIT_ASSERT_EQUAL((size_t)1024 + 2000, arena->get_bytes_reserved());
+	}
+	void test_deallocate_last()
+	{
+		void* a = arena->allocate(16, 8);
+		arena->deallocate(a, 16);
+		void* b = arena->allocate(16, 8);
+		CPPUNIT_ASSERT_EQUAL(a, b);
+	}
+	void test_track_events()
+	{
+		Track track(24, arena), heap_track(24);
+		for(int i = 0; i < 100; i++)
+		{
+			track.add_note(i % 12, 24);
+			heap_track.add_note(i % 12, 24);
+		}
+		CPPUNIT_ASSERT_EQUAL((unsigned long)100, track.get_event_count());
+		for(int i = 0; i < 100; i++)
+			CPPUNIT_ASSERT_EQUAL(heap_track.get_event(i).param, track.get_event(i).param);
+		CPPUNIT_ASSERT_EQUAL(arena, track.get_events().get_allocator().get_arena());
+		CPPUNIT_ASSERT(arena->get_allocation_count() > 0);
+	}
+	void test_track_copy_uses_heap()
+	{
+		Track track(24, arena);
+		track.add_note(1, 24);
+		Track copy = track;
+		CPPUNIT_ASSERT_EQUAL((Arena*)nullptr, copy.get_events().get_allocator().get_arena());
+		CPPUNIT_ASSERT_EQUAL(track.get_event(0).param, copy.get_event(0).param);
+		Track moved = std::move(track);
+		CPPUNIT_ASSERT_EQUAL(arena, moved.get_events().get_allocator().get_arena());
+	}
+	void test_song_arena()
+	{
+		Song song(std::make_shared<Arena>());
+		song.make_track(0).add_note(0, 24);
+		CPPUNIT_ASSERT(song.get_arena() != nullptr);
+		CPPUNIT_ASSERT_EQUAL(song.get_arena(), song.get_track(0).get_events().get_allocator().get_arena());
+		CPPUNIT_ASSERT_EQUAL((Arena*)nullptr, Song().get_arena());
+	}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(Arena_Test);
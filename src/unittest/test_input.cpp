@@ -1,4 +1,8 @@
 #include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <vector>
 #include <cppunit/extensions/HelperMacros.h>
 #include "../input.h"
 
@@ -20,12 +24,22 @@ class Line_Input_Test : public CppUnit::TestFixture, private Line_Input
 	CPPUNIT_TEST_EXCEPTION(test_get_num_eol, std::invalid_argument);
 	CPPUNIT_TEST_EXCEPTION(test_get_num_nan, std::invalid_argument);
 	CPPUNIT_TEST(test_get_num_nan_increment);
+	CPPUNIT_TEST(test_read_num);
 	CPPUNIT_TEST(test_inputref);
+	CPPUNIT_TEST(test_line_view);
+	CPPUNIT_TEST(test_parse_file);
+	CPPUNIT_TEST(test_parse_buffer);
+	CPPUNIT_TEST(test_file_provider);
+	CPPUNIT_TEST(test_source_map);
 	CPPUNIT_TEST_SUITE_END();
+	std::vector<std::string> lines;
+	std::vector<const std::string*> line_buffers;
 public:
 	Line_Input_Test() : Line_Input(0) {}
 	void setUp()
 	{
+		lines.clear();
+		line_buffers.clear();
 		set_buffer("");
 		line = 0;
 		column = 0;
@@ -139,6 +153,28 @@ public:
 		}
 		CPPUNIT_ASSERT_EQUAL((unsigned int)0, column);
 	}
+	// same syntax as strtol(), but a number can't cross the end of the line
+	void test_read_num()
+	{
+		int value = 0;
+		set_buffer("$0x1f x-a 99999999999 -99999999999 12");
+		CPPUNIT_ASSERT(read_num(value));
+		CPPUNIT_ASSERT_EQUAL((int)0x1f, value);
+		CPPUNIT_ASSERT(read_num(value));
+		CPPUNIT_ASSERT_EQUAL((int)-10, value);
+		CPPUNIT_ASSERT(read_num(value));
+		CPPUNIT_ASSERT_EQUAL((int)strtol("99999999999", NULL, 10), value);
+		CPPUNIT_ASSERT(read_num(value));
+		CPPUNIT_ASSERT_EQUAL((int)strtol("-99999999999", NULL, 10), value);
+		line_length -= 1;
+		CPPUNIT_ASSERT(read_num(value));
+		CPPUNIT_ASSERT_EQUAL((int)1, value);
+		CPPUNIT_ASSERT(!read_num(value));
+		set_buffer("c-");
+		get();
+		CPPUNIT_ASSERT(!read_num(value));
+		CPPUNIT_ASSERT_EQUAL((unsigned int)1, column);
+	}
 	void test_get_line()
 	{
 		set_buffer("0123456789");
@@ -148,7 +184,8 @@ public:
 	}
 	void parse_line()
 	{
-		// Dummy function
+		lines.push_back(get_line());
+		line_buffers.push_back(buffer.get());
 	}
 	void test_inputref()
 	{
@@ -160,6 +197,81 @@ public:
 		ptr = get_reference();
 		CPPUNIT_ASSERT_EQUAL((unsigned int)2,ptr->get_column());
 	}
+	// the line ends at the view boundary, not at the end of the buffer
+	void test_line_view()
+	{
+		auto text = std::make_shared<std::string>("12 hi\n34");
+		set_buffer(text, 3, 2);
+		CPPUNIT_ASSERT_EQUAL(std::string("hi"), get_line());
+		CPPUNIT_ASSERT_EQUAL((int)'h', get());
+		CPPUNIT_ASSERT_EQUAL((int)'i', get());
+		CPPUNIT_ASSERT_EQUAL((int)0, get());
+		CPPUNIT_ASSERT_EQUAL(std::string("hi"), get_reference()->get_line_contents());
+		set_buffer(text, 0, 2);
+		CPPUNIT_ASSERT_EQUAL((int)12, get_num());
+		CPPUNIT_ASSERT_THROW(get_num(), std::invalid_argument);
+	}
+	// all lines are read from the same buffer
+	void test_parse_file()
+	{
+		const char* filename = "test_input.tmp";
+		std::ofstream(filename, std::ios::binary) << "first\r\n\nthird line\nlast";
+		open_file(filename);
+		std::remove(filename);
+		CPPUNIT_ASSERT_EQUAL((size_t)4, lines.size());
+		CPPUNIT_ASSERT_EQUAL(std::string("first"), lines[0]);
+		CPPUNIT_ASSERT_EQUAL(std::string(""), lines[1]);
+		CPPUNIT_ASSERT_EQUAL(std::string("third line"), lines[2]);
+		CPPUNIT_ASSERT_EQUAL(std::string("last"), lines[3]);
+		CPPUNIT_ASSERT(line_buffers[0] == line_buffers[3]);
+		CPPUNIT_ASSERT_EQUAL((unsigned int)4, line);
+	}
+	void test_parse_buffer()
+	{
+		open_buffer("buffer.mml", "first\nsecond");
+		CPPUNIT_ASSERT_EQUAL((size_t)2, lines.size());
+		CPPUNIT_ASSERT_EQUAL(std::string("second"), lines[1]);
+		CPPUNIT_ASSERT_EQUAL(std::string("buffer.mml"), get_filename());
+	}
+	// files are shared with the provider, not copied
+	void test_file_provider()
+	{
+		auto provider = std::make_shared<Memory_File_Provider>();
+		provider->add_file("dir/a.mml", "first\nsecond");
+		set_file_provider(provider);
+		open_file("dir/a.mml");
+		CPPUNIT_ASSERT_EQUAL((size_t)2, lines.size());
+		CPPUNIT_ASSERT_EQUAL(std::string("first"), lines[0]);
+		CPPUNIT_ASSERT(line_buffers[0] == provider->read_file("dir/a.mml").get());
+		try
+		{
+			open_file("dir/b.mml");
+			CPPUNIT_FAIL("no error thrown");
+		}
+		catch(InputError& error)
+		{
+			CPPUNIT_ASSERT_EQUAL(std::string("dir/b.mml"), error.get_reference()->get_filename());
+		}
+	}
+	void test_source_map()
+	{
+		Source_Map map;
+		CPPUNIT_ASSERT(map.get_reference({0, 0}) == nullptr);
+		uint16_t file = map.add_file("a.mml");
+		CPPUNIT_ASSERT_EQUAL(file, map.add_file("a.mml"));
+		CPPUNIT_ASSERT(file != map.add_file("b.mml"));
+		uint16_t text = map.add_text(std::make_shared<std::string>("first\nsecond"));
+		uint32_t first = map.add_line(file, text, 0, 0, 5);
+		uint32_t second = map.add_line(file, 7, "copied");
+		auto ref = map.get_reference({first, 2});
+		CPPUNIT_ASSERT_EQUAL(std::string("a.mml"), ref->get_filename());
+		CPPUNIT_ASSERT_EQUAL(std::string("first"), ref->get_line_contents());
+		CPPUNIT_ASSERT_EQUAL((unsigned int)0, ref->get_line());
+		CPPUNIT_ASSERT_EQUAL((unsigned int)2, ref->get_column());
+		ref = map.get_reference({second, 1});
+		CPPUNIT_ASSERT_EQUAL(std::string("copied"), ref->get_line_contents());
+		CPPUNIT_ASSERT_EQUAL((unsigned int)7, ref->get_line());
+	}
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(Line_Input_Test);
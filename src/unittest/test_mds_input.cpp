@@ -0,0 +1,170 @@
+#include <string>
+#include <memory>
+#include <cppunit/extensions/HelperMacros.h>
+#include "../platform/mds_input.h"
+#include "../mml_input.h"
+#include "../song.h"
+#include "../track.h"
+#include "../riff.h"
+
+class MDS_Input_Test : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(MDS_Input_Test);
+	CPPUNIT_TEST(test_sequence_round_trip);
+	CPPUNIT_TEST(test_data_round_trip);
+	CPPUNIT_TEST(test_pcm_round_trip);
+	CPPUNIT_TEST(test_instrument_strings);
+	CPPUNIT_TEST(test_invalid_data);
+	CPPUNIT_TEST(test_get_input);
+	CPPUNIT_TEST_SUITE_END();
+private:
+	Song *song;
+	MML_Input *mml_input;
+	std::shared_ptr<Memory_File_Provider> provider;
+
+	// Convert the MML song to .mds, and read it back to imported
+	std::vector<uint8_t> import(Song& imported)
+	{
+		auto bytes = MDSDRV_Converter(*song).get_mds().to_bytes();
+		provider->add_file("test.mds", std::string(bytes.begin(), bytes.end()));
+		MDS_Input input(&imported);
+		input.set_file_provider(provider);
+		input.open_file("test.mds");
+		return bytes;
+	}
+
+	// Get the contents of a chunk (or of all chunks in a list) in an .mds file
+	static std::vector<uint8_t> get_chunk(const std::vector<uint8_t>& bytes, uint32_t type)
+	{
+		RIFF mds(bytes);
+		std::vector<uint8_t> out;
+		while(!mds.at_end())
+		{
+			RIFF chunk(mds.get_chunk());
+			if(chunk.get_type() == type)
+				return chunk.get_data();
+			if(chunk.get_type() == RIFF::TYPE_LIST && chunk.get_id() == type)
+			{
+				while(!chunk.at_end())
+				{
+					auto data = RIFF(chunk.get_chunk()).get_data();
+					out.insert(out.end(), data.begin(), data.end());
+				}
+			}
+		}
+		return out;
+	}
+public:
+	void setUp()
+	{
+		song = new Song();
+		mml_input = new MML_Input(song);
+		provider = std::make_shared<Memory_File_Provider>();
+	}
+	void tearDown()
+	{
+		delete mml_input;
+		delete song;
+	}
+	// Converting the imported song should give the same sequence
+	void test_sequence_round_trip()
+	{
+		mml_input->read_line("A t140 l8 o4 v12 [c d / e r]3 L *20 c1^1^2 r1^1 g:300 >c4&d4");
+		mml_input->read_line("A k3 K-2 G4 p1 'lfo 2 3' 'tl1 +3' 'write 0xb4 0xc0' V+4 V-4 P30 d4 P0 c");
+		mml_input->read_line("B o3 l16 [[c]4 / r]2 'mode 1' 'lforate 3' 'fm3 1010' 'pcmmode 2' 'pcmrate 3'");
+		mml_input->read_line("C D40 l4 a c a r D0 o5 e");
+		mml_input->read_line("G o4 v10 l4 c d e 'mode 2' f _2 g __-1 a");
+		mml_input->read_line("*20 o5 l16 ef ga");
+		mml_input->read_line("*30 'carry' p3 r:2 p1 r:2 p2");
+		mml_input->read_line("*40 'cmd 0xf6 0x1234' c");
+		mml_input->read_line("*42 'lfo 1 1' d");
+
+		Song imported;
+		auto bytes = import(imported);
+		CPPUNIT_ASSERT(imported.get_track_map().count(0));
+		CPPUNIT_ASSERT(imported.get_track_map().count(6));
+		auto result = MDSDRV_Converter(imported).get_mds().to_bytes();
+		CPPUNIT_ASSERT(get_chunk(bytes, FOURCC("seq ")) == get_chunk(result, FOURCC("seq ")));
+	}
+	// Instruments and envelopes should be identical after importing
+	void test_data_round_trip()
+	{
+		mml_input->read_line("@1 fm 4 7");
+		mml_input->read_line("  31 0 19 5 0 23 0 0 0 0");
+		mml_input->read_line("  31 6 0 4 3 19 0 0 0 100");
+		mml_input->read_line("  31 15 0 5 4 38 0 4 0 8");
+		mml_input->read_line("  31 27 0 11 1 0 1 1 3 0 -12");
+		mml_input->read_line("@2 psg 15>12:4 / 11>7:6 6>0:36");
+		mml_input->read_line("@3 psg 15 14 | 13 12 11");
+		mml_input->read_line("@M1 0 1>-1:4 | -2>2:8 0");
+		mml_input->read_line("@M2 12 0:5 -0.5");
+		mml_input->read_line("A @1 o4 l4 M1 c d M2 e M0 f");
+		mml_input->read_line("G @2 o4 l4 c @3 d");
+
+		Song imported;
+		auto bytes = import(imported);
+		auto result = MDSDRV_Converter(imported).get_mds().to_bytes();
+		CPPUNIT_ASSERT(get_chunk(bytes, FOURCC("seq ")) == get_chunk(result, FOURCC("seq ")));
+		CPPUNIT_ASSERT(get_chunk(bytes, FOURCC("dblk")) == get_chunk(result, FOURCC("dblk")));
+	}
+	// PCM samples are imported with the data: form
+	void test_pcm_round_trip()
+	{
+		mml_input->read_line("@30 pcm data:80ff00017f rate=8000");
+		mml_input->read_line("F @30 l4 c c");
+
+		Song imported;
+		auto bytes = import(imported);
+		auto result = MDSDRV_Converter(imported).get_mds().to_bytes();
+		CPPUNIT_ASSERT(get_chunk(bytes, FOURCC("seq ")) == get_chunk(result, FOURCC("seq ")));
+		CPPUNIT_ASSERT(get_chunk(bytes, FOURCC("dblk")) == get_chunk(result, FOURCC("dblk")));
+		CPPUNIT_ASSERT(get_chunk(bytes, FOURCC("pcmd")) == get_chunk(result, FOURCC("pcmd")));
+	}
+	void test_instrument_strings()
+	{
+		CPPUNIT_ASSERT_EQUAL(std::string("psg 15 14:2 13 / 12"),
+			MDS_Input::psg_instrument({0x10, 0x21, 0x12, 0x01, 0x13, 0x00}));
+		CPPUNIT_ASSERT_EQUAL(std::string("psg 15 | 14 13"),
+			MDS_Input::psg_instrument({0x10, 0x11, 0x12, 0x02, 0x01}));
+		CPPUNIT_ASSERT_THROW(MDS_Input::psg_instrument({0x10, 0x11}), std::invalid_argument);
+		CPPUNIT_ASSERT_THROW(MDS_Input::fm_instrument({0x00}), std::invalid_argument);
+		CPPUNIT_ASSERT_THROW(MDS_Input::pitch_envelope({0x00, 0x00}, false), std::invalid_argument);
+	}
+	void test_invalid_data()
+	{
+		Song imported;
+		MDS_Input input(&imported);
+		input.set_file_provider(provider);
+		provider->add_file("test.mds", "not an mds file");
+		CPPUNIT_ASSERT_THROW(input.open_file("test.mds"), InputError);
+
+		mml_input->read_line("A l4 o4 cdef");
+		auto bytes = MDSDRV_Converter(*song).get_mds().to_bytes();
+		RIFF truncated(RIFF::TYPE_RIFF, FOURCC("MDS0"));
+		RIFF mds(bytes);
+		while(!mds.at_end())
+		{
+			RIFF chunk(mds.get_chunk());
+			if(chunk.get_type() == FOURCC("seq "))
+			{
+				auto data = chunk.get_data();
+				data.resize(data.size() - 3);
+				chunk = RIFF(FOURCC("seq "), data);
+			}
+			truncated.add_chunk(chunk);
+		}
+		bytes = truncated.to_bytes();
+		provider->add_file("test.mds", std::string(bytes.begin(), bytes.end()));
+		Song truncated_song;
+		MDS_Input truncated_input(&truncated_song);
+		truncated_input.set_file_provider(provider);
+		CPPUNIT_ASSERT_THROW(truncated_input.open_file("test.mds"), InputError);
+	}
+	void test_get_input()
+	{
+		CPPUNIT_ASSERT(std::dynamic_pointer_cast<MDS_Input>(Input::get_input(song, "songs/test.mds")));
+		CPPUNIT_ASSERT(!std::dynamic_pointer_cast<MDS_Input>(Input::get_input(song, "songs/test.mml")));
+	}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(MDS_Input_Test);
@@ -16,6 +16,7 @@ class MDSDRV_Converter_Test : public CppUnit::TestFixture
 	CPPUNIT_TEST(test_loop_handling);
 	CPPUNIT_TEST(test_loop_handling_sequence_output);
 	CPPUNIT_TEST(test_sequence_optimization);
+	CPPUNIT_TEST(test_cost_model);
 	CPPUNIT_TEST(test_data_output);
 	CPPUNIT_TEST_SUITE_END();
 private:
@@ -295,6 +296,25 @@ public:
 		CPPUNIT_ASSERT_EQUAL((uint16_t)11, (uint16_t)trk.at(20)); //   r8
 		CPPUNIT_ASSERT_EQUAL((uint16_t)MDSDRV_Event::FINISH, (uint16_t)trk.at(21)); //
 	}
+	//! Test that the cost model matches the converted track size
+	void test_cost_model()
+	{
+		mml_input->read_line("A l4 o4c r8 c c r:228 c r8 c r8 c r r:5 c:228 r8");
+		mml_input->read_line("B l8 o4v5 [c d / e r]3 f q4 g g a4 'lfo 1 2' b r4 c:300");
+		auto converter = MDSDRV_Converter(*song);
+		MDSDRV_Cost_Model cost_model;
+		std::vector<Cost_Model::Event_Cost> cost_list;
+
+		for(int id = 0; id < 2; id++)
+		{
+			auto trk = converter.convert_track(converter.track_list[id]);
+			cost_model.get_track_cost(*song, song->get_track(id), cost_list);
+			unsigned int size = 1; // FINISH
+			for(auto && cost : cost_list)
+				size += cost.size;
+			CPPUNIT_ASSERT_EQUAL((unsigned int)trk.size(), size);
+		}
+	}
 	//! Test that sequence data looks sound.
 	void test_data_output()
 	{
@@ -367,9 +387,50 @@ class MDSDRV_Platform_Test : public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE(MDSDRV_Platform_Test);
 	CPPUNIT_TEST(test_export_list);
+	CPPUNIT_TEST(test_compile_command);
+	CPPUNIT_TEST(test_compile_register_command);
+	CPPUNIT_TEST(test_pcmrate_fm_channel);
 	CPPUNIT_TEST_SUITE_END();
 private:
 	MDSDRV_Platform *platform;
+
+	// Count the YM2612 key on writes in a VGM file
+	static int count_key_on(const std::vector<uint8_t>& vgm)
+	{
+		int count = 0;
+		uint32_t pos = 0x34 + (vgm[0x34] | vgm[0x35] << 8 | vgm[0x36] << 16 | vgm[0x37] << 24);
+		while(pos < vgm.size())
+		{
+			uint8_t cmd = vgm[pos];
+			if(cmd == 0x66)
+				break;
+			else if(cmd == 0x52 && vgm[pos + 1] == 0x28 && (vgm[pos + 2] & 0xf0))
+				count++;
+			if(cmd == 0x67)
+				pos += 7 + (vgm[pos + 3] | vgm[pos + 4] << 8 | vgm[pos + 5] << 16 | vgm[pos + 6] << 24);
+			else if(cmd == 0x50)
+				pos += 2;
+			else if(cmd >= 0x51 && cmd <= 0x5f)
+				pos += 3;
+			else if(cmd == 0x61)
+				pos += 3;
+			else if((cmd >= 0x62 && cmd <= 0x63) || (cmd >= 0x70 && cmd <= 0x8f))
+				pos += 1;
+			else if(cmd == 0x90 || cmd == 0x91 || cmd == 0x95)
+				pos += 5;
+			else if(cmd == 0x92)
+				pos += 6;
+			else if(cmd == 0x93)
+				pos += 11;
+			else if(cmd == 0x94)
+				pos += 2;
+			else if(cmd == 0xe0)
+				pos += 5;
+			else
+				CPPUNIT_FAIL(stringf("unknown VGM command %02x", cmd));
+		}
+		return count;
+	}
 public:
 	void setUp()
 	{
@@ -385,6 +446,40 @@ public:
 		CPPUNIT_ASSERT_EQUAL(std::string("vgm"), export_list[0].first);
 		CPPUNIT_ASSERT_EQUAL(std::string("mds"), export_list[1].first);
 	}
+	void test_compile_command()
+	{
+		Platform_Command command = platform->compile_command(Tag{"LFO", "3", "0x12"});
+		CPPUNIT_ASSERT_EQUAL((int)MDSDRV_Platform::CMD_LFO, (int)command.opcode);
+		CPPUNIT_ASSERT_EQUAL((int)3, (int)command.word_count);
+		CPPUNIT_ASSERT_EQUAL((int32_t)3, command.args[0]);
+		CPPUNIT_ASSERT_EQUAL((int32_t)0x12, command.args[1]);
+
+		command = platform->compile_command(Tag{"fm3", "0101"});
+		CPPUNIT_ASSERT_EQUAL((int)MDSDRV_Platform::CMD_FM3, (int)command.opcode);
+		CPPUNIT_ASSERT_EQUAL((int32_t)5, command.args[0]);
+
+		command = platform->compile_command(Tag{"unknown", "1"});
+		CPPUNIT_ASSERT_EQUAL((int)MDSDRV_Platform::CMD_UNKNOWN, (int)command.opcode);
+	}
+	void test_compile_register_command()
+	{
+		Platform_Command command = platform->compile_command(Tag{"tl1", "-4"});
+		CPPUNIT_ASSERT_EQUAL((int)MDSDRV_Platform::CMD_REGISTER, (int)command.opcode);
+		CPPUNIT_ASSERT(command.variant != 0);
+		CPPUNIT_ASSERT_EQUAL((int)MDSDRV_Platform::CMD_RELATIVE, (int)command.flags);
+		CPPUNIT_ASSERT_EQUAL((int32_t)-4, command.args[0]);
+
+		command = platform->compile_command(Tag{"tl1", ""});
+		CPPUNIT_ASSERT_EQUAL((int)MDSDRV_Platform::CMD_EMPTY_VALUE, (int)command.flags);
+	}
+	// 'pcmrate' must not enable PCM playback on an FM channel
+	void test_pcmrate_fm_channel()
+	{
+		Song song;
+		MML_Input mml_input(&song);
+		mml_input.read_line("A @1 o4 l8 c 'pcmrate 4' defgab>c");
+		CPPUNIT_ASSERT_EQUAL(8, count_key_on(platform->get_export_data(song, 0)));
+	}
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(MDSDRV_Converter_Test);
@@ -0,0 +1,142 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <cppunit/extensions/HelperMacros.h>
+#include "../midi_input.h"
+#include "../mml_input.h"
+#include "../song.h"
+#include "../track.h"
+
+class MIDI_Input_Test : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(MIDI_Input_Test);
+	CPPUNIT_TEST(test_notes);
+	CPPUNIT_TEST(test_tie);
+	CPPUNIT_TEST(test_channel_map);
+	CPPUNIT_TEST(test_volume_pan);
+	CPPUNIT_TEST(test_errors);
+	CPPUNIT_TEST(test_get_input);
+	CPPUNIT_TEST_SUITE_END();
+private:
+	Song *song;
+	std::shared_ptr<Memory_File_Provider> provider;
+
+	// Create a type 1 MIDI file with 96 ticks per quarter note
+	static std::string midi_file(const std::vector<std::string>& tracks, int format = 1)
+	{
+		std::string out("MThd\0\0\0\6\0\0\0\0\0\x60", 14);
+		out[9] = format;
+		out[11] = tracks.size();
+		for(auto && track : tracks)
+		{
+			out += "MTrk";
+			out += std::string{0, 0, (char)(track.size() >> 8), (char)track.size()};
+			out += track;
+		}
+		return out;
+	}
+	void parse(const std::string& data, const std::string& channel_map = MIDI_Input::DEFAULT_CHANNEL_MAP)
+	{
+		provider->add_file("test.mid", data);
+		MIDI_Input input(song, channel_map);
+		input.set_file_provider(provider);
+		input.open_file("test.mid");
+	}
+	void assert_event(Track& track, unsigned long position, Event::Type type, int16_t param, uint16_t on_time = 0, uint16_t off_time = 0)
+	{
+		const Event& event = track.get_event(position);
+		CPPUNIT_ASSERT_EQUAL(type, event.type);
+		CPPUNIT_ASSERT_EQUAL(param, event.param);
+		CPPUNIT_ASSERT_EQUAL(on_time, event.on_time);
+		CPPUNIT_ASSERT_EQUAL(off_time, event.off_time);
+	}
+public:
+	void setUp()
+	{
+		song = new Song();
+		provider = std::make_shared<Memory_File_Provider>();
+	}
+	void tearDown()
+	{
+		delete song;
+	}
+	void test_notes()
+	{
+		std::string tempo_track("\0\xff\x51\3\x07\xa1\x20\0\xff\x2f\0", 11);
+		std::string note_track(
+			"\0\xc0\5"					// program change
+			"\0\x90\x3c\x40"			// o4c
+			"\x60\x80\x3c\0"			// note off
+			"\x60\x90\x3e\x40"			// o4d after a quarter rest
+			"\x60\x3e\0"				// running status note off
+			"\0\xff\x2f\0", 22);
+		parse(midi_file({tempo_track, note_track}));
+		Track& track = song->get_track(0);
+		CPPUNIT_ASSERT_EQUAL((unsigned long)5, track.get_event_count());
+		assert_event(track, 0, Event::TEMPO_BPM, 120);
+		assert_event(track, 1, Event::INS, 5);
+		assert_event(track, 2, Event::NOTE, 36, 24, 0);
+		assert_event(track, 3, Event::REST, 0, 0, 24);
+		assert_event(track, 4, Event::NOTE, 38, 24, 0);
+	}
+	// Notes are split by other events, and end at the next note
+	void test_tie()
+	{
+		std::string note_track(
+			"\0\x90\x3c\x40"			// o4c
+			"\x30\xb0\7\x7f"			// volume
+			"\x30\x90\x3e\x40"			// o4d
+			"\x60\x80\x3c\0"			// note off for the previous note is ignored
+			"\x60\x80\x3e\0"
+			"\x60\xff\x2f\0", 24);
+		parse(midi_file({note_track}));
+		Track& track = song->get_track(0);
+		CPPUNIT_ASSERT_EQUAL((unsigned long)5, track.get_event_count());
+		assert_event(track, 0, Event::NOTE, 36, 12, 0);
+		assert_event(track, 1, Event::VOL_FINE, 0);
+		assert_event(track, 2, Event::TIE, 0, 12, 0);
+		assert_event(track, 3, Event::NOTE, 38, 48, 0);
+		assert_event(track, 4, Event::REST, 0, 0, 24);
+	}
+	// Tracks with the same channel are merged, channels not in the map are ignored
+	void test_channel_map()
+	{
+		std::string track_1("\x60\x92\x3c\x40\x60\x82\x3c\0\0\xff\x2f\0", 12);
+		std::string track_2("\0\xc2\1\0\xff\x2f\0", 7);
+		std::string track_3("\0\xc1\2\0\xff\x2f\0", 7);
+		parse(midi_file({track_1, track_2, track_3}), "A-B");
+		CPPUNIT_ASSERT_EQUAL((size_t)1, song->get_track_map().size());
+		Track& track = song->get_track(1);
+		CPPUNIT_ASSERT_EQUAL((unsigned long)3, track.get_event_count());
+		assert_event(track, 0, Event::INS, 1);
+		assert_event(track, 1, Event::REST, 0, 0, 24);
+		assert_event(track, 2, Event::NOTE, 36, 24, 0);
+	}
+	void test_volume_pan()
+	{
+		CPPUNIT_ASSERT_EQUAL(0, MIDI_Input::volume_to_mdsdrv(127));
+		CPPUNIT_ASSERT_EQUAL(16, MIDI_Input::volume_to_mdsdrv(64));
+		CPPUNIT_ASSERT_EQUAL(127, MIDI_Input::volume_to_mdsdrv(0));
+		CPPUNIT_ASSERT_EQUAL(2, MIDI_Input::pan_to_mdsdrv(0));
+		CPPUNIT_ASSERT_EQUAL(3, MIDI_Input::pan_to_mdsdrv(64));
+		CPPUNIT_ASSERT_EQUAL(1, MIDI_Input::pan_to_mdsdrv(127));
+	}
+	void test_errors()
+	{
+		std::string note_track("\0\x90\x3c\x40\x60\x80\x3c\0\0\xff\x2f\0", 12);
+		CPPUNIT_ASSERT_THROW(parse("RIFF"), InputError);
+		CPPUNIT_ASSERT_THROW(parse(midi_file({note_track}, 0)), InputError);
+		std::string file = midi_file({note_track});
+		CPPUNIT_ASSERT_THROW(parse(file.substr(0, file.size() - 3)), InputError);
+		CPPUNIT_ASSERT_THROW(parse(midi_file({std::string("\0\x3c\x40\0\xff\x2f\0", 7)})), InputError);
+	}
+	void test_get_input()
+	{
+		CPPUNIT_ASSERT(std::dynamic_pointer_cast<MIDI_Input>(Input::get_input(song, "dir/song.MID")));
+		CPPUNIT_ASSERT(std::dynamic_pointer_cast<MIDI_Input>(Input::get_input(song, "song.smf")));
+		CPPUNIT_ASSERT(std::dynamic_pointer_cast<MML_Input>(Input::get_input(song, "song.mml")));
+		CPPUNIT_ASSERT(std::dynamic_pointer_cast<MML_Input>(Input::get_input(song, "dir.mid/song")));
+	}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(MIDI_Input_Test);
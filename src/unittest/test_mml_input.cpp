@@ -1,3 +1,6 @@
+#include <cstdio>
+#include <fstream>
+#include <string>
 #include <cppunit/extensions/HelperMacros.h>
 #include "../mml_input.h"
 #include "../song.h"
@@ -22,6 +25,12 @@ class MML_Input_Test : public CppUnit::TestFixture
 	CPPUNIT_TEST(test_mml_key_signature);
 	CPPUNIT_TEST(test_mml_track_map);
 	CPPUNIT_TEST(test_mml_echo);
+	CPPUNIT_TEST(test_mml_reference);
+	CPPUNIT_TEST(test_mml_parallel);
+	CPPUNIT_TEST(test_mml_parallel_error);
+	CPPUNIT_TEST(test_mml_command_table);
+	CPPUNIT_TEST(test_mml_include);
+	CPPUNIT_TEST(test_mml_include_error);
 	CPPUNIT_TEST_SUITE_END();
 private:
 	Song *song;
@@ -290,6 +299,190 @@ public:
 		CPPUNIT_ASSERT_EQUAL((int16_t)2, song->get_track(0).get_event(21).param);
 	}
 
+	// The line contents are only looked up when requested
+	void test_mml_reference()
+	{
+		mml_input->read_line("A cd", 4);
+		mml_input->read_line("B  e", 5);
+		auto& map = song->get_source_map();
+		auto ref = map.get_reference(song->get_track(0).get_reference(1));
+		CPPUNIT_ASSERT_EQUAL((unsigned int)4, ref->get_line());
+		CPPUNIT_ASSERT_EQUAL((unsigned int)3, ref->get_column());
+		CPPUNIT_ASSERT_EQUAL(std::string("A cd"), ref->get_line_contents());
+		ref = map.get_reference(song->get_track(1).get_reference(0));
+		CPPUNIT_ASSERT_EQUAL((unsigned int)5, ref->get_line());
+		CPPUNIT_ASSERT_EQUAL((unsigned int)3, ref->get_column());
+		CPPUNIT_ASSERT_EQUAL(std::string("B  e"), ref->get_line_contents());
+	}
+
+	// A dialect that uses 'y' for volume and has no 'v' command
+	class Dialect_Input : public MML_Input
+	{
+		public:
+			Dialect_Input(Song* song)
+				: MML_Input(song)
+				, table(get_default_command_table())
+			{
+				table['y'] = table['v'];
+				table['v'] = {nullptr, Event::INVALID};
+				table['!'] = {static_cast<Command_Handler>(&Dialect_Input::cmd_double_note), Event::NOTE};
+				set_command_table(table);
+			}
+		private:
+			void cmd_double_note(int, Event::Type)
+			{
+				int note = read_note(get_token());
+				unsigned int duration = read_duration();
+				get_current_track().add_note(note, duration);
+				get_current_track().add_note(note, duration);
+			}
+			Command_Table table;
+	};
+	void test_mml_command_table()
+	{
+		Dialect_Input input(song);
+		input.read_line("A y10 !c8");
+		CPPUNIT_ASSERT_EQUAL((unsigned long)3, song->get_track(0).get_event_count());
+		CPPUNIT_ASSERT_EQUAL(Event::VOL, song->get_track(0).get_event(0).type);
+		CPPUNIT_ASSERT_EQUAL((int16_t)10, song->get_track(0).get_event(0).param);
+		CPPUNIT_ASSERT_EQUAL(Event::NOTE, song->get_track(0).get_event(2).type);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)12, song->get_track(0).get_event(2).on_time);
+		CPPUNIT_ASSERT_THROW(input.read_line("A v10"), InputError);
+	}
+	// Parse a file with the specified number of jobs
+	static void parse_file(Song& out, const char* text, unsigned int jobs)
+	{
+		const char* filename = "test_mml_input.tmp";
+		std::ofstream(filename, std::ios::binary) << text;
+		MML_Input input(&out, jobs);
+		try
+		{
+			input.open_file(filename);
+		}
+		catch(...)
+		{
+			std::remove(filename);
+			throw;
+		}
+		std::remove(filename);
+	}
+	static void assert_equal_songs(Song& expected, Song& actual)
+	{
+		CPPUNIT_ASSERT_EQUAL(expected.get_track_map().size(), actual.get_track_map().size());
+		for(auto && it : expected.get_track_map())
+		{
+			Track& a = it.second;
+			Track& b = actual.get_track(it.first);
+			CPPUNIT_ASSERT_EQUAL(a.get_event_count(), b.get_event_count());
+			for(unsigned long i = 0; i < a.get_event_count(); i++)
+			{
+				CPPUNIT_ASSERT_EQUAL(a.get_event(i).type, b.get_event(i).type);
+				CPPUNIT_ASSERT_EQUAL(a.get_event(i).param, b.get_event(i).param);
+				CPPUNIT_ASSERT_EQUAL(a.get_event(i).on_time, b.get_event(i).on_time);
+				CPPUNIT_ASSERT_EQUAL(a.get_reference(i).line, b.get_reference(i).line);
+				CPPUNIT_ASSERT_EQUAL(a.get_reference(i).column, b.get_reference(i).column);
+			}
+		}
+		int16_t param = -32768;
+		for(; expected.get_tag_map().count(Tag_Key::platform_command(param)); param++)
+			CPPUNIT_ASSERT(expected.get_platform_command(param) == actual.get_platform_command(param));
+		CPPUNIT_ASSERT(!actual.get_tag_map().count(Tag_Key::platform_command(param)));
+	}
+	static void parse_memory(Song& out, std::shared_ptr<File_Provider> provider, unsigned int jobs)
+	{
+		MML_Input input(&out, jobs);
+		input.set_file_provider(provider);
+		input.open_file("songs/main.mml");
+	}
+	// Included files are read through the file provider
+	void test_mml_include()
+	{
+		auto provider = std::make_shared<Memory_File_Provider>();
+		provider->add_file("songs/main.mml", "#include inst.mml\nA cd\n#include \"sub/part.mml\"\nB e 'y 2'");
+		provider->add_file("songs/inst.mml", "@1 1 2\nC f 'x 1'");
+		provider->add_file("songs/sub/part.mml", "D g");
+		for(unsigned int jobs = 1; jobs <= 4; jobs *= 4)
+		{
+			Song serial, parallel;
+			parse_memory(serial, provider, 1);
+			parse_memory(parallel, provider, jobs);
+			assert_equal_songs(serial, parallel);
+			CPPUNIT_ASSERT_EQUAL((unsigned long)2, parallel.get_track(0).get_event_count());
+			CPPUNIT_ASSERT_EQUAL((unsigned long)2, parallel.get_track(1).get_event_count());
+			CPPUNIT_ASSERT_EQUAL((unsigned long)2, parallel.get_track(2).get_event_count());
+			CPPUNIT_ASSERT_EQUAL((unsigned long)1, parallel.get_track(3).get_event_count());
+			CPPUNIT_ASSERT_EQUAL(std::string("2"), parallel.get_tag("@1").at(1));
+			CPPUNIT_ASSERT_EQUAL(std::string("x"), parallel.get_platform_command(-32768).at(0));
+			auto ref = parallel.get_source_map().get_reference(parallel.get_track(3).get_reference(0));
+			CPPUNIT_ASSERT_EQUAL(std::string("songs/sub/part.mml"), ref->get_filename());
+		}
+	}
+	void test_mml_include_error()
+	{
+		auto provider = std::make_shared<Memory_File_Provider>();
+		provider->add_file("songs/main.mml", "A c\n#include bad.mml\nB c");
+		provider->add_file("songs/bad.mml", "A l0");
+		for(unsigned int jobs = 1; jobs <= 4; jobs *= 4)
+		{
+			Song song;
+			try
+			{
+				parse_memory(song, provider, jobs);
+				CPPUNIT_FAIL("no error thrown");
+			}
+			catch(InputError& error)
+			{
+				CPPUNIT_ASSERT_EQUAL(std::string("songs/bad.mml"), error.get_reference()->get_filename());
+				CPPUNIT_ASSERT_EQUAL((unsigned int)0, error.get_reference()->get_line());
+			}
+		}
+		provider->add_file("songs/main.mml", "#include main.mml");
+		Song song;
+		CPPUNIT_ASSERT_THROW(parse_memory(song, provider, 1), InputError);
+		provider->add_file("songs/main.mml", "#include missing.mml");
+		CPPUNIT_ASSERT_THROW(parse_memory(song, provider, 1), InputError);
+	}
+	// Parsing with multiple jobs gives the same result
+	void test_mml_parallel()
+	{
+		const char* text =
+			"#title test\n"
+			"ABC o4 l8 'a 1' c{d/e/f}g\n"
+			"  'b 2' [ab]2\n"
+			"D cd 'c 3'\n"
+			"@1 1 2 3\n"
+			"AD >c<c\n"
+			"E {c/d\n";
+		Song serial, parallel;
+		CPPUNIT_ASSERT_THROW(parse_file(serial, text, 1), InputError);
+		CPPUNIT_ASSERT_THROW(parse_file(parallel, text, 4), InputError);
+		assert_equal_songs(serial, parallel);
+	}
+	// The first error in the file is reported
+	void test_mml_parallel_error()
+	{
+		const char* text =
+			"A cd 'x 1'\n"
+			"B cd l0\n"
+			"A l0 'y 2'\n"
+			"C cd 'z 3'\n";
+		for(unsigned int jobs = 1; jobs <= 4; jobs *= 4)
+		{
+			Song song;
+			try
+			{
+				parse_file(song, text, jobs);
+				CPPUNIT_FAIL("no error thrown");
+			}
+			catch(InputError& error)
+			{
+				CPPUNIT_ASSERT_EQUAL((unsigned int)1, error.get_reference()->get_line());
+			}
+			// Only the command before the error is registered
+			CPPUNIT_ASSERT_EQUAL(std::string("x"), song.get_platform_command(-32768).at(0));
+			CPPUNIT_ASSERT(!song.get_tag_map().count(Tag_Key::platform_command(-32767)));
+		}
+	}
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(MML_Input_Test);
@@ -0,0 +1,502 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "../mml_input.h"
+#include "../song.h"
+#include "../track.h"
+#include "../player.h"
+#include "../optimizer.h"
+
+class Optimizer_Test : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(Optimizer_Test);
+	CPPUNIT_TEST(test_suffix_array_candidates);
+	CPPUNIT_TEST(test_suffix_array_track_boundary);
+	CPPUNIT_TEST(test_stack_analyzer);
+	CPPUNIT_TEST(test_stack_analyzer_update);
+	CPPUNIT_TEST(test_find_loop_match);
+	CPPUNIT_TEST(test_find_match_loop_hierarchy);
+	CPPUNIT_TEST(test_find_subroutine_match);
+	CPPUNIT_TEST(test_byte_score);
+	CPPUNIT_TEST(test_find_transposed_match);
+	CPPUNIT_TEST(test_optimize_transposed);
+	CPPUNIT_TEST(test_optimize_play_time);
+	CPPUNIT_TEST(test_validate_pass);
+	CPPUNIT_TEST(test_read_options);
+	CPPUNIT_TEST(test_optimize_budget);
+	CPPUNIT_TEST(test_parallel_search);
+	CPPUNIT_TEST(test_match_cache);
+	CPPUNIT_TEST(test_batch);
+	CPPUNIT_TEST(test_synthesize_loops);
+	CPPUNIT_TEST_SUITE_END();
+private:
+	Song *song;
+	MML_Input *mml_input;
+public:
+	void setUp()
+	{
+		song = new Song();
+		mml_input = new MML_Input(song);
+	}
+	void tearDown()
+	{
+		delete mml_input;
+		delete song;
+	}
+	void test_suffix_array_candidates()
+	{
+		mml_input->read_line("A l8 cdefg cdefg cdef");
+		Optimizer opt(*song);
+		opt.suffix_array.build(*song);
+		std::vector<Optimizer::Suffix_Array::Candidate> candidates;
+		opt.suffix_array.find_candidates(opt.suffix_array.get_index(0, 0), 3, candidates);
+		CPPUNIT_ASSERT_EQUAL((size_t)2, candidates.size());
+		CPPUNIT_ASSERT_EQUAL((uint32_t)5, candidates[0].index);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)9, candidates[0].length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)10, candidates[1].index);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)4, candidates[1].length);
+		// only later positions are returned
+		opt.suffix_array.find_candidates(opt.suffix_array.get_index(0, 5), 3, candidates);
+		CPPUNIT_ASSERT_EQUAL((size_t)1, candidates.size());
+		CPPUNIT_ASSERT_EQUAL((uint32_t)10, candidates[0].index);
+		opt.suffix_array.find_candidates(opt.suffix_array.get_index(0, 0), 5, candidates);
+		CPPUNIT_ASSERT_EQUAL((size_t)1, candidates.size());
+	}
+	void test_suffix_array_track_boundary()
+	{
+		mml_input->read_line("A l8 cdef");
+		mml_input->read_line("B l8 cdef");
+		Optimizer opt(*song);
+		opt.suffix_array.build(*song);
+		uint32_t index = opt.suffix_array.get_index(1, 0);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)5, index);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)1, opt.suffix_array.positions[index].track_id);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)0, opt.suffix_array.positions[index].position);
+		// common prefix must stop at the track separator
+		CPPUNIT_ASSERT_EQUAL((uint32_t)4, opt.suffix_array.lcp[opt.suffix_array.rank[index]]);
+	}
+	void test_stack_analyzer()
+	{
+		mml_input->read_line("*30 l16 c");
+		mml_input->read_line("*31 l16 c");
+		mml_input->read_line("*40 l16 [c *41]2");
+		mml_input->read_line("*41 l16 o3 g");
+		mml_input->read_line("A l16 *40 D30 a *41 D0 c");
+		Optimizer opt(*song);
+		opt.analyze_stack();
+		auto& track = opt.get_stack_analyzer(0);
+		CPPUNIT_ASSERT_EQUAL((int16_t)0, track.base_usage);
+		CPPUNIT_ASSERT_EQUAL((int16_t)4, track.max_usage);
+		CPPUNIT_ASSERT(track.event_list == std::vector<int16_t>({4, 0, 1, 2, 0, 0}));
+		auto& sub = opt.get_stack_analyzer(40);
+		CPPUNIT_ASSERT_EQUAL((int16_t)1, sub.base_usage);
+		CPPUNIT_ASSERT(sub.event_list == std::vector<int16_t>({2, 2, 3, 2}));
+		// called with and without drum mode
+		auto& nested_sub = opt.get_stack_analyzer(41);
+		CPPUNIT_ASSERT_EQUAL((uint8_t)3, nested_sub.used);
+		CPPUNIT_ASSERT_EQUAL((int16_t)4, nested_sub.base_usage);
+		CPPUNIT_ASSERT_EQUAL((int16_t)1, nested_sub.max_usage);
+		// drum mode note
+		CPPUNIT_ASSERT_EQUAL((int16_t)1, opt.get_stack_analyzer(30).base_usage);
+		CPPUNIT_ASSERT_EQUAL((int16_t)2, opt.get_stack_analyzer(31).base_usage);
+	}
+	// Result after an edit must be the same as analyzing the whole song
+	void test_stack_analyzer_update()
+	{
+		const char* mml[] = {
+			"*30 l16 c",
+			"*31 l16 c",
+			"*40 l16 [c *41]2",
+			"*41 l16 o3 g",
+			"*42 l16 c",
+			"A l16 *40 D30 a *41 D0 c",
+		};
+		Song new_song;
+		MML_Input new_input(&new_song);
+		for(auto && line : mml)
+		{
+			mml_input->read_line(line);
+			new_input.read_line(line);
+		}
+		Optimizer opt(*song);
+		opt.analyze_stack();
+		CPPUNIT_ASSERT_EQUAL((int16_t)100, opt.get_stack_analyzer(42).base_usage);
+
+		for(auto && edit_song : {song, &new_song})
+		{
+			auto& track = edit_song->get_track(41);
+			track.insert_event(0, {Event::JUMP, 42, 0, 0}, 0, track.get_reference(0));
+		}
+		opt.add_edit(41, 0, 0, 1);
+		opt.analyze_stack();
+		CPPUNIT_ASSERT(opt.get_stack_analyzer(40).walked);
+		CPPUNIT_ASSERT(!opt.get_stack_analyzer(30).walked);
+
+		Optimizer new_opt(new_song);
+		new_opt.analyze_stack();
+		for(auto && track_it : new_song.get_track_map())
+		{
+			auto& expected = new_opt.get_stack_analyzer(track_it.first);
+			auto& actual = opt.get_stack_analyzer(track_it.first);
+			CPPUNIT_ASSERT_EQUAL(expected.base_usage, actual.base_usage);
+			CPPUNIT_ASSERT_EQUAL(expected.max_usage, actual.max_usage);
+			CPPUNIT_ASSERT(expected.event_list == actual.event_list);
+		}
+		CPPUNIT_ASSERT_EQUAL((int16_t)5, opt.get_stack_analyzer(42).base_usage);
+	}
+	void test_find_loop_match()
+	{
+		mml_input->read_line("A l8 cdef cdef cdef");
+		Optimizer opt(*song);
+		opt.cost_model = std::make_shared<Cost_Model>();
+		opt.analyze_stack();
+		opt.suffix_array.build(*song);
+		opt.update_cost();
+		auto match = opt.find_match(0, 0);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)4, match.loop_position);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)8, match.loop_length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)4, match.sub_length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)2, match.sub_repeats);
+		CPPUNIT_ASSERT_EQUAL((int32_t)6, match.best_score());
+	}
+	void test_find_match_loop_hierarchy()
+	{
+		mml_input->read_line("A l8 [cdef]2 cdef");
+		Optimizer opt(*song);
+		opt.cost_model = std::make_shared<Cost_Model>();
+		opt.analyze_stack();
+		opt.suffix_array.build(*song);
+		opt.update_cost();
+		auto match = opt.find_match(0, 1);
+		// can't create a loop that crosses the end of another loop
+		CPPUNIT_ASSERT_EQUAL((uint32_t)0, match.loop_length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)4, match.sub_length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)1, match.sub_repeats);
+	}
+	void test_find_subroutine_match()
+	{
+		mml_input->read_line("A l8 cdefg r");
+		mml_input->read_line("B l8 a cdefg");
+		mml_input->read_line("C l8 r cdefg");
+		Optimizer opt(*song);
+		opt.cost_model = std::make_shared<Cost_Model>();
+		opt.analyze_stack();
+		opt.suffix_array.build(*song);
+		opt.update_cost();
+		auto match = opt.find_match(0, 0);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)0, match.loop_length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)5, match.sub_length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)2, match.sub_repeats);
+		CPPUNIT_ASSERT_EQUAL((int32_t)7, match.sub_score);
+	}
+	// The platform cost model scores a match by the bytes it saves
+	void test_byte_score()
+	{
+		mml_input->read_line("A l8 cdefg a");
+		mml_input->read_line("B l8 a cdefg");
+		mml_input->read_line("C l8 b cdefg");
+		mml_input->read_line("D l8 b cdefg");
+		mml_input->read_line("E l8 b cdefg");
+		unsigned int size = song->get_platform()->get_export_data(*song, 1).size();
+		Optimizer opt(*song);
+		opt.analyze_stack();
+		opt.suffix_array.build(*song);
+		opt.update_cost();
+		auto match = opt.find_match(0, 0);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)5, match.sub_length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)4, match.sub_repeats);
+		CPPUNIT_ASSERT_EQUAL((int32_t)6, match.sub_score);
+		opt.best_match = match;
+		opt.apply_match();
+		CPPUNIT_ASSERT_EQUAL(size - 6, (unsigned int)song->get_platform()->get_export_data(*song, 1).size());
+	}
+	void test_find_transposed_match()
+	{
+		mml_input->read_line("A l8 o3 ceg>c<gece df+a>d<af+df+");
+		Optimizer opt(*song);
+		opt.cost_model = std::make_shared<Cost_Model>();
+		opt.analyze_stack();
+		opt.suffix_array.build(*song);
+		opt.interval_array.build(*song, true);
+		opt.update_cost();
+		auto match = opt.find_match(0, 0);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)0, match.sub_length);
+		opt.use_transpose = true;
+		match = opt.find_match(0, 0);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)8, match.sub_length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)1, match.sub_repeats);
+		// 8 events replaced with 3, minus the subroutine call
+		CPPUNIT_ASSERT_EQUAL((int32_t)4, match.sub_score);
+	}
+	// Transposed phrases must play the same notes after optimization
+	void test_optimize_transposed()
+	{
+		const char* mml[] = {
+			"A l8 o2 ccggaag4 ffeeddc4 ddaabba4 ggf+f+eed4 ffb-b-ccb-4 e-e-ddccb-4",
+			"B l8 o3 ggddeed4 ccc<bbaag4 >ffccddc4 <b-b-aaggf4"
+		};
+		Song transposed_song;
+		MML_Input transposed_input(&transposed_song);
+		for(auto && line : mml)
+		{
+			mml_input->read_line(line);
+			transposed_input.read_line(line);
+		}
+		auto notes = get_notes(*song);
+		Optimizer opt(*song);
+		opt.optimize();
+		Optimizer transposed_opt(transposed_song);
+		transposed_opt.transpose = true;
+		transposed_opt.optimize();
+
+		CPPUNIT_ASSERT(get_notes(transposed_song) == notes);
+		unsigned int size = song->get_platform()->get_export_data(*song, 1).size();
+		unsigned int transposed_size = transposed_song.get_platform()->get_export_data(transposed_song, 1).size();
+		CPPUNIT_ASSERT(transposed_size < size);
+	}
+	void test_optimize_play_time()
+	{
+		mml_input->read_line("A l8 cdefg cdefg cdefg cdefg r4 cdefg cdefg");
+		mml_input->read_line("B l8 L cdefg a cdefg a cdefg a");
+		auto before = Song_Validator(*song);
+		unsigned int event_count = song->get_track(0).get_event_count();
+		Optimizer opt(*song);
+		opt.optimize();
+		auto after = Song_Validator(*song);
+		CPPUNIT_ASSERT(song->get_track(0).get_event_count() < event_count);
+		for(auto && it : before.get_track_map())
+		{
+			CPPUNIT_ASSERT_EQUAL(it.second.get_play_time(), after.get_track_map().at(it.first).get_play_time());
+			CPPUNIT_ASSERT_EQUAL(it.second.get_loop_length(), after.get_track_map().at(it.first).get_loop_length());
+		}
+	}
+	// Only changed tracks and their callers are validated again
+	void test_validate_pass()
+	{
+		mml_input->read_line("*10 l8 cdef");
+		mml_input->read_line("A l8 c *10");
+		mml_input->read_line("B l8 gab");
+		Optimizer opt(*song);
+		opt.validate_pass();
+		opt.reference_time = opt.track_time;
+		CPPUNIT_ASSERT_EQUAL((unsigned int)60, opt.track_time.at(0).play_time);
+		// not reported as changed, so not validated
+		song->get_track(1).get_event(0).on_time *= 2;
+		opt.validate_pass();
+		CPPUNIT_ASSERT_EQUAL((unsigned int)36, opt.track_time.at(1).play_time);
+		// the calling track must be validated as well
+		song->get_track(10).get_event(0).on_time *= 2;
+		opt.add_edit(10, 0, 1, 1);
+		CPPUNIT_ASSERT_THROW(opt.validate_pass(), std::logic_error);
+		CPPUNIT_ASSERT_EQUAL((unsigned int)72, opt.track_time.at(0).play_time);
+	}
+	void test_read_options()
+	{
+		mml_input->read_line("#option noextpitch max_sub_stack=4 min_score=5");
+		Optimizer opt(*song);
+		CPPUNIT_ASSERT_EQUAL(4, opt.max_sub_stack);
+		CPPUNIT_ASSERT_EQUAL(6, opt.max_loop_stack);
+		CPPUNIT_ASSERT_EQUAL(5, opt.min_score);
+		CPPUNIT_ASSERT_EQUAL(5, opt.top_score);
+		opt.read_options({"max_stack_depth=3"});
+		CPPUNIT_ASSERT_EQUAL(3, opt.max_stack_depth);
+		CPPUNIT_ASSERT_THROW(opt.read_options({"min_score=x"}), InputError);
+	}
+	void test_optimize_budget()
+	{
+		const char* mml[] = {
+			"A l8 cdefg cdefg cdefg cdefg r4 cdefg cdefg",
+			"B l8 L cdefg a cdefg a cdefg a",
+			"C l16 o3 cdec cdec cdec cdec r2 cdec cdec",
+		};
+		Song full_song;
+		MML_Input full_input(&full_song);
+		for(auto && line : mml)
+		{
+			mml_input->read_line(line);
+			full_input.read_line(line);
+		}
+		Optimizer full(full_song);
+		full.min_score = 0;
+		full.optimize();
+
+		Optimizer opt(*song);
+		opt.min_score = 0;
+		opt.max_passes = 1;
+		unsigned int size = opt.get_size();
+		opt.optimize();
+		CPPUNIT_ASSERT_EQUAL(1, opt.pass);
+		CPPUNIT_ASSERT(opt.get_size() < size);
+		CPPUNIT_ASSERT(full.pass > 1);
+		CPPUNIT_ASSERT(full.get_size() < opt.get_size());
+
+		// continue until the target size is reached
+		opt.max_passes = 0;
+		opt.target_size = opt.get_size() - 1;
+		opt.optimize();
+		CPPUNIT_ASSERT(opt.get_size() <= opt.target_size);
+		CPPUNIT_ASSERT(opt.pass < full.pass);
+	}
+	// Result must not depend on the number of threads
+	void test_parallel_search()
+	{
+		const char* mml[] = {
+			"A l8 cdefg cdefg cdefg cdefg r4 cdefg cdefg",
+			"B l8 L cdefg a cdefg a cdefg a",
+			"C l16 o3 [c c c g]4 c c c g cdefg",
+			"D l16 o3 c c c g cdefg a cdefg a"
+		};
+		Song parallel_song;
+		MML_Input parallel_input(&parallel_song);
+		for(auto && line : mml)
+		{
+			mml_input->read_line(line);
+			parallel_input.read_line(line);
+		}
+		Optimizer serial_opt(*song, 0, 1);
+		serial_opt.optimize();
+		Optimizer parallel_opt(parallel_song, 0, 4);
+		parallel_opt.optimize();
+
+		CPPUNIT_ASSERT_EQUAL(serial_opt.pass, parallel_opt.pass);
+		compare_songs(*song, parallel_song);
+	}
+	// Result must be the same as if every position is scored in each pass
+	void test_match_cache()
+	{
+		const char* mml[] = {
+			"A l8 cdefg cdefg cdefg cdefg r4 cdefg cdefg",
+			"B l8 L cdefg a cdefg a [cdefg]3 a",
+			"C l16 o3 [c c c g]4 c c c g cdefg r",
+			"D l16 o3 c c c g cdefg a cdefg a c c c g c c c g",
+			"E l16 D40 a b a b c a b a b a b c a b c c",
+			"*40 o2 c",
+			"*41 o2 r",
+			"*42 o2 [c]2"
+		};
+		Song uncached_song;
+		MML_Input uncached_input(&uncached_song);
+		for(auto && line : mml)
+		{
+			mml_input->read_line(line);
+			uncached_input.read_line(line);
+		}
+		Optimizer cached_opt(*song);
+		cached_opt.optimize();
+		Optimizer uncached_opt(uncached_song);
+		uncached_opt.use_cache = false;
+		uncached_opt.optimize();
+
+		CPPUNIT_ASSERT_EQUAL(uncached_opt.pass, cached_opt.pass);
+		compare_songs(uncached_song, *song);
+	}
+	// Apply multiple matches per pass
+	void test_batch()
+	{
+		const char* mml[] = {
+			"A l8 cdefgab cdefgab cdefgab cdefgab",
+			"B l16 cdefgab cdefgab cdefgab cdefgab",
+			"C l32 cdefgab cdefgab cdefgab cdefgab",
+			"D l4 cdefgab cdefgab cdefgab cdefgab",
+		};
+		Song batch_song;
+		MML_Input batch_input(&batch_song);
+		for(auto && line : mml)
+		{
+			mml_input->read_line(line);
+			batch_input.read_line(line);
+		}
+		auto before = Song_Validator(*song);
+		Optimizer opt(*song);
+		opt.optimize();
+		Optimizer batch_opt(batch_song);
+		batch_opt.batch_size = 8;
+		batch_opt.optimize();
+		CPPUNIT_ASSERT(batch_opt.pass < opt.pass);
+
+		auto after = Song_Validator(batch_song);
+		for(auto && it : before.get_track_map())
+		{
+			CPPUNIT_ASSERT_EQUAL(it.second.get_play_time(), after.get_track_map().at(it.first).get_play_time());
+			CPPUNIT_ASSERT_EQUAL(it.second.get_loop_length(), after.get_track_map().at(it.first).get_loop_length());
+		}
+	}
+	// Nested loops and break points are scored together
+	void test_synthesize_loops()
+	{
+		mml_input->read_line("A l16 cdefcdefcdega cdefcdefcdega");
+		Song expected_song;
+		MML_Input expected_input(&expected_song);
+		expected_input.read_line("A l16 cdefcdefcdega cdefcdefcdega");
+		Optimizer opt(*song);
+		opt.min_score = 0;
+		opt.analyze_stack();
+		opt.update_cost();
+		std::vector<Optimizer::Loop> loops;
+		CPPUNIT_ASSERT(opt.find_loops(0, 0, song->get_track(0).get_event_count(), 0, 0, loops) > 0);
+		CPPUNIT_ASSERT_EQUAL((size_t)1, loops.size());
+		CPPUNIT_ASSERT_EQUAL((uint32_t)0, loops[0].position);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)13, loops[0].length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)13, loops[0].repeat_length);
+		CPPUNIT_ASSERT_EQUAL((size_t)1, loops[0].inner_loops.size());
+		CPPUNIT_ASSERT_EQUAL((uint32_t)4, loops[0].inner_loops[0].length);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)7, loops[0].inner_loops[0].repeat_length);
+
+		opt.synthesize_loops();
+		const Event::Type types[] = {
+			Event::LOOP_START, Event::LOOP_START, Event::NOTE, Event::NOTE, Event::NOTE,
+			Event::LOOP_BREAK, Event::NOTE, Event::LOOP_END, Event::NOTE, Event::NOTE, Event::LOOP_END
+		};
+		Track& track = song->get_track(0);
+		CPPUNIT_ASSERT_EQUAL(sizeof(types) / sizeof(types[0]), (size_t)track.get_event_count());
+		for(unsigned int i = 0; i < track.get_event_count(); i++)
+			CPPUNIT_ASSERT_EQUAL(types[i], track.get_event(i).type);
+		CPPUNIT_ASSERT_EQUAL((int16_t)3, track.get_event(7).param);
+		CPPUNIT_ASSERT_EQUAL((int16_t)2, track.get_event(10).param);
+		CPPUNIT_ASSERT(get_notes(expected_song) == get_notes(*song));
+	}
+	//! Records the notes played by a track, including transposition.
+	class Note_Recorder : public Player
+	{
+		public:
+			Note_Recorder(Song& song, Track& track)
+				: Player(song, track)
+			{
+			}
+			std::vector<std::pair<unsigned int, int16_t>> notes;
+		protected:
+			void write_event() override
+			{
+				if(event.type == Event::NOTE)
+					notes.push_back({play_time, (int16_t)(event.param + get_var(Event::TRANSPOSE))});
+			}
+	};
+	std::map<int, std::vector<std::pair<unsigned int, int16_t>>> get_notes(Song& song)
+	{
+		std::map<int, std::vector<std::pair<unsigned int, int16_t>>> notes;
+		for(int id = 0; id < 16; id++)
+		{
+			if(!song.get_track_map().count(id))
+				continue;
+			Note_Recorder recorder(song, song.get_track(id));
+			while(recorder.is_enabled())
+				recorder.play_tick();
+			notes[id] = recorder.notes;
+		}
+		return notes;
+	}
+	void compare_songs(Song& expected, Song& actual)
+	{
+		CPPUNIT_ASSERT_EQUAL(expected.get_track_map().size(), actual.get_track_map().size());
+		for(auto && it : expected.get_track_map())
+		{
+			Track& track = actual.get_track(it.first);
+			CPPUNIT_ASSERT_EQUAL(it.second.get_event_count(), track.get_event_count());
+			for(unsigned int i = 0; i < track.get_event_count(); i++)
+			{
+				CPPUNIT_ASSERT_EQUAL(it.second.get_event(i).type, track.get_event(i).type);
+				CPPUNIT_ASSERT_EQUAL(it.second.get_event(i).param, track.get_event(i).param);
+			}
+		}
+	}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(Optimizer_Test);
@@ -2,6 +2,7 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "../song.h"
 #include "../track.h"
+#include "../arena.h"
 
 class Song_Test : public CppUnit::TestFixture
 {
@@ -22,7 +23,16 @@ class Song_Test : public CppUnit::TestFixture
 	CPPUNIT_TEST(test_get_track_map);
 	CPPUNIT_TEST(test_set_platform_command);
 	CPPUNIT_TEST(test_get_platform_command);
+	CPPUNIT_TEST(test_get_compiled_platform_command);
+	CPPUNIT_TEST_EXCEPTION(test_get_undefined_compiled_platform_command, std::out_of_range);
 	CPPUNIT_TEST(test_get_tag_order_list);
+	CPPUNIT_TEST(test_get_option_list);
+	CPPUNIT_TEST(test_tag_map_intern);
+	CPPUNIT_TEST(test_tag_map_order);
+	CPPUNIT_TEST(test_tag_map_get_numbers);
+	CPPUNIT_TEST(test_move);
+	CPPUNIT_TEST(test_clone);
+	CPPUNIT_TEST(test_platform_registry);
 	CPPUNIT_TEST_SUITE_END();
 private:
 	Song *song;
@@ -193,6 +203,18 @@ public:
 		CPPUNIT_ASSERT_EQUAL(std::string("second"), song->get_platform_command(param2).at(0));
 		CPPUNIT_ASSERT_EQUAL(std::string("third"), song->get_platform_command(param3).at(0));
 	}
+	void test_get_compiled_platform_command()
+	{
+		int16_t param = song->register_platform_command(-1, "first 10 0x20");
+		const Platform_Command& command = song->get_compiled_platform_command(param);
+		CPPUNIT_ASSERT_EQUAL((int)3, (int)command.word_count);
+		CPPUNIT_ASSERT_EQUAL((int32_t)10, command.args[0]);
+		CPPUNIT_ASSERT_EQUAL((int32_t)0x20, command.args[1]);
+	}
+	void test_get_undefined_compiled_platform_command()
+	{
+		song->get_compiled_platform_command(5);
+	}
 	void test_get_tag_order_list()
 	{
 		song->add_tag("Tag1", "first");
@@ -204,6 +226,125 @@ public:
 		CPPUNIT_ASSERT_EQUAL(std::string("Tag3"), tag->at(1));
 		CPPUNIT_ASSERT_EQUAL(std::string("Tag2"), tag->at(2));
 	}
+	void test_get_option_list()
+	{
+		CPPUNIT_ASSERT_EQUAL((size_t)0, song->get_option_list().size());
+		song->set_tag("#option", "noextpitch  min_score=5,max_sub_stack=4");
+		Tag option_list = song->get_option_list();
+		CPPUNIT_ASSERT_EQUAL((size_t)3, option_list.size());
+		CPPUNIT_ASSERT_EQUAL(std::string("noextpitch"), option_list.at(0));
+		CPPUNIT_ASSERT_EQUAL(std::string("min_score=5"), option_list.at(1));
+		CPPUNIT_ASSERT_EQUAL(std::string("max_sub_stack=4"), option_list.at(2));
+	}
+	void test_tag_map_intern()
+	{
+		Tag_Map& map = song->get_tag_map();
+		Tag_Key key = map.intern("@12");
+		CPPUNIT_ASSERT_EQUAL((int)Tag_Key::INSTRUMENT, (int)key.family);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)12, key.id);
+		key = map.intern("@m3");
+		CPPUNIT_ASSERT_EQUAL((int)Tag_Key::MACRO, (int)key.family);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)3, key.id);
+		key = map.intern("cmd_-32768");
+		CPPUNIT_ASSERT(key == Tag_Key::platform_command(-32768));
+		CPPUNIT_ASSERT_EQUAL(std::string("cmd_-32768"), map.get_name(key));
+		// Non-canonical numbers are stored as atoms
+		key = map.intern("@012");
+		CPPUNIT_ASSERT_EQUAL((int)Tag_Key::NAMED, (int)key.family);
+		CPPUNIT_ASSERT_EQUAL(std::string("@012"), map.get_name(key));
+		CPPUNIT_ASSERT(key == map.intern("@012"));
+		CPPUNIT_ASSERT(key != map.intern("#title"));
+		// Lookup does not create atoms
+		CPPUNIT_ASSERT(!map.lookup("#composer", key));
+		CPPUNIT_ASSERT(map.lookup("#title", key));
+	}
+	void test_tag_map_order()
+	{
+		song->add_tag("@2", "psg");
+		song->add_tag("#title", "title");
+		song->add_tag("@1", "fm");
+		song->add_tag("@2", "15");
+		auto& order = song->get_tag_map().get_order();
+		CPPUNIT_ASSERT_EQUAL((size_t)4, order.size()); // includes tag_order
+		CPPUNIT_ASSERT_EQUAL(std::string("@2"), song->get_tag_map().get_name(order[1]));
+		CPPUNIT_ASSERT_EQUAL(std::string("#title"), song->get_tag_map().get_name(order[2]));
+		CPPUNIT_ASSERT_EQUAL(std::string("@1"), song->get_tag_map().get_name(order[3]));
+		CPPUNIT_ASSERT_EQUAL(std::string("15"), song->get_tag("@2").at(1));
+	}
+	void test_tag_map_get_numbers()
+	{
+		song->add_tag_list("@1", "fm 1 2 -3");
+		Tag_Map& map = song->get_tag_map();
+		Tag_Key key = map.intern("@1");
+		const std::vector<int32_t>& numbers = map.get_numbers(key);
+		CPPUNIT_ASSERT_EQUAL((size_t)4, numbers.size());
+		CPPUNIT_ASSERT_EQUAL((int32_t)0, numbers[0]);
+		CPPUNIT_ASSERT_EQUAL((int32_t)-3, numbers[3]);
+		// Writing to the tag invalidates the cache
+		song->add_tag("@1", "4");
+		CPPUNIT_ASSERT_EQUAL((size_t)5, map.get_numbers(key).size());
+		CPPUNIT_ASSERT_EQUAL((int32_t)4, map.get_numbers(key)[4]);
+		// Reading through the non-const map keeps the cache
+		map.at(key)[4] = "5";
+		map.find(key);
+		CPPUNIT_ASSERT_EQUAL((int32_t)4, map.get_numbers(key)[4]);
+		song->set_tag("@1", "6");
+		CPPUNIT_ASSERT_EQUAL((size_t)1, map.get_numbers(key).size());
+		CPPUNIT_ASSERT_EQUAL((int32_t)6, map.get_numbers(key)[0]);
+	}
+	void test_move()
+	{
+		auto arena = std::make_shared<Arena>();
+		Song original(arena);
+		original.add_tag("#title", "title");
+		original.make_track(0).add_note(3, 24);
+		const Event* events = original.get_track(0).get_events().data();
+		const Platform* platform = original.get_platform();
+		Song moved(std::move(original));
+		CPPUNIT_ASSERT_EQUAL(std::string("title"), moved.get_tag_front("#title"));
+		CPPUNIT_ASSERT_EQUAL(arena.get(), moved.get_arena());
+		CPPUNIT_ASSERT_EQUAL(platform, moved.get_platform());
+		// The event list is not copied
+		CPPUNIT_ASSERT_EQUAL(events, moved.get_track(0).get_events().data());
+		*song = std::move(moved);
+		CPPUNIT_ASSERT_EQUAL(events, song->get_track(0).get_events().data());
+	}
+	void test_clone()
+	{
+		Song original(std::make_shared<Arena>());
+		original.add_tag("#title", "title");
+		original.make_track(0).add_note(3, 24);
+		original.register_platform_command(-1, "cmd 0xf6 0x2287");
+		Song copy = original.clone();
+		CPPUNIT_ASSERT_EQUAL((Arena*)nullptr, copy.get_arena());
+		CPPUNIT_ASSERT_EQUAL(original.get_platform(), copy.get_platform());
+		CPPUNIT_ASSERT_EQUAL(std::string("title"), copy.get_tag_front("#title"));
+		CPPUNIT_ASSERT_EQUAL((int)original.get_compiled_platform_command(-32768).opcode,
+			(int)copy.get_compiled_platform_command(-32768).opcode);
+		// The copy is independent
+		copy.get_track(0).add_note(5, 24);
+		copy.set_tag("#title", "copy");
+		CPPUNIT_ASSERT_EQUAL((unsigned long)1, original.get_track(0).get_event_count());
+		CPPUNIT_ASSERT_EQUAL((unsigned long)2, copy.get_track(0).get_event_count());
+		CPPUNIT_ASSERT_EQUAL(std::string("title"), original.get_tag_front("#title"));
+	}
+	void test_platform_registry()
+	{
+		Song other;
+		CPPUNIT_ASSERT(song->get_platform() != nullptr);
+		CPPUNIT_ASSERT_EQUAL(song->get_platform(), other.get_platform());
+		CPPUNIT_ASSERT_EQUAL(song->get_platform(), Platform::get_platform("MegaDrive").get());
+		CPPUNIT_ASSERT(!Platform::get_platform("unknown"));
+
+		CPPUNIT_ASSERT_EQUAL(false, other.set_platform("mdsdrv"));
+		CPPUNIT_ASSERT_EQUAL(Platform::get_platform("mdsdrv").get(), other.get_platform());
+		CPPUNIT_ASSERT(song->get_platform() != other.get_platform());
+		CPPUNIT_ASSERT_EQUAL(true, other.set_platform("unknown"));
+		CPPUNIT_ASSERT_EQUAL(Platform::get_platform("mdsdrv").get(), other.get_platform());
+
+		// The cost model is shared as well
+		CPPUNIT_ASSERT_EQUAL(song->get_platform()->get_cost_model(), song->get_platform()->get_cost_model());
+	}
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(Song_Test);
@@ -0,0 +1,136 @@
+#include <string>
+#include <memory>
+#include <cppunit/extensions/HelperMacros.h>
+#include "../song_cache.h"
+#include "../mml_input.h"
+#include "../song.h"
+#include "../track.h"
+#include "../riff.h"
+#include "../platform/mdsdrv.h"
+
+class Song_Cache_Test : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(Song_Cache_Test);
+	CPPUNIT_TEST(test_round_trip);
+	CPPUNIT_TEST(test_dependencies);
+	CPPUNIT_TEST(test_invalid_data);
+	CPPUNIT_TEST(test_load);
+	CPPUNIT_TEST_SUITE_END();
+private:
+	std::shared_ptr<Memory_File_Provider> provider;
+
+	// Parse songs/main.mml and return the dependencies
+	std::vector<Song_Cache::Dependency> parse(Song& song)
+	{
+		auto recorder = std::make_shared<Recording_File_Provider>(provider);
+		MML_Input input(&song);
+		input.set_file_provider(recorder);
+		input.open_file("songs/main.mml");
+		return recorder->get_dependencies();
+	}
+public:
+	void setUp()
+	{
+		provider = std::make_shared<Memory_File_Provider>();
+		provider->add_file("songs/main.mml",
+			"#title Test\n#platform mdsdrv\n#include inst.mml\n"
+			"A l8 v12 o4 [cde]2 'cmd 0xf6 0x2287' ^ r\n"
+			"*10 'cmd 0xf6 0x1234' g4");
+		provider->add_file("songs/inst.mml", "B o3 c2 *10 'cmd 0xf6 0x2287'");
+	}
+	void tearDown()
+	{
+	}
+	void test_round_trip()
+	{
+		Song song, cached;
+		auto dependencies = parse(song);
+		CPPUNIT_ASSERT_EQUAL((size_t)2, dependencies.size());
+		CPPUNIT_ASSERT_EQUAL(std::string("songs/main.mml"), dependencies[0].filename);
+		CPPUNIT_ASSERT_EQUAL(std::string("songs/inst.mml"), dependencies[1].filename);
+		std::string data = Song_Cache::write(song, dependencies);
+		CPPUNIT_ASSERT(Song_Cache::read(cached, data, "songs/main.mml", *provider));
+
+		CPPUNIT_ASSERT_EQUAL(song.get_ppqn(), cached.get_ppqn());
+		CPPUNIT_ASSERT(song.get_tag_map().get_order().size() == cached.get_tag_map().get_order().size());
+		CPPUNIT_ASSERT(song.get_tag_order_list() == cached.get_tag_order_list());
+		CPPUNIT_ASSERT_EQUAL(std::string("Test"), cached.get_tag_front("#title"));
+		CPPUNIT_ASSERT(song.get_tag("include_path") == cached.get_tag("include_path"));
+		CPPUNIT_ASSERT_EQUAL(song.get_track_map().size(), cached.get_track_map().size());
+		for(auto && it : song.get_track_map())
+		{
+			Track& a = it.second;
+			Track& b = cached.get_track(it.first);
+			CPPUNIT_ASSERT_EQUAL(a.get_event_count(), b.get_event_count());
+			for(unsigned long i = 0; i < a.get_event_count(); i++)
+			{
+				CPPUNIT_ASSERT_EQUAL(a.get_event(i).type, b.get_event(i).type);
+				CPPUNIT_ASSERT_EQUAL(a.get_event(i).param, b.get_event(i).param);
+				CPPUNIT_ASSERT_EQUAL(a.get_event(i).on_time, b.get_event(i).on_time);
+				CPPUNIT_ASSERT_EQUAL(a.get_event(i).off_time, b.get_event(i).off_time);
+				auto ref_a = song.get_source_map().get_reference(a.get_reference(i));
+				auto ref_b = cached.get_source_map().get_reference(b.get_reference(i));
+				CPPUNIT_ASSERT_EQUAL(ref_a->get_filename(), ref_b->get_filename());
+				CPPUNIT_ASSERT_EQUAL(ref_a->get_line(), ref_b->get_line());
+				CPPUNIT_ASSERT_EQUAL(ref_a->get_column(), ref_b->get_column());
+				CPPUNIT_ASSERT_EQUAL(ref_a->get_line_contents(), ref_b->get_line_contents());
+			}
+		}
+		for(int16_t param = -32768; param < -32765; param++)
+		{
+			CPPUNIT_ASSERT(song.get_platform_command(param) == cached.get_platform_command(param));
+			CPPUNIT_ASSERT_EQUAL(song.get_compiled_platform_command(param).opcode,
+				cached.get_compiled_platform_command(param).opcode);
+		}
+		CPPUNIT_ASSERT_THROW(cached.get_compiled_platform_command(-32765), std::out_of_range);
+
+		// New platform commands continue from the same id
+		CPPUNIT_ASSERT_EQUAL(song.register_platform_command(-1, "x"), cached.register_platform_command(-1, "x"));
+
+		// Same output
+		Song reference;
+		parse(reference);
+		CPPUNIT_ASSERT(MDSDRV_Converter(reference).get_mds().to_bytes() == MDSDRV_Converter(cached).get_mds().to_bytes());
+	}
+	// The cache is only loaded if all files are unchanged
+	void test_dependencies()
+	{
+		Song song;
+		std::string data = Song_Cache::write(song, parse(song));
+		Song cached;
+		CPPUNIT_ASSERT(!Song_Cache::read(cached, data, "songs/other.mml", *provider));
+		provider->add_file("songs/inst.mml", "B o3 c2 *10 'cmd 0xf6 0x1234'");
+		CPPUNIT_ASSERT(!Song_Cache::read(cached, data, "songs/main.mml", *provider));
+		CPPUNIT_ASSERT_EQUAL((size_t)0, cached.get_track_map().size());
+		CPPUNIT_ASSERT_EQUAL((size_t)0, cached.get_tag_map().size());
+	}
+	void test_invalid_data()
+	{
+		Song song;
+		std::string data = Song_Cache::write(song, parse(song));
+		Song cached;
+		CPPUNIT_ASSERT(!Song_Cache::read(cached, "", "songs/main.mml", *provider));
+		CPPUNIT_ASSERT(!Song_Cache::read(cached, data.substr(0, data.size() - 1), "songs/main.mml", *provider));
+		data[data.size() / 2] ^= 1;
+		CPPUNIT_ASSERT(!Song_Cache::read(cached, data, "songs/main.mml", *provider));
+		data[data.size() / 2] ^= 1;
+		data[4] ^= 1; // version
+		CPPUNIT_ASSERT(!Song_Cache::read(cached, data, "songs/main.mml", *provider));
+		CPPUNIT_ASSERT_EQUAL((size_t)0, cached.get_track_map().size());
+	}
+	void test_load()
+	{
+		Song song;
+		auto dependencies = parse(song);
+		Song_Cache cache("cache");
+		cache.set_file_provider(provider);
+		Song cached;
+		CPPUNIT_ASSERT(!cache.load(cached, "songs/main.mml"));
+		provider->add_file(cache.get_cache_filename("songs/main.mml"), Song_Cache::write(song, dependencies));
+		CPPUNIT_ASSERT(cache.load(cached, "songs/main.mml"));
+		CPPUNIT_ASSERT_EQUAL(song.get_track_map().size(), cached.get_track_map().size());
+		CPPUNIT_ASSERT(cache.get_cache_filename("songs/main.mml") != cache.get_cache_filename("songs/inst.mml"));
+	}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(Song_Cache_Test);
@@ -25,6 +25,8 @@ class Track_Test : public CppUnit::TestFixture
 	CPPUNIT_TEST(test_get_event_count);
 	CPPUNIT_TEST(test_key_signature);
 	CPPUNIT_TEST(test_shuffle);
+	CPPUNIT_TEST(test_edit_events);
+	CPPUNIT_TEST(test_track_map);
 	CPPUNIT_TEST_SUITE_END();
 private:
 	Track *track;
@@ -41,7 +43,7 @@ public:
 	void test_add_notes()
 	{
 		int i;
-		std::vector<Event>::iterator it;
+		Track::Event_List::const_iterator it;
 		for(i=0; i<10; i++)
 			track->add_note(i, 24);
 		for(i=0, it = track->get_events().begin();
@@ -328,6 +330,74 @@ public:
 		track->add_tie(24);
 		CPPUNIT_ASSERT_EQUAL((uint16_t)48, track->get_event(4).on_time);
 	}
+	// Play times and references follow the events
+	void test_edit_events()
+	{
+		CPPUNIT_ASSERT_EQUAL((size_t)8, sizeof(Event));
+		track->set_reference({1, 0});
+		track->add_note(0, 24);
+		track->set_reference({2, 0});
+		track->add_note(2, 24);
+		track->set_play_time(1, 24);
+		track->insert_event(1, {Event::SLUR, 0, 0, 0}, 20, {3, 5});
+		CPPUNIT_ASSERT_EQUAL(Event::SLUR, track->get_event(1).type);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)20, track->get_play_time(1));
+		CPPUNIT_ASSERT_EQUAL((uint32_t)5, track->get_reference(1).column);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)24, track->get_play_time(2));
+		CPPUNIT_ASSERT_EQUAL((uint32_t)2, track->get_reference(2).line);
+
+		Track copy;
+		copy.insert_events(0, *track, 1, 2);
+		CPPUNIT_ASSERT_EQUAL((unsigned long)2, copy.get_event_count());
+		CPPUNIT_ASSERT_EQUAL((uint32_t)3, copy.get_reference(0).line);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)24, copy.get_play_time(1));
+
+		track->erase_events(0, 2);
+		CPPUNIT_ASSERT_EQUAL((unsigned long)1, track->get_event_count());
+		CPPUNIT_ASSERT_EQUAL((int16_t)62, track->get_event(0).param);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)24, track->get_play_time(0));
+		CPPUNIT_ASSERT_EQUAL((uint32_t)2, track->get_reference(0).line);
+	}
+	// Iteration is ordered and references are stable
+	void test_track_map()
+	{
+		Track_Map map;
+		CPPUNIT_ASSERT(map.begin() == map.end());
+		Track& first = map[15000];
+		map[3].add_note(0);
+		map.emplace(40, Track());
+		CPPUNIT_ASSERT(!map.emplace(3, Track()).second);
+		CPPUNIT_ASSERT_EQUAL((unsigned long)1, map.at(3).get_event_count());
+		CPPUNIT_ASSERT_EQUAL(&first, &map.at(15000));
+		CPPUNIT_ASSERT_EQUAL((Track_Map::size_type)3, map.size());
+		CPPUNIT_ASSERT_EQUAL((Track_Map::size_type)0, map.count(4));
+		CPPUNIT_ASSERT_THROW(map.at(4), std::out_of_range);
+		CPPUNIT_ASSERT(map.find(4) == map.end());
+		CPPUNIT_ASSERT_EQUAL((uint16_t)15000, map.rbegin()->first);
+
+		// tracks added while iterating are visited if their ID is higher
+		std::vector<uint16_t> ids;
+		for(auto && it : map)
+		{
+			ids.push_back(it.first);
+			if(it.first == 3)
+			{
+				map[1];
+				map[20];
+			}
+		}
+		CPPUNIT_ASSERT_EQUAL((size_t)4, ids.size());
+		CPPUNIT_ASSERT_EQUAL((uint16_t)3, ids[0]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)20, ids[1]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)40, ids[2]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)15000, ids[3]);
+
+		Track_Map copy = map;
+		CPPUNIT_ASSERT_EQUAL((Track_Map::size_type)1, map.erase(3));
+		CPPUNIT_ASSERT_EQUAL((Track_Map::size_type)4, map.size());
+		CPPUNIT_ASSERT_EQUAL((unsigned long)1, copy.at(3).get_event_count());
+		CPPUNIT_ASSERT_EQUAL((uint16_t)1, copy.begin()->first);
+	}
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(Track_Test);
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <cctype>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -214,6 +215,12 @@ void Wave_Bank::set_include_paths(const Tag& tag)
 }
 
 //! Convert and add sample to the waverom.
+/*!
+ *  The first word of the tag is the file name of the sample. It can also
+ *  be `data:` followed by the encoded sample data in hexadecimal, for
+ *  samples that have already been converted. The sample rate must then
+ *  be set with the `rate` parameter.
+ */
 unsigned int Wave_Bank::add_sample(const Tag& tag)
 {
 	int status = -1;
@@ -223,32 +230,57 @@ unsigned int Wave_Bank::add_sample(const Tag& tag)
 		throw InputError(nullptr, error_message.c_str());
 	}
 	std::string filename = tag[0];
-	Wave_File wf;
-	for(auto&& i : include_paths)
+	std::vector<uint8_t> sample;
+	Wave_Bank::Sample header = {0, 0, 0, 0, 0, 0, 0, 0};
+	if(filename.compare(0, 5, "data:") == 0)
 	{
-		std::string fn = i + filename;
-		//std::cout << "attempt to load " << fn << "\n";
-		status = wf.read(fn);
-		if(status == 0)
-			break;
+		if((filename.size() - 5) & 1)
+		{
+			error_message = "Odd number of digits in sample data";
+			throw InputError(nullptr, error_message.c_str());
+		}
+		for(size_t i = 5; i < filename.size(); i += 2)
+		{
+			char* end;
+			std::string digits = filename.substr(i, 2);
+			sample.push_back(std::strtoul(digits.c_str(), &end, 16));
+			if(*end || !std::isxdigit(digits[0]))
+			{
+				error_message = "Invalid sample data";
+				throw InputError(nullptr, error_message.c_str());
+			}
+		}
+		header.size = sample.size();
 	}
-	if(status)
+	else
 	{
-		error_message = filename + " not found";
-		throw InputError(nullptr, error_message.c_str());
-	}
+		Wave_File wf;
+		for(auto&& i : include_paths)
+		{
+			std::string fn = i + filename;
+			//std::cout << "attempt to load " << fn << "\n";
+			status = wf.read(fn);
+			if(status == 0)
+				break;
+		}
+		if(status)
+		{
+			error_message = filename + " not found";
+			throw InputError(nullptr, error_message.c_str());
+		}
 
-	// convert sample
-	std::vector<uint8_t> sample = encode_sample("", wf.data[0]);
-	Wave_Bank::Sample header = {
-		0,
-		0,
-		wf.slength,
-		wf.lstart,
-		wf.lend,
-		wf.srate,
-		wf.transpose,
-		0};
+		// convert sample
+		sample = encode_sample("", wf.data[0]);
+		header = {
+			0,
+			0,
+			wf.slength,
+			wf.lstart,
+			wf.lend,
+			wf.srate,
+			wf.transpose,
+			0};
+	}
 
 	// Allow overriding the sample rate and setting start offset
 	int i = 1;
@@ -268,6 +300,11 @@ unsigned int Wave_Bank::add_sample(const Tag& tag)
 		}
 		i++;
 	}
+	if(!header.rate && filename.compare(0, 5, "data:") == 0)
+	{
+		error_message = "Sample rate is not set";
+		throw InputError(nullptr, error_message.c_str());
+	}
 
 	return add_sample(header, sample);
 };